@@ -0,0 +1,145 @@
+//
+// ascii_case.hpp
+// ~~~~~~~~~~~~~~
+//
+
+#ifndef ASCII_CASE_HPP
+#define ASCII_CASE_HPP
+
+#include <cstddef>
+
+// The vector kernels need SSE2 as a baseline, which every x86-64 target has
+// but a 32-bit build only when it is compiled for it (-msse2, /arch:SSE2);
+// other 32-bit builds use the scalar loop.
+#if defined(__GNUC__) && defined(__SSE2__) \
+  && (defined(__x86_64__) || defined(__i386__))
+# define ASCII_CASE_HAS_X86_KERNELS 1
+# include <immintrin.h>
+# define ASCII_CASE_TARGET_AVX2 __attribute__((target("avx2")))
+#elif defined(_MSC_VER) \
+  && (defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+# define ASCII_CASE_HAS_X86_KERNELS 1
+# include <immintrin.h>
+# include <intrin.h>
+# define ASCII_CASE_TARGET_AVX2
+#endif
+
+// In-place ASCII case conversion for text stages. Only the letters a-z and A-Z
+// change; every other byte, including UTF-8 sequences, is left as it is, and
+// the current locale plays no part. to_upper and to_lower pick the widest
+// kernel the CPU supports the first time they are called: AVX2, then SSE2,
+// then, for builds without SSE2, a portable scalar loop.
+namespace ascii {
+
+typedef void (*case_kernel)(char* data, std::size_t size);
+
+namespace detail {
+
+// Flip the case bit of every byte in [Lo, Hi].
+template <char Lo, char Hi>
+inline void convert_scalar(char* data, std::size_t size)
+{
+  for (std::size_t i = 0; i < size; ++i)
+  {
+    unsigned char c = static_cast<unsigned char>(data[i]);
+    unsigned char in_range = static_cast<unsigned char>(c - Lo) <= Hi - Lo;
+    data[i] = static_cast<char>(c ^ (in_range << 5));
+  }
+}
+
+#if defined(ASCII_CASE_HAS_X86_KERNELS)
+
+// Bytes are compared as signed values, so anything at or above 0x80 is
+// negative and falls outside the range.
+template <char Lo, char Hi>
+inline void convert_sse2(char* data, std::size_t size)
+{
+  const __m128i lo = _mm_set1_epi8(Lo - 1);
+  const __m128i hi = _mm_set1_epi8(Hi + 1);
+  const __m128i bit = _mm_set1_epi8(0x20);
+
+  std::size_t i = 0;
+  for (; i + 16 <= size; i += 16)
+  {
+    __m128i* p = reinterpret_cast<__m128i*>(data + i);
+    __m128i v = _mm_loadu_si128(p);
+    __m128i in_range = _mm_and_si128(
+        _mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+    _mm_storeu_si128(p, _mm_xor_si128(v, _mm_and_si128(in_range, bit)));
+  }
+  convert_scalar<Lo, Hi>(data + i, size - i);
+}
+
+template <char Lo, char Hi>
+ASCII_CASE_TARGET_AVX2
+inline void convert_avx2(char* data, std::size_t size)
+{
+  const __m256i lo = _mm256_set1_epi8(Lo - 1);
+  const __m256i hi = _mm256_set1_epi8(Hi + 1);
+  const __m256i bit = _mm256_set1_epi8(0x20);
+
+  std::size_t i = 0;
+  for (; i + 32 <= size; i += 32)
+  {
+    __m256i* p = reinterpret_cast<__m256i*>(data + i);
+    __m256i v = _mm256_loadu_si256(p);
+    __m256i in_range = _mm256_and_si256(
+        _mm256_cmpgt_epi8(v, lo), _mm256_cmpgt_epi8(hi, v));
+    _mm256_storeu_si256(p, _mm256_xor_si256(v, _mm256_and_si256(in_range, bit)));
+  }
+  convert_sse2<Lo, Hi>(data + i, size - i);
+}
+
+inline bool cpu_has_avx2()
+{
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7)
+    return false;
+  __cpuid(info, 1);
+  bool osxsave = (info[2] & (1 << 27)) != 0;
+  bool avx = (info[2] & (1 << 28)) != 0;
+  if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+    return false;
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+#else // defined(_MSC_VER)
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") != 0;
+#endif // defined(_MSC_VER)
+}
+
+#endif // defined(ASCII_CASE_HAS_X86_KERNELS)
+
+template <char Lo, char Hi>
+inline case_kernel select_kernel()
+{
+#if defined(ASCII_CASE_HAS_X86_KERNELS)
+  if (cpu_has_avx2())
+    return &convert_avx2<Lo, Hi>;
+  return &convert_sse2<Lo, Hi>;
+#else // defined(ASCII_CASE_HAS_X86_KERNELS)
+  return &convert_scalar<Lo, Hi>;
+#endif // defined(ASCII_CASE_HAS_X86_KERNELS)
+}
+
+} // namespace detail
+
+// Convert a-z to A-Z in place.
+inline void to_upper(char* data, std::size_t size)
+{
+  static const case_kernel kernel = detail::select_kernel<'a', 'z'>();
+  kernel(data, size);
+}
+
+// Convert A-Z to a-z in place.
+inline void to_lower(char* data, std::size_t size)
+{
+  static const case_kernel kernel = detail::select_kernel<'A', 'Z'>();
+  kernel(data, size);
+}
+
+} // namespace ascii
+
+#endif // ASCII_CASE_HPP
@@ -2,62 +2,235 @@
 #include <gtest/gtest.h>
 
 #include <boost/asio.hpp>
+#include <boost/utility/string_view.hpp>
 
+#if !defined(BOOST_ASIO_WINDOWS)
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#else // !defined(BOOST_ASIO_WINDOWS)
+#include <io.h>
+#endif // !defined(BOOST_ASIO_WINDOWS)
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
 #include <queue>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 #include <string>
 #include <iostream>
 #include <functional>
+#include <fstream>
 #include <future>
+#include <stdexcept>
+
+#include "ascii_case.hpp"
 
-// An executor that launches a new thread for each function submitted to it.
-// This class satisfies the Executor requirements.
+// An executor that runs each function submitted to it on a thread of its own.
+// Threads are cached: a thread that has finished its function parks and is
+// reused for the next one, so only the first functions pay for thread
+// creation. The threads belong to an execution context, by default the system
+// executor's. This class satisfies the Executor requirements.
 class thread_executor
 {
 private:
-    // Service to track all threads started through a thread_executor.
-    class thread_bag : public boost::asio::execution_context::service
+    // Service owning the threads started through a thread_executor.
+    class thread_cache : public boost::asio::execution_context::service
     {
     public:
-        typedef thread_bag key_type;
+        typedef thread_cache key_type;
+
+        explicit thread_cache(boost::asio::execution_context& ctx)
+            : boost::asio::execution_context::service(ctx),
+            max_threads_(std::max(64u, 4 * std::thread::hardware_concurrency()))
+        {
+        }
+
+        // Run f on a parked thread if there is one, otherwise on a new thread
+        // while fewer than max_threads exist. Beyond that f waits until a
+        // thread finishes its current function.
+        template <class Func>
+        void post(Func f)
+        {
+            std::unique_ptr<function_base> fn(new function<Func>(std::move(f)));
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            queue_.push_back(std::move(fn));
+            if (queue_.size() <= idle_)
+                condition_.notify_one();
+            else if (threads_.size() < max_threads_)
+                threads_.emplace_back([this] { run(); });
+        }
+
+        void work_started()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            ++work_;
+        }
+
+        void work_finished()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (--work_ == 0)
+                work_condition_.notify_all();
+        }
+
+        void set_max_threads(std::size_t n)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            max_threads_ = std::max<std::size_t>(n, 1);
+        }
 
-        explicit thread_bag(boost::asio::execution_context& ctx)
-            : boost::asio::execution_context::service(ctx)
+        std::size_t thread_count()
         {
+            std::unique_lock<std::mutex> lock(mutex_);
+            return threads_.size();
         }
 
-        void add_thread(std::thread&& t)
+        std::size_t outstanding_work()
         {
             std::unique_lock<std::mutex> lock(mutex_);
-            threads_.push_back(std::move(t));
+            return work_;
         }
 
     private:
+        // Type-erased wrapper so that move-only functions can be queued.
+        struct function_base
+        {
+            virtual ~function_base() {}
+            virtual void call() = 0;
+        };
+
+        template <class Func>
+        struct function : function_base
+        {
+            explicit function(Func f) : f_(std::move(f)) {}
+            void call() { f_(); }
+            Func f_;
+        };
+
+        void run()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            for (;;)
+            {
+                while (queue_.empty() && !stopped_)
+                {
+                    ++idle_;
+                    condition_.wait(lock);
+                    --idle_;
+                }
+                if (queue_.empty())
+                    return;
+
+                std::unique_ptr<function_base> fn(std::move(queue_.front()));
+                queue_.pop_front();
+                lock.unlock();
+                fn->call();
+                fn.reset();
+                lock.lock();
+            }
+        }
+
+        // As with io_context::run(), wait for outstanding work to finish, then
+        // let the threads drain the queue and join them.
         virtual void shutdown()
         {
-            for (auto& t : threads_)
-                t.join();
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (work_ != 0)
+                work_condition_.wait(lock);
+            stopped_ = true;
+            condition_.notify_all();
+
+            // The functions still queued may post more and start new threads,
+            // so keep joining until no thread is left.
+            while (!threads_.empty())
+            {
+                std::vector<std::thread> threads;
+                threads.swap(threads_);
+                lock.unlock();
+                for (auto& t : threads)
+                    t.join();
+                lock.lock();
+            }
         }
 
         std::mutex mutex_;
+        std::condition_variable condition_;
+        std::condition_variable work_condition_;
+        std::deque<std::unique_ptr<function_base>> queue_;
         std::vector<std::thread> threads_;
+        std::size_t idle_ = 0;
+        std::size_t work_ = 0;
+        std::size_t max_threads_;
+        bool stopped_ = false;
     };
 
+    thread_cache& cache() const
+    {
+        return boost::asio::use_service<thread_cache>(context());
+    }
+
+    boost::asio::execution_context* context_;
+
 public:
+    thread_executor() noexcept
+        : context_(&boost::asio::system_executor().context())
+    {
+    }
+
+    explicit thread_executor(boost::asio::execution_context& context) noexcept
+        : context_(&context)
+    {
+    }
+
     boost::asio::execution_context& context() const noexcept
     {
-        return boost::asio::system_executor().context();
+        return *context_;
     }
 
     void on_work_started() const noexcept
     {
-        // This executor doesn't count work.
+        cache().work_started();
     }
 
     void on_work_finished() const noexcept
     {
-        // This executor doesn't count work.
+        cache().work_finished();
+    }
+
+    // Cap the number of threads. Every stage of a pipeline blocks a thread
+    // for as long as it runs, so the cap must cover the longest pipeline.
+    void set_max_threads(std::size_t n) const
+    {
+        cache().set_max_threads(n);
+    }
+
+    // Number of threads started so far, parked or busy.
+    std::size_t thread_count() const
+    {
+        return cache().thread_count();
+    }
+
+    // Work counted through on_work_started() and not yet finished.
+    std::size_t outstanding_work() const
+    {
+        return cache().outstanding_work();
     }
 
     template <class Func, class Alloc>
@@ -69,8 +242,7 @@ public:
     template <class Func, class Alloc>
     void post(Func f, const Alloc&) const
     {
-        thread_bag& bag = boost::asio::use_service<thread_bag>(context());
-        bag.add_thread(std::thread(std::move(f)));
+        cache().post(std::move(f));
     }
 
     template <class Func, class Alloc>
@@ -79,205 +251,2718 @@ public:
         post(std::forward<Func>(f), a);
     }
 
-    friend bool operator==(const thread_executor&,
-        const thread_executor&) noexcept
+    friend bool operator==(const thread_executor& a,
+        const thread_executor& b) noexcept
     {
-        return true;
+        return a.context_ == b.context_;
     }
 
-    friend bool operator!=(const thread_executor&,
-        const thread_executor&) noexcept
+    friend bool operator!=(const thread_executor& a,
+        const thread_executor& b) noexcept
     {
-        return false;
+        return a.context_ != b.context_;
     }
 };
 
-// Base class for all thread-safe queue implementations.
-class queue_impl_base
+// Double-ended queue of tasks for work stealing, after Chase and Lev ("Dynamic
+// Circular Work-Stealing Deque") with the memory orderings of Le et al.
+// ("Correct and Efficient Work-Stealing for Weak Memory Models"). The owning
+// worker pushes and takes at the bottom without locking; other workers steal
+// from the top with a single compare-and-swap. The array grows when full and
+// retired arrays are kept until the deque is destroyed, since a thief may
+// still be reading one.
+template <class Task>
+class chase_lev_deque
 {
-    template <class> friend class queue_front;
-    template <class> friend class queue_back;
-    std::mutex mutex_;
-    std::condition_variable condition_;
-    bool stop_ = false;
-};
+public:
+    explicit chase_lev_deque(std::size_t capacity = 256)
+        : top_(0), bottom_(0), array_(new ring(capacity))
+    {
+    }
 
-// Underlying implementation of a thread-safe queue, shared between the
-// queue_front and queue_back classes.
-template <class T>
-class queue_impl : public queue_impl_base
-{
-    template <class> friend class queue_front;
-    template <class> friend class queue_back;
-    std::queue<T> queue_;
-};
+    chase_lev_deque(const chase_lev_deque&) = delete;
+    chase_lev_deque& operator=(const chase_lev_deque&) = delete;
 
-// The front end of a queue between consecutive pipeline stages.
-template <class T>
-class queue_front
-{
-public:
-    typedef T value_type;
+    ~chase_lev_deque()
+    {
+        delete array_.load();
+        for (ring* r : retired_)
+            delete r;
+    }
 
-    explicit queue_front(std::shared_ptr<queue_impl<T>> impl)
-        : impl_(impl)
+    // Owner only.
+    void push(Task* task)
     {
+        std::int64_t b = bottom_.load(std::memory_order_relaxed);
+        std::int64_t t = top_.load(std::memory_order_acquire);
+        ring* a = array_.load(std::memory_order_relaxed);
+        if (b - t > static_cast<std::int64_t>(a->mask))
+        {
+            retired_.push_back(a);
+            a = a->grow(b, t);
+            array_.store(a, std::memory_order_release);
+        }
+        a->put(b, task);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom_.store(b + 1, std::memory_order_relaxed);
     }
 
-    void push(T t)
+    // Owner only. Returns the most recently pushed task, or null.
+    Task* take()
     {
-        std::unique_lock<std::mutex> lock(impl_->mutex_);
-        impl_->queue_.push(std::move(t));
-        impl_->condition_.notify_one();
+        std::int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+        ring* a = array_.load(std::memory_order_relaxed);
+        bottom_.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t t = top_.load(std::memory_order_relaxed);
+
+        Task* task = nullptr;
+        if (t <= b)
+        {
+            task = a->get(b);
+            if (t == b)
+            {
+                // Last task: race any thief for it.
+                if (!top_.compare_exchange_strong(t, t + 1,
+                    std::memory_order_seq_cst, std::memory_order_relaxed))
+                {
+                    task = nullptr;
+                }
+                bottom_.store(b + 1, std::memory_order_relaxed);
+            }
+        }
+        else
+        {
+            bottom_.store(b + 1, std::memory_order_relaxed);
+        }
+        return task;
     }
 
-    void stop()
+    // Any thread. Returns the oldest task, or null if the deque is empty or
+    // the steal lost a race.
+    Task* steal()
     {
-        std::unique_lock<std::mutex> lock(impl_->mutex_);
-        impl_->stop_ = true;
-        impl_->condition_.notify_one();
+        std::int64_t t = top_.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t b = bottom_.load(std::memory_order_acquire);
+        if (t >= b)
+            return nullptr;
+
+        ring* a = array_.load(std::memory_order_acquire);
+        Task* task = a->get(t);
+        if (!top_.compare_exchange_strong(t, t + 1,
+            std::memory_order_seq_cst, std::memory_order_relaxed))
+        {
+            return nullptr;
+        }
+        return task;
     }
 
 private:
-    std::shared_ptr<queue_impl<T>> impl_;
+    struct ring
+    {
+        explicit ring(std::size_t capacity)
+            : mask(capacity - 1), items(new std::atomic<Task*>[capacity])
+        {
+        }
+
+        Task* get(std::int64_t i) const
+        {
+            return items[i & mask].load(std::memory_order_relaxed);
+        }
+
+        void put(std::int64_t i, Task* task)
+        {
+            items[i & mask].store(task, std::memory_order_relaxed);
+        }
+
+        ring* grow(std::int64_t bottom, std::int64_t top) const
+        {
+            ring* r = new ring(2 * (mask + 1));
+            for (std::int64_t i = top; i < bottom; ++i)
+                r->put(i, get(i));
+            return r;
+        }
+
+        std::size_t mask;
+        std::unique_ptr<std::atomic<Task*>[]> items;
+    };
+
+    enum { cache_line_size = 64 };
+
+    std::atomic<std::int64_t> top_;
+    char pad_[cache_line_size];
+    std::atomic<std::int64_t> bottom_;
+    std::atomic<ring*> array_;
+    std::vector<ring*> retired_;
 };
 
-// The back end of a queue between consecutive pipeline stages.
-template <class T>
-class queue_back
+// A pool of worker threads that balances load by work stealing. Every worker
+// owns a chase_lev_deque: functions posted from a worker go onto its own deque
+// and are taken back newest first, while idle workers steal the oldest tasks
+// from the other deques. Functions posted from outside the pool go through a
+// shared injection queue. Its executor satisfies the Executor requirements, so
+// stages can be bound to the pool with bind_executor.
+class work_stealing_pool : public boost::asio::execution_context
 {
 public:
-    typedef T value_type;
+    class executor_type;
 
-    explicit queue_back(std::shared_ptr<queue_impl<T>> impl)
-        : impl_(impl)
+    explicit work_stealing_pool(
+        std::size_t threads = std::thread::hardware_concurrency())
+        : workers_(std::max<std::size_t>(threads, 1))
     {
+        for (std::size_t i = 0; i < workers_.size(); ++i)
+            workers_[i].reset(new worker);
+        for (std::size_t i = 0; i < workers_.size(); ++i)
+            workers_[i]->thread = std::thread([this, i] { run(i); });
     }
 
-    bool pop(T& t)
+    ~work_stealing_pool()
+    {
+        join();
+        shutdown();
+        destroy();
+    }
+
+    inline executor_type get_executor() noexcept;
+
+    // Wait until all outstanding work has finished, then stop the workers.
+    void join()
     {
-        std::unique_lock<std::mutex> lock(impl_->mutex_);
-        while (impl_->queue_.empty() && !impl_->stop_)
-            impl_->condition_.wait(lock);
-        if (!impl_->queue_.empty())
         {
-            t = impl_->queue_.front();
-            impl_->queue_.pop();
-            return true;
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (work_.load() != 0)
+                join_condition_.wait(lock);
+            stopped_ = true;
+            condition_.notify_all();
         }
-        return false;
+
+        for (auto& w : workers_)
+            if (w->thread.joinable())
+                w->thread.join();
     }
 
 private:
-    std::shared_ptr<queue_impl<T>> impl_;
-};
+    struct task
+    {
+        virtual ~task() {}
+        virtual void run() = 0;
+    };
 
-// Launch the last stage in a pipeline.
-template <class T, class F>
-std::future<void> pipeline(queue_back<T> in, F f)
-{
-    // Get the function's associated executor, defaulting to thread_executor.
-    auto ex = boost::asio::get_associated_executor(f, thread_executor());
+    template <class Func>
+    struct function_task : task
+    {
+        explicit function_task(Func f) : f_(std::move(f)) {}
+        void run() { f_(); }
+        Func f_;
+    };
 
-    // Run the function, and as we're the last stage return a future so that the
-    // caller can wait for the pipeline to finish.
-    return boost::asio::post(ex, boost::asio::use_future([in, f]() mutable { f(in); }));
-}
+    struct worker
+    {
+        chase_lev_deque<task> deque;
+        std::thread thread;
+    };
 
-// Launch an intermediate stage in a pipeline.
-template <class T, class F, class... Tail>
-std::future<void> pipeline(queue_back<T> in, F f, Tail... t)
-{
-    // Determine the output queue type.
-    typedef typename boost::asio::executor_binder<F, thread_executor>::second_argument_type::value_type output_value_type;
+    // The pool and worker index of the calling thread, if it is a worker.
+    struct current_worker
+    {
+        work_stealing_pool* pool;
+        std::size_t index;
+    };
 
-    // Create the output queue and its implementation.
-    auto out_impl = std::make_shared<queue_impl<output_value_type>>();
-    queue_front<output_value_type> out(out_impl);
-    queue_back<output_value_type> next_in(out_impl);
+    static current_worker& current()
+    {
+        static thread_local current_worker c = { nullptr, 0 };
+        return c;
+    }
 
-    // Get the function's associated executor, defaulting to thread_executor.
-    auto ex = boost::asio::get_associated_executor(f, thread_executor());
+    bool running_in_this_thread() const noexcept
+    {
+        return current().pool == this;
+    }
 
-    // Run the function.
-    boost::asio::post(ex, [in, out, f]() mutable
+    void work_started()
+    {
+        work_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void work_finished()
+    {
+        if (work_.fetch_sub(1, std::memory_order_acq_rel) == 1)
         {
-            f(in, out);
-            out.stop();
-        });
+            std::lock_guard<std::mutex> lock(mutex_);
+            join_condition_.notify_all();
+        }
+    }
 
-    // Launch the rest of the pipeline.
-    return pipeline(next_in, std::move(t)...);
-}
+    template <class Func>
+    void post(Func f)
+    {
+        task* t = new function_task<Func>(std::move(f));
+        work_started();
 
-// Launch the first stage in a pipeline.
-template <class F, class... Tail>
-std::future<void> pipeline(F f, Tail... t)
-{
-    // Determine the output queue type.
-    typedef typename boost::asio::executor_binder<F, thread_executor>::argument_type::value_type output_value_type;
+        if (running_in_this_thread())
+        {
+            workers_[current().index]->deque.push(t);
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lock(injection_mutex_);
+            injection_.push_back(t);
+        }
 
-    // Create the output queue and its implementation.
-    auto out_impl = std::make_shared<queue_impl<output_value_type>>();
-    queue_front<output_value_type> out(out_impl);
-    queue_back<output_value_type> next_in(out_impl);
+        // Pairs with the sleeper count taken by a worker before it parks:
+        // either it sees the new task or we see that it is asleep.
+        pending_.fetch_add(1, std::memory_order_seq_cst);
+        if (sleepers_.load(std::memory_order_seq_cst) > 0)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            condition_.notify_one();
+        }
+    }
 
-    // Get the function's associated executor, defaulting to thread_executor.
-    auto ex = boost::asio::get_associated_executor(f, thread_executor());
+    task* find_task(std::size_t index, std::uint32_t& seed)
+    {
+        if (task* t = workers_[index]->deque.take())
+            return t;
 
-    // Run the function.
-    boost::asio::post(ex, [out, f]() mutable
         {
-            f(out);
-            out.stop();
-        });
+            std::lock_guard<std::mutex> lock(injection_mutex_);
+            if (!injection_.empty())
+            {
+                task* t = injection_.front();
+                injection_.pop_front();
+                return t;
+            }
+        }
 
-    // Launch the rest of the pipeline.
-    return pipeline(next_in, std::move(t)...);
-}
+        // Try every other worker once, starting from a random victim.
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        std::size_t n = workers_.size();
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            std::size_t victim = (seed + i) % n;
+            if (victim != index)
+                if (task* t = workers_[victim]->deque.steal())
+                    return t;
+        }
+        return nullptr;
+    }
 
+    void run(std::size_t index)
+    {
+        current().pool = this;
+        current().index = index;
+        std::uint32_t seed = static_cast<std::uint32_t>(index) * 2654435761u + 1;
 
-void reader(queue_front<std::string> out)
-{
-    std::string line;
-    while (std::getline(std::cin, line))
-        out.push(line);
-}
+        for (;;)
+        {
+            if (task* t = find_task(index, seed))
+            {
+                pending_.fetch_sub(1, std::memory_order_seq_cst);
+                t->run();
+                delete t;
+                work_finished();
+                continue;
+            }
 
-void filter(queue_back<std::string> in, queue_front<std::string> out)
-{
-    std::string line;
-    while (in.pop(line))
-        if (line.length() > 5)
-            out.push(line);
-}
+            std::unique_lock<std::mutex> lock(mutex_);
+            sleepers_.fetch_add(1, std::memory_order_seq_cst);
+            while (pending_.load(std::memory_order_seq_cst) <= 0 && !stopped_)
+                condition_.wait(lock);
+            sleepers_.fetch_sub(1, std::memory_order_seq_cst);
+            if (stopped_ && pending_.load() <= 0)
+                return;
+
+            // A task is pending but may still be on its way into a deque.
+            lock.unlock();
+            std::this_thread::yield();
+        }
+    }
+
+    std::vector<std::unique_ptr<worker>> workers_;
+
+    std::mutex injection_mutex_;
+    std::deque<task*> injection_;
+
+    // Tasks queued but not yet taken, and workers parked waiting for one.
+    std::atomic<std::int64_t> pending_{0};
+    std::atomic<std::int64_t> sleepers_{0};
+
+    // Tasks not yet finished plus work counted through the executor.
+    std::atomic<std::size_t> work_{0};
+
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    std::condition_variable join_condition_;
+    bool stopped_ = false;
+};
 
-void upper(queue_back<std::string> in, queue_front<std::string> out)
+class work_stealing_pool::executor_type
 {
-    std::string line;
-    while (in.pop(line))
+public:
+    work_stealing_pool& context() const noexcept
     {
-        std::string new_line;
-        for (char c : line)
-            new_line.push_back(std::toupper(c));
-        out.push(new_line);
+        return *pool_;
     }
-}
 
-void writer(queue_back<std::string> in)
-{
-    std::size_t count = 0;
-    std::string line;
-    while (in.pop(line))
-        std::cout << count++ << ": " << line << std::endl;
-}
+    void on_work_started() const noexcept
+    {
+        pool_->work_started();
+    }
+
+    void on_work_finished() const noexcept
+    {
+        pool_->work_finished();
+    }
 
+    // Whether the calling thread is one of the pool's workers.
+    bool running_in_this_thread() const noexcept
+    {
+        return pool_->running_in_this_thread();
+    }
 
-TEST(asio, Executor)
-{
-    boost::asio::thread_pool pool;
+    template <class Func, class Alloc>
+    void dispatch(Func&& f, const Alloc& a) const
+    {
+        if (running_in_this_thread())
+        {
+            typename std::decay<Func>::type tmp(std::forward<Func>(f));
+            tmp();
+        }
+        else
+        {
+            post(std::forward<Func>(f), a);
+        }
+    }
 
-    auto f = pipeline(reader, filter, bind_executor(pool, upper), writer);
-    f.wait();
-}
+    template <class Func, class Alloc>
+    void post(Func f, const Alloc&) const
+    {
+        pool_->post(std::move(f));
+    }
+
+    template <class Func, class Alloc>
+    void defer(Func&& f, const Alloc& a) const
+    {
+        post(std::forward<Func>(f), a);
+    }
+
+    friend bool operator==(const executor_type& a,
+        const executor_type& b) noexcept
+    {
+        return a.pool_ == b.pool_;
+    }
 
+    friend bool operator!=(const executor_type& a,
+        const executor_type& b) noexcept
+    {
+        return a.pool_ != b.pool_;
+    }
+
+private:
+    friend class work_stealing_pool;
+
+    explicit executor_type(work_stealing_pool& pool) noexcept
+        : pool_(&pool)
+    {
+    }
+
+    work_stealing_pool* pool_;
+};
+
+inline work_stealing_pool::executor_type
+work_stealing_pool::get_executor() noexcept
+{
+    return executor_type(*this);
+}
+
+// A view of a contiguous run of items. It is used by the batch queue
+// operations and by stage functions that work on several items at once.
+template <class T>
+class item_span
+{
+public:
+    item_span() noexcept
+        : data_(nullptr), size_(0)
+    {
+    }
+
+    item_span(T* data, std::size_t size) noexcept
+        : data_(data), size_(size)
+    {
+    }
+
+    item_span(std::vector<T>& items) noexcept
+        : data_(items.data()), size_(items.size())
+    {
+    }
+
+    T* data() const noexcept { return data_; }
+    std::size_t size() const noexcept { return size_; }
+    bool empty() const noexcept { return size_ == 0; }
+    T* begin() const noexcept { return data_; }
+    T* end() const noexcept { return data_ + size_; }
+    T& operator[](std::size_t i) const noexcept { return data_[i]; }
+
+    // The first n items of the span.
+    item_span first(std::size_t n) const noexcept
+    {
+        return item_span(data_, n);
+    }
+
+private:
+    T* data_;
+    std::size_t size_;
+};
+
+// Counters kept by each queue implementation when the program is built with
+// PIPELINE_ENABLE_STATS defined. Each counter has a single writer at a time,
+// either the producer or the consumer, so updates are plain relaxed loads and
+// stores, and the clock is only read on the paths that are about to block.
+// Any thread may take a snapshot while the pipeline runs. Without the macro
+// every member is an empty inline function.
+struct queue_stats_snapshot
+{
+    std::uint64_t pushed = 0;
+    std::uint64_t popped = 0;
+    std::uint64_t high_water = 0;
+
+    // Time the consumer spent waiting for items and the producer spent
+    // waiting for space, in nanoseconds.
+    std::uint64_t pop_wait_ns = 0;
+    std::uint64_t push_wait_ns = 0;
+
+    // Steady clock times, in nanoseconds, at which the producer stopped the
+    // queue and the consumer found it stopped and empty; zero until then.
+    std::int64_t stopped_at_ns = 0;
+    std::int64_t drained_at_ns = 0;
+};
+
+#if defined(PIPELINE_ENABLE_STATS)
+
+class queue_stats
+{
+public:
+    queue_stats()
+        : pushed_(0), high_water_(0), push_wait_ns_(0), stopped_at_ns_(0),
+        popped_(0), pop_wait_ns_(0), drained_at_ns_(0)
+    {
+    }
+
+    static std::int64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Record count items pushed, leaving depth items in the queue.
+    void pushed(std::size_t count, std::size_t depth)
+    {
+        add(pushed_, count);
+        if (depth > high_water_.load(std::memory_order_relaxed))
+            high_water_.store(depth, std::memory_order_relaxed);
+    }
+
+    // As above, where depth_bound may overstate the depth and exact() gives
+    // the real one. exact() is only called for a possible new high water.
+    template <class Depth>
+    void pushed(std::size_t count, std::size_t depth_bound, Depth exact)
+    {
+        add(pushed_, count);
+        if (depth_bound > high_water_.load(std::memory_order_relaxed))
+        {
+            std::size_t depth = exact();
+            if (depth > high_water_.load(std::memory_order_relaxed))
+                high_water_.store(depth, std::memory_order_relaxed);
+        }
+    }
+
+    void popped(std::size_t count) { add(popped_, count); }
+
+    // Start timing a wait; pass the result to the matching _waited call.
+    std::int64_t wait_begin() const { return now(); }
+    void push_waited(std::int64_t begin) { add(push_wait_ns_, now() - begin); }
+    void pop_waited(std::int64_t begin) { add(pop_wait_ns_, now() - begin); }
+
+    void stopped() { stopped_at_ns_.store(now(), std::memory_order_relaxed); }
+
+    void drained()
+    {
+        if (drained_at_ns_.load(std::memory_order_relaxed) == 0)
+            drained_at_ns_.store(now(), std::memory_order_relaxed);
+    }
+
+    queue_stats_snapshot snapshot() const
+    {
+        queue_stats_snapshot s;
+        s.popped = popped_.load(std::memory_order_relaxed);
+        s.pushed = pushed_.load(std::memory_order_relaxed);
+        s.high_water = high_water_.load(std::memory_order_relaxed);
+        s.pop_wait_ns = pop_wait_ns_.load(std::memory_order_relaxed);
+        s.push_wait_ns = push_wait_ns_.load(std::memory_order_relaxed);
+        s.stopped_at_ns = stopped_at_ns_.load(std::memory_order_relaxed);
+        s.drained_at_ns = drained_at_ns_.load(std::memory_order_relaxed);
+        return s;
+    }
+
+private:
+    enum { cache_line_size = 64 };
+
+    template <class Counter, class Value>
+    static void add(Counter& counter, Value value)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + value,
+            std::memory_order_relaxed);
+    }
+
+    // Producer side.
+    std::atomic<std::uint64_t> pushed_;
+    std::atomic<std::uint64_t> high_water_;
+    std::atomic<std::uint64_t> push_wait_ns_;
+    std::atomic<std::int64_t> stopped_at_ns_;
+    char producer_pad_[cache_line_size];
+
+    // Consumer side.
+    std::atomic<std::uint64_t> popped_;
+    std::atomic<std::uint64_t> pop_wait_ns_;
+    std::atomic<std::int64_t> drained_at_ns_;
+};
+
+#else // defined(PIPELINE_ENABLE_STATS)
+
+class queue_stats
+{
+public:
+    void pushed(std::size_t, std::size_t) {}
+    template <class Depth> void pushed(std::size_t, std::size_t, Depth) {}
+    void popped(std::size_t) {}
+    std::int64_t wait_begin() const { return 0; }
+    void push_waited(std::int64_t) {}
+    void pop_waited(std::int64_t) {}
+    void stopped() {}
+    void drained() {}
+    queue_stats_snapshot snapshot() const { return queue_stats_snapshot(); }
+};
+
+#endif // defined(PIPELINE_ENABLE_STATS)
+
+// Base class for all thread-safe queue implementations.
+class queue_impl_base
+{
+public:
+    const queue_stats& stats() const
+    {
+        return stats_;
+    }
+
+protected:
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    bool stop_ = false;
+    queue_stats stats_;
+};
+
+// Underlying implementation of a thread-safe queue, shared between the
+// queue_front and queue_back classes. It is unbounded and takes a mutex for
+// every operation.
+template <class T>
+class queue_impl : public queue_impl_base
+{
+public:
+    void push(T t)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        queue_.push(std::move(t));
+        stats_.pushed(1, queue_.size());
+        condition_.notify_one();
+    }
+
+    void push_batch(T* items, std::size_t count)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (std::size_t i = 0; i < count; ++i)
+            queue_.push(std::move(items[i]));
+        stats_.pushed(count, queue_.size());
+        condition_.notify_one();
+    }
+
+    bool pop(T& t)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wait(lock);
+        if (!queue_.empty())
+        {
+            t = std::move(queue_.front());
+            queue_.pop();
+            stats_.popped(1);
+            return true;
+        }
+        stats_.drained();
+        return false;
+    }
+
+    std::size_t pop_batch(T* items, std::size_t max)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wait(lock);
+        return take(items, max);
+    }
+
+    std::size_t pop_batch_until(T* items, std::size_t max,
+        std::chrono::steady_clock::time_point deadline)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (queue_.empty() && !stop_)
+        {
+            std::int64_t begin = stats_.wait_begin();
+            while (queue_.empty() && !stop_)
+                if (condition_.wait_until(lock, deadline) == std::cv_status::timeout)
+                    break;
+            stats_.pop_waited(begin);
+        }
+        return take(items, max);
+    }
+
+    void stop()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        stop_ = true;
+        stats_.stopped();
+        condition_.notify_one();
+    }
+
+    // Drop anything left in a stopped queue and open it for pushes again.
+    void restart()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!queue_.empty())
+            queue_.pop();
+        stop_ = false;
+    }
+
+private:
+    void wait(std::unique_lock<std::mutex>& lock)
+    {
+        if (queue_.empty() && !stop_)
+        {
+            std::int64_t begin = stats_.wait_begin();
+            while (queue_.empty() && !stop_)
+                condition_.wait(lock);
+            stats_.pop_waited(begin);
+        }
+    }
+
+    std::size_t take(T* items, std::size_t max)
+    {
+        std::size_t n = std::min(max, queue_.size());
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            items[i] = std::move(queue_.front());
+            queue_.pop();
+        }
+        if (n != 0)
+            stats_.popped(n);
+        else if (stop_)
+            stats_.drained();
+        return n;
+    }
+
+    std::queue<T> queue_;
+};
+
+// Bounded single-producer single-consumer ring buffer implementation. Each
+// pipeline link has exactly one producer and one consumer, so push and pop
+// only need acquire/release atomics on the two indexes, which live on separate
+// cache lines. A full ring applies backpressure to the producer and an empty
+// ring holds up the consumer: either side spins briefly, then yields, then
+// parks on a condition variable until the other side makes progress.
+template <class T, std::size_t Capacity>
+class spsc_ring_impl
+{
+    static_assert(Capacity != 0 && (Capacity & (Capacity - 1)) == 0,
+        "capacity must be a power of two");
+
+public:
+    spsc_ring_impl()
+        : head_(0), cached_tail_(0), tail_(0), cached_head_(0),
+        stop_(false), producer_waiting_(false), consumer_waiting_(false)
+    {
+    }
+
+    spsc_ring_impl(const spsc_ring_impl&) = delete;
+    spsc_ring_impl& operator=(const spsc_ring_impl&) = delete;
+
+    ~spsc_ring_impl()
+    {
+        for (std::size_t i = head_.load(); i != tail_.load(); ++i)
+            slot(i)->~T();
+    }
+
+    void push(T t)
+    {
+        const std::size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - cached_head_ == Capacity)
+            wait_for_space(tail);
+
+        new (slot(tail)) T(std::move(t));
+        tail_.store(tail + 1, std::memory_order_release);
+        record_push(1, tail + 1);
+        wake(consumer_waiting_);
+    }
+
+    void push_batch(T* items, std::size_t count)
+    {
+        std::size_t tail = tail_.load(std::memory_order_relaxed);
+        while (count != 0)
+        {
+            if (Capacity - (tail - cached_head_) < count)
+                cached_head_ = head_.load(std::memory_order_acquire);
+            if (tail - cached_head_ == Capacity)
+                wait_for_space(tail);
+
+            // Publish as many items as fit with a single index update.
+            std::size_t n = std::min(count, Capacity - (tail - cached_head_));
+            for (std::size_t i = 0; i < n; ++i)
+                new (slot(tail + i)) T(std::move(items[i]));
+            tail += n;
+            items += n;
+            count -= n;
+            tail_.store(tail, std::memory_order_release);
+            record_push(n, tail);
+            wake(consumer_waiting_);
+        }
+    }
+
+    bool pop(T& t)
+    {
+        const std::size_t head = head_.load(std::memory_order_relaxed);
+        if (head == cached_tail_ && !wait_for_data(head))
+            return false;
+
+        T* item = slot(head);
+        t = std::move(*item);
+        item->~T();
+        head_.store(head + 1, std::memory_order_release);
+        stats_.popped(1);
+        wake(producer_waiting_);
+        return true;
+    }
+
+    std::size_t pop_batch(T* items, std::size_t max)
+    {
+        return take_batch(items, max, nullptr);
+    }
+
+    std::size_t pop_batch_until(T* items, std::size_t max,
+        std::chrono::steady_clock::time_point deadline)
+    {
+        return take_batch(items, max, &deadline);
+    }
+
+    void stop()
+    {
+        stop_.store(true, std::memory_order_release);
+        stats_.stopped();
+        wake(consumer_waiting_);
+    }
+
+    const queue_stats& stats() const
+    {
+        return stats_;
+    }
+
+private:
+    enum { cache_line_size = 64, spin_count = 64, yield_count = 64 };
+
+    T* slot(std::size_t index)
+    {
+        return reinterpret_cast<T*>(&slots_[index & (Capacity - 1)]);
+    }
+
+    std::size_t take_batch(T* items, std::size_t max,
+        const std::chrono::steady_clock::time_point* deadline)
+    {
+        const std::size_t head = head_.load(std::memory_order_relaxed);
+        if (head == cached_tail_ && !wait_for_data(head, deadline))
+            return 0;
+        if (cached_tail_ - head < max)
+            cached_tail_ = tail_.load(std::memory_order_acquire);
+
+        // Take everything available, up to max, with a single index update.
+        std::size_t n = std::min(max, cached_tail_ - head);
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            T* item = slot(head + i);
+            items[i] = std::move(*item);
+            item->~T();
+        }
+        head_.store(head + n, std::memory_order_release);
+        stats_.popped(n);
+        wake(producer_waiting_);
+        return n;
+    }
+
+    // The cached head only ever understates how far the consumer has got, so
+    // it gives an upper bound on the depth; the real head is loaded only when
+    // that bound exceeds the high water mark.
+    void record_push(std::size_t count, std::size_t tail)
+    {
+        stats_.pushed(count, tail - cached_head_,
+            [this, tail]() { return tail - head_.load(std::memory_order_relaxed); });
+    }
+
+    // Called by the producer when its cached view of the ring is full.
+    void wait_for_space(std::size_t tail)
+    {
+        cached_head_ = head_.load(std::memory_order_acquire);
+        if (tail - cached_head_ != Capacity)
+            return;
+
+        std::int64_t begin = stats_.wait_begin();
+        spin_for_space(tail);
+        stats_.push_waited(begin);
+    }
+
+    void spin_for_space(std::size_t tail)
+    {
+        for (int i = 0; i < spin_count + yield_count; ++i)
+        {
+            cached_head_ = head_.load(std::memory_order_acquire);
+            if (tail - cached_head_ != Capacity)
+                return;
+            if (i >= spin_count)
+                std::this_thread::yield();
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        producer_waiting_.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while (tail - (cached_head_ = head_.load(std::memory_order_acquire))
+            == Capacity)
+        {
+            condition_.wait(lock);
+        }
+        producer_waiting_.store(false, std::memory_order_relaxed);
+    }
+
+    // Called by the consumer when its cached view of the ring is empty.
+    // Returns false once the ring is stopped and fully drained, or when the
+    // deadline, if any, passes first.
+    bool wait_for_data(std::size_t head,
+        const std::chrono::steady_clock::time_point* deadline = nullptr)
+    {
+        if (has_data(head))
+            return true;
+
+        std::int64_t begin = stats_.wait_begin();
+        bool ready = spin_for_data(head, deadline);
+        stats_.pop_waited(begin);
+        if (!ready && stop_.load(std::memory_order_acquire))
+            stats_.drained();
+        return ready;
+    }
+
+    bool spin_for_data(std::size_t head,
+        const std::chrono::steady_clock::time_point* deadline)
+    {
+        for (int i = 0; i < spin_count + yield_count; ++i)
+        {
+            if (has_data(head))
+                return true;
+            if (stop_.load(std::memory_order_acquire))
+                return has_data(head);
+            if (i >= spin_count)
+                std::this_thread::yield();
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        consumer_waiting_.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while (!has_data(head) && !stop_.load(std::memory_order_acquire))
+        {
+            if (!deadline)
+                condition_.wait(lock);
+            else if (condition_.wait_until(lock, *deadline)
+                == std::cv_status::timeout)
+                break;
+        }
+        consumer_waiting_.store(false, std::memory_order_relaxed);
+        return has_data(head);
+    }
+
+    bool has_data(std::size_t head)
+    {
+        cached_tail_ = tail_.load(std::memory_order_acquire);
+        return cached_tail_ != head;
+    }
+
+    // Wake the other side if it is parked. The fence pairs with the one taken
+    // before parking, so either the waiter sees the new index or we see its
+    // flag.
+    void wake(std::atomic<bool>& waiting)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting.load(std::memory_order_relaxed))
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            condition_.notify_all();
+        }
+    }
+
+    // Consumer side.
+    std::atomic<std::size_t> head_;
+    std::size_t cached_tail_;
+    char consumer_pad_[cache_line_size];
+
+    // Producer side.
+    std::atomic<std::size_t> tail_;
+    std::size_t cached_head_;
+    char producer_pad_[cache_line_size];
+
+    // Shared, rarely written state.
+    std::atomic<bool> stop_;
+    std::atomic<bool> producer_waiting_;
+    std::atomic<bool> consumer_waiting_;
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    queue_stats stats_;
+    char stats_pad_[cache_line_size];
+
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type slots_[Capacity];
+};
+
+// Queue policies select the implementation shared by a queue_front and its
+// queue_back. A stage picks the policy through the queue types in its
+// signature and pipeline() creates the matching implementation.
+struct locked_queue
+{
+    template <class T>
+    using impl = queue_impl<T>;
+};
+
+template <std::size_t Capacity = 1024>
+struct spsc_ring
+{
+    template <class T>
+    using impl = spsc_ring_impl<T, Capacity>;
+};
+
+// The front end of a queue between consecutive pipeline stages.
+template <class T, class Policy = locked_queue>
+class queue_front
+{
+public:
+    typedef T value_type;
+    typedef Policy policy_type;
+    typedef typename Policy::template impl<T> impl_type;
+
+    explicit queue_front(std::shared_ptr<impl_type> impl)
+        : impl_(impl)
+    {
+    }
+
+    void push(T t)
+    {
+        impl_->push(std::move(t));
+    }
+
+    // Move all items of the span into the queue with one synchronization
+    // round. The items are left in a moved-from state.
+    void push_batch(item_span<T> items)
+    {
+        if (!items.empty())
+            impl_->push_batch(items.data(), items.size());
+    }
+
+    void stop()
+    {
+        impl_->stop();
+    }
+
+private:
+    std::shared_ptr<impl_type> impl_;
+};
+
+// The back end of a queue between consecutive pipeline stages.
+template <class T, class Policy = locked_queue>
+class queue_back
+{
+public:
+    typedef T value_type;
+    typedef Policy policy_type;
+    typedef typename Policy::template impl<T> impl_type;
+
+    explicit queue_back(std::shared_ptr<impl_type> impl)
+        : impl_(impl)
+    {
+    }
+
+    bool pop(T& t)
+    {
+        return impl_->pop(t);
+    }
+
+    // Wait for items and move up to buffer.size() of them into the buffer.
+    // Returns the filled part of the buffer, which is empty once the queue has
+    // been stopped and drained.
+    item_span<T> pop_batch(item_span<T> buffer)
+    {
+        return buffer.first(impl_->pop_batch(buffer.data(), buffer.size()));
+    }
+
+    // As pop_batch, but gives up and returns an empty span when no items
+    // arrive before the deadline.
+    item_span<T> pop_batch_until(item_span<T> buffer,
+        std::chrono::steady_clock::time_point deadline)
+    {
+        return buffer.first(
+            impl_->pop_batch_until(buffer.data(), buffer.size(), deadline));
+    }
+
+private:
+    std::shared_ptr<impl_type> impl_;
+};
+
+// A pipeline stage replicated R times. The replicas share the stage's input
+// queue: each in turn takes a batch of items along with the next sequence
+// number, runs its own copy of the stage function over the batch through a
+// pair of private queues that it reuses from batch to batch, and hands the
+// output to a reorder buffer that forwards batches downstream in sequence
+// order. Bind it to an executor with enough threads for
+// the replicas, e.g. bind_executor(pool, parallel(4, upper)).
+template <class F>
+class parallel_stage
+{
+public:
+    typedef typename boost::asio::executor_binder<F,
+        thread_executor>::first_argument_type first_argument_type;
+    typedef typename boost::asio::executor_binder<F,
+        thread_executor>::second_argument_type second_argument_type;
+    typedef typename first_argument_type::value_type input_type;
+    typedef typename second_argument_type::value_type output_type;
+
+    // The function runs over each batch to completion before any output is
+    // read back, so its queues must not apply backpressure.
+    static_assert(std::is_same<typename first_argument_type::policy_type,
+        locked_queue>::value, "replicated stages need unbounded queues");
+    static_assert(std::is_same<typename second_argument_type::policy_type,
+        locked_queue>::value, "replicated stages need unbounded queues");
+
+    parallel_stage(F f, std::size_t replicas, std::size_t batch_size = 64)
+        : f_(f), replicas_(std::max<std::size_t>(replicas, 1)),
+        batch_size_(std::max<std::size_t>(batch_size, 1))
+    {
+    }
+
+    std::size_t replicas() const
+    {
+        return replicas_;
+    }
+
+    // State shared by the replicas of one launch.
+    template <class In, class Out>
+    struct shared_state
+    {
+        shared_state(In i, Out o, std::size_t replicas)
+            : in(i), out(o), running(replicas)
+        {
+        }
+
+        In in;
+        Out out;
+
+        // Held while taking a batch so batches get ascending sequence numbers.
+        std::mutex input_mutex;
+        std::size_t next_batch = 0;
+
+        // Output of batches that finished ahead of their turn.
+        std::mutex order_mutex;
+        std::size_t next_output = 0;
+        std::map<std::size_t, std::vector<output_type>> pending;
+
+        std::atomic<std::size_t> running;
+    };
+
+    // Run one replica until the input queue is drained.
+    template <class In, class Out>
+    void run_replica(shared_state<In, Out>& s) const
+    {
+        replica r(f_);
+        std::vector<input_type> batch(batch_size_);
+        std::vector<output_type> output;
+        for (;;)
+        {
+            std::size_t sequence;
+            item_span<input_type> items;
+            {
+                std::lock_guard<std::mutex> lock(s.input_mutex);
+                items = s.in.pop_batch(batch);
+                if (items.empty())
+                    return;
+                sequence = s.next_batch++;
+            }
+
+            output.clear();
+            r.process(items, output);
+            emit(s, sequence, output);
+        }
+    }
+
+    // Run as an ordinary single replica stage.
+    void operator()(first_argument_type in, second_argument_type out) const
+    {
+        shared_state<first_argument_type, second_argument_type> s(in, out, 1);
+        run_replica(s);
+    }
+
+private:
+    // The function copy and private queues of one replica.
+    class replica
+    {
+    public:
+        explicit replica(const F& f)
+            : f_(f),
+            in_(std::make_shared<typename first_argument_type::impl_type>()),
+            out_(std::make_shared<typename second_argument_type::impl_type>())
+        {
+        }
+
+        void process(item_span<input_type> items,
+            std::vector<output_type>& output)
+        {
+            in_->push_batch(items.data(), items.size());
+            in_->stop();
+            f_(first_argument_type(in_), second_argument_type(out_));
+            out_->stop();
+
+            output_type item;
+            while (out_->pop(item))
+                output.push_back(std::move(item));
+            in_->restart();
+            out_->restart();
+        }
+
+    private:
+        F f_;
+        std::shared_ptr<typename first_argument_type::impl_type> in_;
+        std::shared_ptr<typename second_argument_type::impl_type> out_;
+    };
+
+    template <class In, class Out>
+    static void emit(shared_state<In, Out>& s, std::size_t sequence,
+        std::vector<output_type>& output)
+    {
+        std::lock_guard<std::mutex> lock(s.order_mutex);
+        if (sequence != s.next_output)
+        {
+            s.pending[sequence].swap(output);
+            return;
+        }
+
+        s.out.push_batch(output);
+        ++s.next_output;
+        for (auto it = s.pending.begin();
+            it != s.pending.end() && it->first == s.next_output;
+            it = s.pending.erase(it))
+        {
+            s.out.push_batch(it->second);
+            ++s.next_output;
+        }
+    }
+
+    F f_;
+    std::size_t replicas_;
+    std::size_t batch_size_;
+};
+
+// Mark a stage to run as R replicas.
+template <class F>
+inline parallel_stage<F> parallel(std::size_t replicas, F f)
+{
+    return parallel_stage<F>(f, replicas);
+}
+
+// The first exception thrown by any stage of a pipeline. The stages share it,
+// and the last stage rethrows it through the future pipeline() returns.
+class pipeline_error
+{
+public:
+    void set(std::exception_ptr e)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!error_)
+            error_ = e;
+    }
+
+    void rethrow()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (error_)
+            std::rethrow_exception(error_);
+    }
+
+private:
+    std::mutex mutex_;
+    std::exception_ptr error_;
+};
+
+// Discard the rest of a failed stage's input, so that earlier stages are not
+// held up by a full queue and run to completion.
+template <class T, class P>
+void discard_input(queue_back<T, P>& in)
+{
+    T item;
+    while (in.pop(item))
+    {
+    }
+}
+
+// Start an intermediate stage on its executor. The stage stops its output
+// queue once it returns or throws.
+template <class Executor, class In, class Out, class F>
+void launch_stage(const Executor& ex, In in, Out out, F f,
+    std::shared_ptr<pipeline_error> error)
+{
+    boost::asio::post(ex, [in, out, f, error]() mutable
+        {
+            try
+            {
+                f(in, out);
+            }
+            catch (...)
+            {
+                error->set(std::current_exception());
+                discard_input(in);
+            }
+            out.stop();
+        });
+}
+
+// Start every replica of a parallel stage. The last replica to finish stops
+// the output queue.
+template <class Executor, class In, class Out, class F>
+void launch_stage(const Executor& ex, In in, Out out, parallel_stage<F> f,
+    std::shared_ptr<pipeline_error> error)
+{
+    typedef typename parallel_stage<F>::template shared_state<In, Out> state_type;
+    auto state = std::make_shared<state_type>(in, out, f.replicas());
+    for (std::size_t i = 0; i < f.replicas(); ++i)
+    {
+        boost::asio::post(ex, [state, f, error]()
+            {
+                try
+                {
+                    f.run_replica(*state);
+                }
+                catch (...)
+                {
+                    error->set(std::current_exception());
+                    std::lock_guard<std::mutex> lock(state->input_mutex);
+                    discard_input(state->in);
+                }
+                if (state->running.fetch_sub(1) == 1)
+                    state->out.stop();
+            });
+    }
+}
+
+template <class Executor, class In, class Out, class F, class E>
+void launch_stage(const Executor& ex, In in, Out out,
+    boost::asio::executor_binder<parallel_stage<F>, E> f,
+    std::shared_ptr<pipeline_error> error)
+{
+    launch_stage(ex, in, out, f.get(), error);
+}
+
+// Collects the queue counters of a pipeline. A pipeline started through run()
+// records its queues, in order, as pipeline() creates them, so queue i links
+// stage i to stage i + 1. snapshot() may be called from any thread while the
+// pipeline runs and write_json() reports per queue and per stage figures.
+// Without PIPELINE_ENABLE_STATS nothing is recorded.
+class pipeline_stats
+{
+public:
+    pipeline_stats()
+        : started_at_ns_(0)
+    {
+    }
+
+    // Start a pipeline, as pipeline(stages...) does.
+    template <class... Stages>
+    std::future<void> run(Stages... stages);
+
+    // Called by pipeline() for each queue it creates.
+    template <class Impl>
+    static void attach(const std::shared_ptr<Impl>& impl)
+    {
+#if defined(PIPELINE_ENABLE_STATS)
+        if (pipeline_stats* stats = current())
+            stats->queues_.push_back(
+                std::shared_ptr<const queue_stats>(impl, &impl->stats()));
+#else // defined(PIPELINE_ENABLE_STATS)
+        (void)impl;
+#endif // defined(PIPELINE_ENABLE_STATS)
+    }
+
+    std::vector<queue_stats_snapshot> snapshot() const
+    {
+        std::vector<queue_stats_snapshot> result;
+        for (const auto& queue : queues_)
+            result.push_back(queue->snapshot());
+        return result;
+    }
+
+    void write_json(std::ostream& os) const
+    {
+        std::vector<queue_stats_snapshot> queues = snapshot();
+        std::int64_t now = now_ns();
+        auto ms = [](double ns) { return ns / 1e6; };
+        auto since_start = [&](std::int64_t at)
+            {
+                return at ? ms(double(at - started_at_ns_)) : 0.0;
+            };
+
+        os << "{\"elapsed_ms\": " << since_start(now) << ", \"queues\": [";
+        for (std::size_t i = 0; i < queues.size(); ++i)
+        {
+            const queue_stats_snapshot& q = queues[i];
+            os << (i ? ", " : "")
+                << "{\"index\": " << i
+                << ", \"pushed\": " << q.pushed
+                << ", \"popped\": " << q.popped
+                << ", \"depth\": " << q.pushed - q.popped
+                << ", \"high_water\": " << q.high_water
+                << ", \"pop_wait_ms\": " << ms(double(q.pop_wait_ns))
+                << ", \"push_wait_ms\": " << ms(double(q.push_wait_ns))
+                << ", \"stopped_ms\": " << since_start(q.stopped_at_ns)
+                << ", \"drained_ms\": " << since_start(q.drained_at_ns) << "}";
+        }
+
+        // A stage's input is the previous queue and its output the next one;
+        // a stage finishes when it stops its output, or for the last stage,
+        // when it drains its input.
+        os << "], \"stages\": [";
+        for (std::size_t i = 0; !queues.empty() && i <= queues.size(); ++i)
+        {
+            const queue_stats_snapshot* in = i ? &queues[i - 1] : nullptr;
+            const queue_stats_snapshot* out =
+                i < queues.size() ? &queues[i] : nullptr;
+            os << (i ? ", " : "")
+                << "{\"index\": " << i
+                << ", \"items_in\": " << (in ? in->popped : 0)
+                << ", \"items_out\": " << (out ? out->pushed : 0)
+                << ", \"input_wait_ms\": "
+                << (in ? ms(double(in->pop_wait_ns)) : 0.0)
+                << ", \"output_wait_ms\": "
+                << (out ? ms(double(out->push_wait_ns)) : 0.0)
+                << ", \"finished_ms\": "
+                << since_start(out ? out->stopped_at_ns : in->drained_at_ns)
+                << "}";
+        }
+        os << "]}";
+    }
+
+private:
+    static std::int64_t now_ns()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // The collector that pipeline() is currently creating queues for.
+    static pipeline_stats*& current()
+    {
+        static thread_local pipeline_stats* stats = nullptr;
+        return stats;
+    }
+
+    std::int64_t started_at_ns_;
+    std::vector<std::shared_ptr<const queue_stats>> queues_;
+};
+
+// Launch the last stage in a pipeline.
+template <class T, class P, class F>
+std::future<void> pipeline_stages(std::shared_ptr<pipeline_error> error,
+    queue_back<T, P> in, F f)
+{
+    // Get the function's associated executor, defaulting to thread_executor.
+    auto ex = boost::asio::get_associated_executor(f, thread_executor());
+
+    // Run the function, and as we're the last stage return a future so that the
+    // caller can wait for the pipeline to finish. The future reports the first
+    // exception thrown by any stage.
+    return boost::asio::post(ex, boost::asio::use_future([in, f, error]() mutable
+        {
+            try
+            {
+                f(in);
+            }
+            catch (...)
+            {
+                error->set(std::current_exception());
+                discard_input(in);
+            }
+            error->rethrow();
+        }));
+}
+
+// Launch an intermediate stage in a pipeline.
+template <class T, class P, class F, class... Tail>
+std::future<void> pipeline_stages(std::shared_ptr<pipeline_error> error,
+    queue_back<T, P> in, F f, Tail... t)
+{
+    // Determine the output queue type.
+    typedef typename boost::asio::executor_binder<F, thread_executor>::second_argument_type output_queue_type;
+    typedef typename output_queue_type::value_type output_value_type;
+    typedef typename output_queue_type::policy_type output_policy_type;
+
+    // Create the output queue and its implementation.
+    auto out_impl = std::make_shared<typename output_queue_type::impl_type>();
+    pipeline_stats::attach(out_impl);
+    queue_front<output_value_type, output_policy_type> out(out_impl);
+    queue_back<output_value_type, output_policy_type> next_in(out_impl);
+
+    // Get the function's associated executor, defaulting to thread_executor.
+    auto ex = boost::asio::get_associated_executor(f, thread_executor());
+
+    // Run the function.
+    launch_stage(ex, in, out, f, error);
+
+    // Launch the rest of the pipeline.
+    return pipeline_stages(error, next_in, std::move(t)...);
+}
+
+// Launch the first stage in a pipeline.
+template <class F, class... Tail>
+std::future<void> pipeline(F f, Tail... t)
+{
+    // Determine the output queue type.
+    typedef typename boost::asio::executor_binder<F, thread_executor>::argument_type output_queue_type;
+    typedef typename output_queue_type::value_type output_value_type;
+    typedef typename output_queue_type::policy_type output_policy_type;
+
+    // Create the output queue and its implementation.
+    auto out_impl = std::make_shared<typename output_queue_type::impl_type>();
+    pipeline_stats::attach(out_impl);
+    queue_front<output_value_type, output_policy_type> out(out_impl);
+    queue_back<output_value_type, output_policy_type> next_in(out_impl);
+
+    // Get the function's associated executor, defaulting to thread_executor.
+    auto ex = boost::asio::get_associated_executor(f, thread_executor());
+
+    // Run the function.
+    auto error = std::make_shared<pipeline_error>();
+    boost::asio::post(ex, [out, f, error]() mutable
+        {
+            try
+            {
+                f(out);
+            }
+            catch (...)
+            {
+                error->set(std::current_exception());
+            }
+            out.stop();
+        });
+
+    // Launch the rest of the pipeline.
+    return pipeline_stages(error, next_in, std::move(t)...);
+}
+
+template <class... Stages>
+std::future<void> pipeline_stats::run(Stages... stages)
+{
+    // Restores the previous collector even if pipeline() throws.
+    struct scope
+    {
+        explicit scope(pipeline_stats* stats)
+            : previous(current())
+        {
+            current() = stats;
+        }
+
+        ~scope()
+        {
+            current() = previous;
+        }
+
+        pipeline_stats* previous;
+    };
+
+    queues_.clear();
+    started_at_ns_ = now_ns();
+    scope s(this);
+    return pipeline(std::move(stages)...);
+}
+
+
+void reader(queue_front<std::string> out)
+{
+    std::string line;
+    while (std::getline(std::cin, line))
+        out.push(line);
+}
+
+// A block of text that line slices point into: either a private, writable
+// mapping of a whole file or a heap buffer filled by reads. Stages may modify
+// the text in place; a mapping is copy-on-write, so the file is never changed.
+class text_chunk
+{
+public:
+    text_chunk(const text_chunk&) = delete;
+    text_chunk& operator=(const text_chunk&) = delete;
+
+    static std::shared_ptr<text_chunk> allocate(std::size_t size)
+    {
+        return std::shared_ptr<text_chunk>(
+            new text_chunk(new char[size], size, false));
+    }
+
+#if !defined(BOOST_ASIO_WINDOWS)
+    // Map a regular file. Returns null if the file cannot be mapped.
+    static std::shared_ptr<text_chunk> map(int fd, std::size_t size)
+    {
+        if (size == 0)
+            return nullptr;
+        void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+            return nullptr;
+        ::madvise(p, size, MADV_SEQUENTIAL);
+        return std::shared_ptr<text_chunk>(
+            new text_chunk(static_cast<char*>(p), size, true));
+    }
+#endif // !defined(BOOST_ASIO_WINDOWS)
+
+    ~text_chunk()
+    {
+#if !defined(BOOST_ASIO_WINDOWS)
+        if (mapped_)
+        {
+            ::munmap(data_, size_);
+            return;
+        }
+#endif // !defined(BOOST_ASIO_WINDOWS)
+        delete[] data_;
+    }
+
+    char* data() const noexcept { return data_; }
+    std::size_t size() const noexcept { return size_; }
+
+private:
+    text_chunk(char* data, std::size_t size, bool mapped)
+        : data_(data), size_(size), mapped_(mapped)
+    {
+    }
+
+    char* data_;
+    std::size_t size_;
+    bool mapped_;
+};
+
+// One line of text, without its newline, inside a text_chunk. The slice keeps
+// the chunk alive, so it can be passed between stages without copying.
+class line_slice
+{
+public:
+    line_slice() noexcept
+        : data_(nullptr), size_(0)
+    {
+    }
+
+    line_slice(char* data, std::size_t size, std::shared_ptr<text_chunk> chunk)
+        : data_(data), size_(size), chunk_(std::move(chunk))
+    {
+    }
+
+    char* data() const noexcept { return data_; }
+    std::size_t size() const noexcept { return size_; }
+    std::size_t length() const noexcept { return size_; }
+    char* begin() const noexcept { return data_; }
+    char* end() const noexcept { return data_ + size_; }
+
+    boost::string_view view() const noexcept
+    {
+        return boost::string_view(data_, size_);
+    }
+
+    std::string str() const
+    {
+        return std::string(data_, size_);
+    }
+
+    friend std::ostream& operator<<(std::ostream& os, const line_slice& line)
+    {
+        return os.write(line.data_, line.size_);
+    }
+
+private:
+    char* data_;
+    std::size_t size_;
+    std::shared_ptr<text_chunk> chunk_;
+};
+
+// Source stage that splits a file into line_slice items. Regular files are
+// memory mapped whole; anything that cannot be mapped (a pipe, or "-" for
+// standard input) is read in large chunks instead, carrying a partial last
+// line over into the next chunk. Line ends are found with memchr, which the
+// C library implements with vector instructions. A file that cannot be opened
+// throws boost::system::system_error.
+class mapped_line_reader
+{
+public:
+    typedef queue_front<line_slice> argument_type;
+
+    explicit mapped_line_reader(std::string path,
+        std::size_t chunk_size = 1 << 20)
+        : path_(std::move(path)), chunk_size_(chunk_size)
+    {
+    }
+
+    void operator()(queue_front<line_slice> out) const
+    {
+        std::vector<line_slice> batch;
+        batch.reserve(batch_size);
+
+#if !defined(BOOST_ASIO_WINDOWS)
+        if (path_ != "-")
+        {
+            int fd = ::open(path_.c_str(), O_RDONLY);
+            if (fd < 0)
+                throw_error(errno, "open");
+            struct stat st;
+            if (::fstat(fd, &st) != 0)
+            {
+                int error = errno;
+                ::close(fd);
+                throw_error(error, "fstat");
+            }
+
+            bool regular = S_ISREG(st.st_mode);
+            std::shared_ptr<text_chunk> chunk;
+            if (regular)
+                chunk = text_chunk::map(fd, static_cast<std::size_t>(st.st_size));
+            ::close(fd);
+
+            if (chunk || (regular && st.st_size == 0))
+            {
+                if (chunk)
+                    split(chunk, chunk->data(), chunk->size(), true, out, batch);
+                out.push_batch(batch);
+                return;
+            }
+        }
+#endif // !defined(BOOST_ASIO_WINDOWS)
+
+        std::FILE* file = path_ == "-" ? stdin : std::fopen(path_.c_str(), "rb");
+        if (!file)
+            throw_error(errno, "fopen");
+
+        // The unterminated tail of the previous chunk, copied into the next.
+        std::shared_ptr<text_chunk> previous;
+        const char* carry_data = nullptr;
+        std::size_t carry = 0;
+        for (;;)
+        {
+            auto chunk = text_chunk::allocate(std::max(chunk_size_, 2 * carry));
+            if (carry)
+                std::memcpy(chunk->data(), carry_data, carry);
+            std::size_t n = std::fread(chunk->data() + carry, 1,
+                chunk->size() - carry, file);
+
+            bool eof = n == 0;
+            std::size_t total = carry + n;
+            std::size_t used = split(chunk, chunk->data(), total, eof, out, batch);
+            if (eof)
+                break;
+
+            carry = total - used;
+            carry_data = chunk->data() + used;
+            previous = chunk;
+        }
+        out.push_batch(batch);
+
+        if (file != stdin)
+            std::fclose(file);
+    }
+
+private:
+    enum { batch_size = 256 };
+
+    static void throw_error(int error, const char* what)
+    {
+        boost::system::error_code ec(error,
+            boost::asio::error::get_system_category());
+        boost::asio::detail::throw_error(ec, what);
+    }
+
+    // Emit a slice for every complete line in [data, data + size). A final line
+    // without a newline is emitted only when last is true. Returns the number
+    // of bytes consumed.
+    static std::size_t split(const std::shared_ptr<text_chunk>& chunk,
+        char* data, std::size_t size, bool last,
+        queue_front<line_slice>& out, std::vector<line_slice>& batch)
+    {
+        char* p = data;
+        char* end = data + size;
+        while (p < end)
+        {
+            char* nl = static_cast<char*>(std::memchr(p, '\n', end - p));
+            if (!nl && !last)
+                break;
+
+            char* line_end = nl ? nl : end;
+            batch.emplace_back(p, line_end - p, chunk);
+            if (batch.size() == batch_size)
+            {
+                out.push_batch(batch);
+                batch.clear();
+            }
+            p = nl ? nl + 1 : end;
+        }
+        return p - data;
+    }
+
+    std::string path_;
+    std::size_t chunk_size_;
+};
+
+// Drive a stage whose work is done on spans of items. Up to batch_size items
+// are moved out of the input queue at a time; f processes them in place and
+// returns how many of them, compacted at the front, to forward downstream.
+template <class T, class P1, class P2, class F>
+void run_batched(queue_back<T, P1>& in, queue_front<T, P2>& out, F f,
+    std::size_t batch_size = 256)
+{
+    std::vector<T> buffer(batch_size);
+    for (;;)
+    {
+        item_span<T> items = in.pop_batch(buffer);
+        if (items.empty())
+            break;
+        out.push_batch(items.first(f(items)));
+    }
+}
+
+// The text stages work on std::string lines as well as on line_slice items
+// from mapped_line_reader, which they process without copying the text.
+template <class Line>
+std::size_t filter_lines(item_span<Line> lines)
+{
+    std::size_t kept = 0;
+    for (Line& line : lines)
+    {
+        if (line.length() > 5)
+        {
+            if (&line != &lines[kept])
+                lines[kept] = std::move(line);
+            ++kept;
+        }
+    }
+    return kept;
+}
+
+template <class Line>
+void filter(queue_back<Line> in, queue_front<Line> out)
+{
+    run_batched(in, out, filter_lines<Line>);
+}
+
+template <class Line>
+std::size_t upper_lines(item_span<Line> lines)
+{
+    for (Line& line : lines)
+        if (line.size() != 0)
+            ascii::to_upper(&*line.begin(), line.size());
+    return lines.size();
+}
+
+template <class Line>
+void upper(queue_back<Line> in, queue_front<Line> out)
+{
+    run_batched(in, out, upper_lines<Line>);
+}
+
+struct line_writer_options
+{
+    // Descriptor to write to; standard output by default.
+    int fd = 1;
+
+    // Write once this many bytes are pending.
+    std::size_t flush_bytes = 1 << 16;
+
+    // Write pending output at most this long after it was formatted, even
+    // if no more lines arrive.
+    std::chrono::milliseconds flush_interval = std::chrono::milliseconds(50);
+};
+
+// Sink stage that numbers lines as "N: line" and writes them to a file
+// descriptor in blocks. Numbers and short lines are formatted into a reusable
+// buffer; lines of direct_size bytes or more are not copied but written from
+// where they are. A block is written with one writev call when it reaches
+// flush_bytes, when flush_interval has passed since its first line, and when
+// the input queue is stopped.
+template <class Line>
+class line_writer
+{
+public:
+    explicit line_writer(line_writer_options options = line_writer_options())
+        : options_(options)
+    {
+    }
+
+    void operator()(queue_back<Line> in) const
+    {
+        typedef std::chrono::steady_clock clock;
+
+        // Anything already sent through std::cout must come out first.
+        std::cout.flush();
+
+        block b(options_);
+        std::vector<Line> buffer(256);
+        std::size_t count = 0;
+        clock::time_point deadline;
+        for (;;)
+        {
+            bool pending = !b.empty();
+            item_span<Line> lines = pending
+                ? in.pop_batch_until(buffer, deadline)
+                : in.pop_batch(buffer);
+            if (lines.empty())
+            {
+                // Either the deadline passed or the queue is stopped and
+                // drained; in both cases write what there is.
+                b.flush();
+                if (pending && clock::now() >= deadline)
+                    continue;
+                break;
+            }
+
+            if (!pending)
+                deadline = clock::now() + options_.flush_interval;
+            for (const Line& line : lines)
+                b.append(count++, line.data(), line.size());
+
+            // Direct segments point into the batch buffer, which the next
+            // pop overwrites.
+            if (b.has_direct() || clock::now() >= deadline)
+                b.flush();
+        }
+    }
+
+private:
+    enum { direct_size = 4096, max_segments = 64, max_number_size = 24 };
+
+    class block
+    {
+    public:
+        explicit block(const line_writer_options& options)
+            : fd_(options.fd),
+            flush_bytes_(std::max<std::size_t>(options.flush_bytes,
+                direct_size + max_number_size)),
+            text_(flush_bytes_ + direct_size + max_number_size),
+            text_size_(0), pending_(0), direct_(false)
+        {
+            segments_.reserve(max_segments);
+        }
+
+        bool empty() const { return pending_ == 0; }
+        bool has_direct() const { return direct_; }
+
+        void append(std::size_t number, const char* data, std::size_t size)
+        {
+            if (segments_.size() + 3 > max_segments)
+                flush();
+
+            char digits[max_number_size];
+            char* first = digits + sizeof(digits);
+            do
+                *--first = static_cast<char>('0' + number % 10);
+            while (number /= 10);
+            copy(first, digits + sizeof(digits) - first);
+            copy(": ", 2);
+
+            if (size >= direct_size)
+            {
+                segments_.push_back(boost::asio::const_buffer(data, size));
+                pending_ += size;
+                direct_ = true;
+            }
+            else
+                copy(data, size);
+            copy("\n", 1);
+
+            if (pending_ >= flush_bytes_)
+                flush();
+        }
+
+        void flush()
+        {
+            if (pending_ != 0)
+                write_all();
+            segments_.clear();
+            text_size_ = 0;
+            pending_ = 0;
+            direct_ = false;
+        }
+
+    private:
+        // Copy into the text buffer, extending the last segment when it ends
+        // where the copy starts.
+        void copy(const char* data, std::size_t size)
+        {
+            char* dest = &text_[text_size_];
+            std::memcpy(dest, data, size);
+            text_size_ += size;
+            pending_ += size;
+
+            if (!segments_.empty())
+            {
+                boost::asio::const_buffer& last = segments_.back();
+                if (static_cast<const char*>(last.data()) + last.size() == dest)
+                {
+                    last = boost::asio::const_buffer(last.data(), last.size() + size);
+                    return;
+                }
+            }
+            segments_.push_back(boost::asio::const_buffer(dest, size));
+        }
+
+#if !defined(BOOST_ASIO_WINDOWS)
+        void write_all()
+        {
+            ::iovec iov[max_segments];
+            std::size_t count = segments_.size();
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                iov[i].iov_base = const_cast<void*>(segments_[i].data());
+                iov[i].iov_len = segments_[i].size();
+            }
+
+            ::iovec* next = iov;
+            while (count != 0)
+            {
+                ssize_t n = ::writev(fd_, next, static_cast<int>(count));
+                if (n < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    {
+                        ::pollfd p = { fd_, POLLOUT, 0 };
+                        ::poll(&p, 1, -1);
+                        continue;
+                    }
+                    throw_error("writev");
+                }
+
+                // Skip what was written, which may end inside a segment.
+                std::size_t written = static_cast<std::size_t>(n);
+                while (count != 0 && written >= next->iov_len)
+                {
+                    written -= next->iov_len;
+                    ++next;
+                    --count;
+                }
+                if (count != 0)
+                {
+                    next->iov_base = static_cast<char*>(next->iov_base) + written;
+                    next->iov_len -= written;
+                }
+            }
+        }
+#else // !defined(BOOST_ASIO_WINDOWS)
+        // No gather write for CRT descriptors: write the segments in turn.
+        void write_all()
+        {
+            for (const boost::asio::const_buffer& segment : segments_)
+            {
+                const char* data = static_cast<const char*>(segment.data());
+                std::size_t size = segment.size();
+                while (size != 0)
+                {
+                    unsigned chunk = static_cast<unsigned>(
+                        std::min<std::size_t>(size, 1 << 30));
+                    int n = ::_write(fd_, data, chunk);
+                    if (n < 0)
+                        throw_error("_write");
+                    data += n;
+                    size -= n;
+                }
+            }
+        }
+#endif // !defined(BOOST_ASIO_WINDOWS)
+
+        static void throw_error(const char* what)
+        {
+            boost::system::error_code ec(errno,
+                boost::asio::error::get_system_category());
+            boost::asio::detail::throw_error(ec, what);
+        }
+
+        int fd_;
+        std::size_t flush_bytes_;
+        std::vector<char> text_;
+        std::size_t text_size_;
+        std::size_t pending_;
+        bool direct_;
+        std::vector<boost::asio::const_buffer> segments_;
+    };
+
+    line_writer_options options_;
+};
+
+
+TEST(asio, Executor)
+{
+    boost::asio::thread_pool pool;
+
+    auto f = pipeline(reader, filter<std::string>,
+        bind_executor(pool, upper<std::string>), line_writer<std::string>());
+    f.wait();
+}
+
+
+
+// Stages for comparing queue backends: a source, a relay and a sink passing
+// integers through two links of the given policy.
+const std::size_t queue_bench_messages = 1000000;
+
+template <class Policy>
+void bench_source(queue_front<std::size_t, Policy> out)
+{
+    for (std::size_t i = 0; i < queue_bench_messages; ++i)
+        out.push(i);
+}
+
+template <class Policy>
+void bench_relay(queue_back<std::size_t, Policy> in,
+    queue_front<std::size_t, Policy> out)
+{
+    std::size_t n;
+    while (in.pop(n))
+        out.push(n);
+}
+
+template <class Policy>
+void bench_sink(queue_back<std::size_t, Policy> in)
+{
+    std::size_t n, expected = 0;
+    while (in.pop(n))
+        EXPECT_EQ(expected++, n);
+    EXPECT_EQ(queue_bench_messages, expected);
+}
+
+template <class Policy>
+void bench_queue(const char* name)
+{
+    auto start = std::chrono::steady_clock::now();
+    pipeline(bench_source<Policy>, bench_relay<Policy>, bench_sink<Policy>).wait();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << name << ": " << queue_bench_messages / elapsed.count()
+        << " msg/s" << std::endl;
+}
+
+TEST(asio, QueueBackends)
+{
+    bench_queue<locked_queue>("locked_queue");
+    bench_queue<spsc_ring<1024>>("spsc_ring<1024>");
+    bench_queue<spsc_ring<64>>("spsc_ring<64>");
+}
+
+// Stages for comparing per-item and batched transfers of strings.
+template <class Policy>
+void bench_line_source(queue_front<std::string, Policy> out)
+{
+    std::vector<std::string> batch;
+    for (std::size_t i = 0; i < queue_bench_messages; ++i)
+    {
+        batch.push_back("a line of text");
+        if (batch.size() == 256)
+        {
+            out.push_batch(batch);
+            batch.clear();
+        }
+    }
+    out.push_batch(batch);
+}
+
+template <class Policy>
+void bench_line_relay(queue_back<std::string, Policy> in,
+    queue_front<std::string, Policy> out)
+{
+    std::string line;
+    while (in.pop(line))
+        out.push(std::move(line));
+}
+
+template <class Policy>
+void bench_line_batch_relay(queue_back<std::string, Policy> in,
+    queue_front<std::string, Policy> out)
+{
+    run_batched(in, out,
+        [](item_span<std::string> lines) { return lines.size(); });
+}
+
+template <class Policy>
+void bench_line_sink(queue_back<std::string, Policy> in)
+{
+    std::vector<std::string> buffer(256);
+    std::size_t count = 0;
+    while (std::size_t n = in.pop_batch(buffer).size())
+        count += n;
+    EXPECT_EQ(queue_bench_messages, count);
+}
+
+template <class Policy>
+void bench_batching(const char* name)
+{
+    auto start = std::chrono::steady_clock::now();
+    pipeline(bench_line_source<Policy>, bench_line_relay<Policy>,
+        bench_line_sink<Policy>).wait();
+    std::chrono::duration<double> per_item =
+        std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    pipeline(bench_line_source<Policy>, bench_line_batch_relay<Policy>,
+        bench_line_sink<Policy>).wait();
+    std::chrono::duration<double> batched =
+        std::chrono::steady_clock::now() - start;
+
+    std::cout << name << ": per item "
+        << queue_bench_messages / per_item.count() << " msg/s, batched "
+        << queue_bench_messages / batched.count() << " msg/s" << std::endl;
+}
+
+TEST(asio, QueueBatching)
+{
+    bench_batching<locked_queue>("locked_queue");
+    bench_batching<spsc_ring<1024>>("spsc_ring<1024>");
+}
+
+TEST(asio, ThreadExecutor)
+{
+    // A context of its own, so that threads other tests left in the system
+    // executor's cache are not counted.
+    boost::asio::execution_context context;
+    thread_executor ex(context);
+    const int runs = 10000;
+
+    // Run short functions one after another and wait for each, as a pipeline
+    // with many short stages would.
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < runs; ++i)
+        boost::asio::post(ex, boost::asio::use_future([] {})).wait();
+    std::chrono::duration<double> cached =
+        std::chrono::steady_clock::now() - start;
+
+    // The future is ready before the thread that ran the function has parked
+    // again, so now and then the next function starts a thread of its own.
+    // Most must still find a parked one.
+    EXPECT_LT(ex.thread_count(), std::size_t(runs / 100));
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < runs; ++i)
+        std::thread([] {}).join();
+    std::chrono::duration<double> spawned =
+        std::chrono::steady_clock::now() - start;
+
+    std::cout << "cached threads: " << cached.count() / runs * 1e6
+        << " us per function, new thread: " << spawned.count() / runs * 1e6
+        << " us per function" << std::endl;
+
+    {
+        boost::asio::executor_work_guard<thread_executor> work(ex);
+        EXPECT_EQ(1u, ex.outstanding_work());
+    }
+    EXPECT_EQ(0u, ex.outstanding_work());
+}
+
+TEST(asio, WorkStealingPool)
+{
+    // Tasks that fork more tasks from inside the pool.
+    {
+        work_stealing_pool pool(4);
+        std::atomic<int> count(0);
+        std::function<void(int)> fork = [&](int depth)
+            {
+                ++count;
+                if (depth > 0)
+                {
+                    boost::asio::post(pool, [&fork, depth] { fork(depth - 1); });
+                    boost::asio::post(pool, [&fork, depth] { fork(depth - 1); });
+                }
+            };
+        boost::asio::post(pool, [&fork] { fork(12); });
+        pool.join();
+        EXPECT_EQ((1 << 13) - 1, count.load());
+    }
+}
+
+// Stages for the replicated stage benchmark: a CPU-bound transform between a
+// numbered source and a sink that checks the order is preserved.
+const std::uint64_t parallel_bench_items = 20000;
+
+void numbers(queue_front<std::uint64_t> out)
+{
+    for (std::uint64_t i = 0; i < parallel_bench_items; ++i)
+        out.push(i);
+}
+
+void mix(queue_back<std::uint64_t> in, queue_front<std::uint64_t> out)
+{
+    std::uint64_t n;
+    while (in.pop(n))
+    {
+        std::uint64_t h = n;
+        for (int i = 0; i < 2000; ++i)
+            h = (h ^ (h >> 31)) * 0x9e3779b97f4a7c15ull + i;
+
+        // Drop odd items so replicas emit uneven batches. The hash test keeps
+        // the work above from being optimized away; it never fails.
+        if (n % 2 == 0 && h != 0)
+            out.push(n);
+    }
+}
+
+void check_order(queue_back<std::uint64_t> in)
+{
+    std::uint64_t n, expected = 0;
+    while (in.pop(n))
+    {
+        EXPECT_EQ(expected, n);
+        expected = n + 2;
+    }
+    EXPECT_EQ(parallel_bench_items, expected);
+}
+
+TEST(asio, ParallelStage)
+{
+    for (std::size_t threads = 1; threads <= 32; threads *= 2)
+    {
+        work_stealing_pool pool(threads);
+
+        auto start = std::chrono::steady_clock::now();
+        pipeline(numbers, boost::asio::bind_executor(pool, parallel(threads, mix)),
+            check_order).wait();
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+
+        std::cout << threads << " threads: "
+            << parallel_bench_items / elapsed.count() << " items/s" << std::endl;
+    }
+}
+
+// An intermediate stage that fails part way through its input.
+template <class Policy>
+void fail_midway(queue_back<std::size_t, Policy> in,
+    queue_front<std::size_t, Policy> out)
+{
+    std::size_t n;
+    while (in.pop(n))
+    {
+        if (n == 1000)
+            throw std::runtime_error("stage failed");
+        out.push(n);
+    }
+}
+
+void fail_midway_parallel(queue_back<std::uint64_t> in,
+    queue_front<std::uint64_t> out)
+{
+    std::uint64_t n;
+    while (in.pop(n))
+    {
+        if (n == 1000)
+            throw std::runtime_error("stage failed");
+        out.push(n);
+    }
+}
+
+template <class T, class Policy>
+void discard(queue_back<T, Policy> in)
+{
+    T n;
+    while (in.pop(n))
+    {
+    }
+}
+
+TEST(asio, PipelineError)
+{
+    // The source runs on after the failure and fills the bounded ring well
+    // past its capacity; the failed stage must keep draining it.
+    {
+        std::future<void> f = pipeline(bench_source<spsc_ring<>>,
+            fail_midway<spsc_ring<>>, discard<std::size_t, spsc_ring<>>);
+        EXPECT_THROW(f.get(), std::runtime_error);
+    }
+    {
+        std::future<void> f = pipeline(bench_source<locked_queue>,
+            fail_midway<locked_queue>, discard<std::size_t, locked_queue>);
+        EXPECT_THROW(f.get(), std::runtime_error);
+    }
+
+    // One replica fails while the others carry on.
+    {
+        work_stealing_pool pool(4);
+        std::future<void> f = pipeline(numbers,
+            boost::asio::bind_executor(pool, parallel(4, fail_midway_parallel)),
+            discard<std::uint64_t, locked_queue>);
+        EXPECT_THROW(f.get(), std::runtime_error);
+    }
+
+    // The last stage's own exception comes through unchanged.
+    {
+        std::function<void(queue_back<std::size_t, locked_queue>)> sink =
+            [](queue_back<std::size_t, locked_queue>)
+            {
+                throw std::runtime_error("sink failed");
+            };
+        std::future<void> f = pipeline(bench_source<locked_queue>, sink);
+        EXPECT_THROW(f.get(), std::runtime_error);
+    }
+}
+
+// Reference source for the reader benchmark: std::getline on a file stream,
+// one std::string per line.
+class getline_reader
+{
+public:
+    typedef queue_front<std::string> argument_type;
+
+    explicit getline_reader(std::string path)
+        : path_(std::move(path))
+    {
+    }
+
+    void operator()(queue_front<std::string> out) const
+    {
+        std::ifstream is(path_.c_str());
+        std::string line;
+        while (std::getline(is, line))
+            out.push(line);
+    }
+
+private:
+    std::string path_;
+};
+
+template <class Line>
+void count_bytes(queue_back<Line> in)
+{
+    std::vector<Line> buffer(256);
+    std::size_t lines = 0, bytes = 0;
+    while (std::size_t n = in.pop_batch(buffer).size())
+    {
+        lines += n;
+        for (std::size_t i = 0; i < n; ++i)
+            bytes += buffer[i].length();
+    }
+    std::cout << lines << " lines, " << bytes << " bytes kept" << std::endl;
+}
+
+TEST(asio, MappedLineReader)
+{
+    const char* path = "mapped_line_reader_test.txt";
+
+    // Small file, read both mapped and in chunks small enough to split lines.
+    {
+        std::ofstream os(path);
+        os << "hello world\nshort\n\nanother long line\nno newline at end";
+    }
+    for (std::size_t chunk_size : { std::size_t(1) << 20, std::size_t(7) })
+    {
+        std::vector<std::string> lines;
+        std::function<void(queue_back<line_slice>)> collect =
+            [&lines](queue_back<line_slice> in)
+            {
+                line_slice line;
+                while (in.pop(line))
+                    lines.push_back(line.str());
+            };
+        pipeline(mapped_line_reader(path, chunk_size), filter<line_slice>,
+            upper<line_slice>, collect).wait();
+
+        std::vector<std::string> expected =
+            { "HELLO WORLD", "ANOTHER LONG LINE", "NO NEWLINE AT END" };
+        EXPECT_EQ(expected, lines);
+    }
+
+    // A missing file is an error, not an empty stream.
+    {
+        auto impl = std::make_shared<queue_front<line_slice>::impl_type>();
+        EXPECT_THROW(mapped_line_reader("mapped_line_reader_missing.txt")(
+            queue_front<line_slice>(impl)), boost::system::system_error);
+
+        // Through a pipeline, the error reaches the caller by way of the
+        // future.
+        std::future<void> f = pipeline(
+            mapped_line_reader("mapped_line_reader_missing.txt"),
+            filter<line_slice>, count_bytes<line_slice>);
+        EXPECT_THROW(f.get(), boost::system::system_error);
+    }
+
+    // Throughput against std::getline on a larger file.
+    {
+        std::ofstream os(path);
+        for (int i = 0; i < 500000; ++i)
+            os << "line " << i << " of the mapped line reader benchmark\n";
+    }
+    boost::asio::thread_pool pool;
+
+    auto start = std::chrono::steady_clock::now();
+    pipeline(getline_reader(path), filter<std::string>,
+        bind_executor(pool, upper<std::string>), count_bytes<std::string>).wait();
+    std::chrono::duration<double> getline_time =
+        std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    pipeline(mapped_line_reader(path), filter<line_slice>,
+        bind_executor(pool, upper<line_slice>), count_bytes<line_slice>).wait();
+    std::chrono::duration<double> mapped_time =
+        std::chrono::steady_clock::now() - start;
+
+    std::cout << "getline: " << getline_time.count() << "s, mapped: "
+        << mapped_time.count() << "s" << std::endl;
+    std::remove(path);
+}
+
+// The loop the upper stage used to run: a new string built one
+// locale-aware toupper at a time.
+void upper_push_back(std::string& line)
+{
+    std::string new_line;
+    for (char c : line)
+        new_line.push_back(static_cast<char>(
+            std::toupper(static_cast<unsigned char>(c))));
+    line.swap(new_line);
+}
+
+void upper_in_place(std::string& line)
+{
+    for (char& c : line)
+        c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+}
+
+template <ascii::case_kernel Kernel>
+void upper_kernel(std::string& line)
+{
+    if (!line.empty())
+        Kernel(&line[0], line.size());
+}
+
+TEST(asio, AsciiUpper)
+{
+    typedef void (*upper_function)(std::string&);
+    std::vector<std::pair<const char*, upper_function> > variants;
+    variants.emplace_back("push_back", &upper_push_back);
+    variants.emplace_back("in place", &upper_in_place);
+    variants.emplace_back("scalar", &upper_kernel<ascii::detail::convert_scalar<'a', 'z'> >);
+#if defined(ASCII_CASE_HAS_X86_KERNELS)
+    variants.emplace_back("sse2", &upper_kernel<ascii::detail::convert_sse2<'a', 'z'> >);
+    if (ascii::detail::cpu_has_avx2())
+        variants.emplace_back("avx2", &upper_kernel<ascii::detail::convert_avx2<'a', 'z'> >);
+#endif // defined(ASCII_CASE_HAS_X86_KERNELS)
+    variants.emplace_back("dispatch", &upper_kernel<&ascii::to_upper>);
+
+    // Every byte value at every length and offset around the vector widths.
+    std::string all;
+    for (int i = 0; i < 256; ++i)
+        all.push_back(static_cast<char>(i));
+    all += all;
+    for (std::size_t offset = 0; offset < 33; ++offset)
+    {
+        for (std::size_t size = 0; size + offset <= all.size(); size += 7)
+        {
+            std::string expected = all.substr(offset, size);
+            for (char& c : expected)
+                if (c >= 'a' && c <= 'z')
+                    c = static_cast<char>(c - 'a' + 'A');
+            for (auto& variant : variants)
+            {
+                if (variant.second == &upper_push_back
+                    || variant.second == &upper_in_place)
+                    continue;
+                std::string line = all.substr(offset, size);
+                variant.second(line);
+                ASSERT_EQ(expected, line) << variant.first;
+            }
+        }
+    }
+
+    std::string lower = "abc";
+    ascii::to_lower(&lower[0], 0);
+    EXPECT_EQ("abc", lower);
+    std::string mixed = "Hello, World! 123 \xc3\xa9";
+    ascii::to_lower(&mixed[0], mixed.size());
+    EXPECT_EQ("hello, world! 123 \xc3\xa9", mixed);
+
+    // Throughput over the same 16 MB of text cut into lines of each size.
+    const std::size_t total = std::size_t(16) << 20;
+    for (std::size_t size = 16; size <= 64 * 1024; size *= 4)
+    {
+        std::vector<std::string> lines(total / size);
+        for (std::size_t i = 0; i < lines.size(); ++i)
+            for (std::size_t j = 0; j < size; ++j)
+                lines[i].push_back("the quick brown fox jumps over the lazy dog, "
+                    "THE QUICK BROWN FOX\n"[(i + j) % 65]);
+
+        std::cout << size << " B lines:";
+        for (auto& variant : variants)
+        {
+            std::vector<std::string> work = lines;
+            auto start = std::chrono::steady_clock::now();
+            for (std::string& line : work)
+                variant.second(line);
+            std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+            EXPECT_EQ(size, work.back().size());
+            std::cout << " " << variant.first << " "
+                << total / elapsed.count() / 1e9 << " GB/s,";
+        }
+        std::cout << std::endl;
+    }
+}
+
+// The sink the pipeline used to end with: one flush per line.
+template <class Line>
+void endl_writer(queue_back<Line> in)
+{
+    std::size_t count = 0;
+    Line line;
+    while (in.pop(line))
+        std::cout << count++ << ": " << line << std::endl;
+}
+
+std::string read_file(const char* path)
+{
+    std::ifstream is(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(is),
+        std::istreambuf_iterator<char>());
+}
+
+const std::size_t writer_bench_lines = 2000000;
+
+void writer_bench_source(queue_front<std::string> out)
+{
+    std::vector<std::string> batch;
+    for (std::size_t i = 0; i < writer_bench_lines; ++i)
+    {
+        // Mostly short lines with the occasional one long enough to be
+        // written without copying.
+        batch.push_back(i % 1000 == 999
+            ? std::string(5000, 'x')
+            : "line " + std::to_string(i) + " of the writer benchmark");
+        if (batch.size() == 256)
+        {
+            out.push_batch(batch);
+            batch.clear();
+        }
+    }
+    out.push_batch(batch);
+}
+
+TEST(asio, LineWriter)
+{
+    const char* path = "line_writer_test.txt";
+
+    // Output is flushed within flush_interval while the pipeline is idle.
+    {
+        std::FILE* file = std::fopen(path, "wb");
+        ASSERT_TRUE(file != nullptr);
+        line_writer_options options;
+        options.fd = fileno(file);
+        options.flush_interval = std::chrono::milliseconds(10);
+
+        std::size_t size_while_idle = 0;
+        std::function<void(queue_front<std::string>)> source =
+            [&](queue_front<std::string> out)
+            {
+                out.push("first line");
+                std::this_thread::sleep_for(std::chrono::milliseconds(200));
+                size_while_idle = read_file(path).size();
+                out.push(std::string(10000, 'y'));
+            };
+        pipeline(source, line_writer<std::string>(options)).wait();
+        std::fclose(file);
+
+        EXPECT_EQ(std::strlen("0: first line\n"), size_while_idle);
+        EXPECT_EQ("0: first line\n1: " + std::string(10000, 'y') + "\n",
+            read_file(path));
+    }
+
+    // Throughput against the endl writer, both writing the same file.
+    auto start = std::chrono::steady_clock::now();
+    {
+        std::ofstream os(path, std::ios::binary);
+        std::streambuf* cout_buf = std::cout.rdbuf(os.rdbuf());
+        pipeline(writer_bench_source, endl_writer<std::string>).wait();
+        std::cout.rdbuf(cout_buf);
+    }
+    std::chrono::duration<double> endl_time =
+        std::chrono::steady_clock::now() - start;
+    std::string endl_output = read_file(path);
+
+    start = std::chrono::steady_clock::now();
+    {
+        std::FILE* file = std::fopen(path, "wb");
+        ASSERT_TRUE(file != nullptr);
+        line_writer_options options;
+        options.fd = fileno(file);
+        pipeline(writer_bench_source, line_writer<std::string>(options)).wait();
+        std::fclose(file);
+    }
+    std::chrono::duration<double> buffered_time =
+        std::chrono::steady_clock::now() - start;
+
+    EXPECT_TRUE(endl_output == read_file(path));
+    std::cout << writer_bench_lines << " lines, endl: " << endl_time.count()
+        << "s, buffered: " << buffered_time.count() << "s" << std::endl;
+    std::remove(path);
+}
+
+template <class Policy>
+void check_pipeline_stats(const char* name)
+{
+    pipeline_stats stats;
+    auto f = stats.run(bench_line_source<Policy>, bench_line_relay<Policy>,
+        bench_line_sink<Policy>);
+
+    // Snapshots taken while the pipeline runs never show more items out of
+    // a queue than went in.
+    while (f.wait_for(std::chrono::milliseconds(1)) != std::future_status::ready)
+        for (const queue_stats_snapshot& q : stats.snapshot())
+            EXPECT_LE(q.popped, q.pushed);
+    f.get();
+
+    std::vector<queue_stats_snapshot> queues = stats.snapshot();
+#if defined(PIPELINE_ENABLE_STATS)
+    ASSERT_EQ(2u, queues.size());
+    for (const queue_stats_snapshot& q : queues)
+    {
+        EXPECT_EQ(queue_bench_messages, q.pushed);
+        EXPECT_EQ(queue_bench_messages, q.popped);
+        EXPECT_GE(q.high_water, 1u);
+        EXPECT_NE(0, q.stopped_at_ns);
+        EXPECT_NE(0, q.drained_at_ns);
+    }
+#else // defined(PIPELINE_ENABLE_STATS)
+    EXPECT_TRUE(queues.empty());
+#endif // defined(PIPELINE_ENABLE_STATS)
+
+    std::cout << name << ": ";
+    stats.write_json(std::cout);
+    std::cout << std::endl;
+}
+
+TEST(asio, PipelineStats)
+{
+    check_pipeline_stats<locked_queue>("locked_queue");
+    check_pipeline_stats<spsc_ring<64>>("spsc_ring<64>");
+}
@@ -1,20 +1,67 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
 
 #include <boost/noncopyable.hpp>
 #include <boost/aligned_storage.hpp>
 
 #include <boost/asio.hpp>
 
+#if defined(__linux__)
+# include <unistd.h>
+#endif // defined(__linux__)
+
+#include "latency_histogram.hpp"
+#include "uring_queue.hpp"
+
 using namespace boost::asio;
 
+// Number of slots, and of bytes in them, over the first n of a table of size
+// classes. These are free functions so that a class can use them on its own
+// table while it is still being defined.
+template <class SizeClass, std::size_t N>
+constexpr std::size_t total_slots(const SizeClass (&classes)[N],
+    std::size_t n = N)
+{
+    return n == 0 ? 0 : classes[n - 1].slot_count + total_slots(classes, n - 1);
+}
+
+template <class SizeClass, std::size_t N>
+constexpr std::size_t total_bytes(const SizeClass (&classes)[N],
+    std::size_t n = N)
+{
+    return n == 0 ? 0 : classes[n - 1].slot_size * classes[n - 1].slot_count
+        + total_bytes(classes, n - 1);
+}
+
+// Per-session memory for handler-based custom allocation. The storage is split
+// into several size classes, each holding a fixed number of slots, and a bitmap
+// records which slots are free. A request is served from the smallest class
+// with a free slot that is large enough, so a read and a write handler can be
+// outstanding at the same time without touching the global heap. Requests that
+// cannot be served from a slot fall back to ::operator new.
 class handler_memory
 {
 public:
     handler_memory()
-        : in_use_(false)
+        : free_slots_((1u << slot_count) - 1), hits_(0), fallbacks_(0)
     {
     }
 
@@ -23,53 +70,358 @@ public:
 
     void* allocate(std::size_t size)
     {
-        if (!in_use_ && size < sizeof(storage_))
+        std::size_t offset = 0;
+        std::size_t slot = 0;
+        for (std::size_t c = 0; c < class_count; ++c)
+        {
+            const size_class& sc = classes[c];
+            if (size <= sc.slot_size)
+            {
+                for (std::size_t i = 0; i < sc.slot_count; ++i)
+                {
+                    unsigned bit = 1u << (slot + i);
+                    if (free_slots_ & bit)
+                    {
+                        free_slots_ &= ~bit;
+                        ++hits_;
+                        return &storage_[offset + i * sc.slot_size];
+                    }
+                }
+            }
+            offset += sc.slot_size * sc.slot_count;
+            slot += sc.slot_count;
+        }
+
+        ++fallbacks_;
+        return ::operator new(size);
+    }
+
+    void deallocate(void* pointer)
+    {
+        char* p = static_cast<char*>(pointer);
+        if (p < storage_ || p >= storage_ + sizeof(storage_))
+        {
+            ::operator delete(pointer);
+            return;
+        }
+
+        std::size_t offset = p - storage_;
+        std::size_t slot = 0;
+        for (std::size_t c = 0; c < class_count; ++c)
+        {
+            const size_class& sc = classes[c];
+            std::size_t class_bytes = sc.slot_size * sc.slot_count;
+            if (offset < class_bytes)
+            {
+                free_slots_ |= 1u << (slot + offset / sc.slot_size);
+                return;
+            }
+            offset -= class_bytes;
+            slot += sc.slot_count;
+        }
+    }
+
+    // Number of allocations served from the slots.
+    std::size_t hits() const noexcept
+    {
+        return hits_;
+    }
+
+    // Number of allocations that fell back to ::operator new.
+    std::size_t fallbacks() const noexcept
+    {
+        return fallbacks_;
+    }
+
+private:
+    // A size class: every slot in it holds up to slot_size bytes.
+    struct size_class
+    {
+        std::size_t slot_size;
+        std::size_t slot_count;
+    };
+
+    // The size classes, smallest first. Slot sizes are multiples of the
+    // strictest fundamental alignment so every slot is suitably aligned.
+    static constexpr std::size_t class_count = 4;
+    static constexpr size_class classes[class_count] =
+    {
+        { 128, 2 }, { 256, 2 }, { 512, 1 }, { 1024, 1 }
+    };
+
+    // Totals over the classes above.
+    static constexpr std::size_t slot_count = total_slots(classes);
+    static constexpr std::size_t storage_size = total_bytes(classes);
+    static_assert(slot_count < sizeof(unsigned) * CHAR_BIT,
+        "too many slots for the free slot bitmap");
+
+    // Storage space used for handler-based custom memory allocation.
+    alignas(std::max_align_t) char storage_[storage_size];
+
+    // Bitmap of free slots, one bit per slot in size class order.
+    unsigned free_slots_;
+
+    // Allocation counters.
+    std::size_t hits_;
+    std::size_t fallbacks_;
+};
+
+constexpr handler_memory::size_class handler_memory::classes[];
+
+
+// Thread-local cache of handler blocks that recycles memory across sessions.
+// Every block carries a small header naming the cache that owns it. Blocks
+// freed on the owning thread go straight back onto its free lists; blocks
+// freed on any other thread are pushed onto the owner's lock-free return stack
+// and collected the next time the owner runs short.
+class handler_block_cache
+{
+public:
+    // Counters for one cache.
+    struct statistics
+    {
+        std::size_t hits = 0;         // Served from a free list.
+        std::size_t misses = 0;       // New block taken from the heap.
+        std::size_t fallbacks = 0;    // Too large for any size class.
+        std::size_t remote_frees = 0; // Returned by another thread.
+    };
+
+    handler_block_cache(const handler_block_cache&) = delete;
+    handler_block_cache& operator=(const handler_block_cache&) = delete;
+
+    // Get the cache belonging to the calling thread.
+    static handler_block_cache& local()
+    {
+        static thread_local cache_holder holder;
+        return *holder.cache;
+    }
+
+    void* allocate(std::size_t size)
+    {
+        std::size_t c = 0;
+        while (c < class_count && size > class_size(c))
+            ++c;
+
+        block_header* block;
+        if (c == class_count)
         {
-            in_use_ = true;
-            return &storage_;
+            ++stats_.fallbacks;
+            block = new_block(nullptr, c, size);
         }
         else
         {
-            return ::operator new(size);
+            if (!free_[c])
+                collect_returns();
+
+            block = free_[c];
+            if (block)
+            {
+                free_[c] = block->next;
+                --free_count_[c];
+                ++stats_.hits;
+            }
+            else
+            {
+                ++stats_.misses;
+                block = new_block(this, c, class_size(c));
+            }
         }
+        return block + 1;
     }
 
-    void deallocate(void* pointer)
+    static void deallocate(void* pointer)
     {
-        if (pointer == &storage_)
+        block_header* block = static_cast<block_header*>(pointer) - 1;
+        if (!block->owner)
+        {
+            ::operator delete(block);
+            return;
+        }
+
+        if (block->owner == &local())
         {
-            in_use_ = false;
+            block->owner->recycle(block);
         }
         else
         {
-            ::operator delete(pointer);
+            // Lock-free push onto the owner's return stack. Only the owner
+            // ever pops, and it takes the whole stack at once, so there is no
+            // ABA hazard.
+            std::atomic<block_header*>& head = block->owner->returned_;
+            block->next = head.load(std::memory_order_relaxed);
+            while (!head.compare_exchange_weak(block->next, block,
+                std::memory_order_release, std::memory_order_relaxed))
+            {
+            }
         }
     }
 
+    const statistics& stats() const noexcept
+    {
+        return stats_;
+    }
+
 private:
-    // Storage space used for handler-based custom memory allocation.
-    typename std::aligned_storage<1024>::type storage_;
+    // Header placed in front of every block. Its alignment keeps the user part
+    // of the block suitably aligned for any handler.
+    struct alignas(std::max_align_t) block_header
+    {
+        handler_block_cache* owner;
+        std::size_t size_class;
+        block_header* next;
+    };
+
+    // Size classes match those of handler_memory.
+    static constexpr std::size_t class_count = 4;
+
+    static constexpr std::size_t class_size(std::size_t c)
+    {
+        return std::size_t(128) << c;
+    }
+
+    // Upper bound on idle blocks kept per size class. Blocks freed beyond it go
+    // back to the heap so that a burst does not pin memory forever.
+    static constexpr std::size_t max_cached_blocks = 4096;
+
+    // Caches are never destroyed. When a thread exits its cache is parked here
+    // and handed to the next thread that needs one, so blocks still in flight
+    // always have a live owner to return to.
+    struct registry
+    {
+        std::mutex mutex;
+        std::vector<handler_block_cache*> idle;
+    };
+
+    static registry& caches()
+    {
+        static registry* r = new registry;
+        return *r;
+    }
+
+    struct cache_holder
+    {
+        cache_holder()
+        {
+            registry& r = caches();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            if (r.idle.empty())
+            {
+                cache = new handler_block_cache;
+            }
+            else
+            {
+                cache = r.idle.back();
+                r.idle.pop_back();
+            }
+        }
+
+        ~cache_holder()
+        {
+            registry& r = caches();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            r.idle.push_back(cache);
+        }
+
+        handler_block_cache* cache;
+    };
+
+    handler_block_cache()
+        : returned_(nullptr)
+    {
+        for (std::size_t c = 0; c < class_count; ++c)
+        {
+            free_[c] = nullptr;
+            free_count_[c] = 0;
+        }
+    }
+
+    static block_header* new_block(handler_block_cache* owner,
+        std::size_t size_class, std::size_t size)
+    {
+        block_header* block = static_cast<block_header*>(
+            ::operator new(sizeof(block_header) + size));
+        block->owner = owner;
+        block->size_class = size_class;
+        return block;
+    }
+
+    void recycle(block_header* block)
+    {
+        std::size_t c = block->size_class;
+        if (free_count_[c] >= max_cached_blocks)
+        {
+            ::operator delete(block);
+            return;
+        }
+
+        block->next = free_[c];
+        free_[c] = block;
+        ++free_count_[c];
+    }
+
+    void collect_returns()
+    {
+        block_header* block = returned_.exchange(nullptr,
+            std::memory_order_acquire);
+        while (block)
+        {
+            block_header* next = block->next;
+            ++stats_.remote_frees;
+            recycle(block);
+            block = next;
+        }
+    }
+
+    // Per size class free lists, touched only by the owning thread.
+    block_header* free_[class_count];
+    std::size_t free_count_[class_count];
+
+    // Blocks returned by other threads.
+    std::atomic<block_header*> returned_;
+
+    statistics stats_;
+};
+
+// Handler memory backed by the calling thread's handler_block_cache. It holds
+// no storage of its own, so an idle session pins nothing beyond the handlers it
+// actually has outstanding.
+class recycling_handler_memory
+{
+public:
+    recycling_handler_memory() = default;
+
+    recycling_handler_memory(const recycling_handler_memory&) = delete;
+    recycling_handler_memory& operator=(const recycling_handler_memory&) = delete;
+
+    void* allocate(std::size_t size)
+    {
+        return handler_block_cache::local().allocate(size);
+    }
 
-    // Whether the handler-based custom allocation storage has been used.
-    bool in_use_;
+    void deallocate(void* pointer)
+    {
+        handler_block_cache::deallocate(pointer);
+    }
 };
 
 
 // The allocator to be associated with the handler objects. This allocator only
-// needs to satisfy the C++11 minimal allocator requirements.
-template <typename T>
+// needs to satisfy the C++11 minimal allocator requirements. The Memory type
+// selects the backend: handler_memory embeds a slab pool in each session,
+// recycling_handler_memory shares a per-thread cache between sessions.
+template <typename T, typename Memory = handler_memory>
 class handler_allocator
 {
 public:
     using value_type = T;
 
-    explicit handler_allocator(handler_memory& mem)
+    explicit handler_allocator(Memory& mem)
         : memory_(mem)
     {
     }
 
     template <typename U>
-    handler_allocator(const handler_allocator<U>& other) noexcept
+    handler_allocator(const handler_allocator<U, Memory>& other) noexcept
         : memory_(other.memory_)
     {
     }
@@ -95,19 +447,19 @@ public:
     }
 
 private:
-    template <typename> friend class handler_allocator;
+    template <typename, typename> friend class handler_allocator;
 
     // The underlying memory.
-    handler_memory& memory_;
+    Memory& memory_;
 };
 
-template <typename Handler>
+template <typename Handler, typename Memory = handler_memory>
 class custom_alloc_handler
 {
 public:
-    using allocator_type = handler_allocator<Handler>;
+    using allocator_type = handler_allocator<Handler, Memory>;
 
-    explicit custom_alloc_handler(handler_memory& m, Handler h) 
+    explicit custom_alloc_handler(Memory& m, Handler h) 
         : memory_(m), handler_(h)
     {
     }
@@ -124,24 +476,25 @@ public:
     }
 
 private:
-    handler_memory& memory_;
+    Memory& memory_;
     Handler handler_;
 };
 
 // Helper
-template <typename Handler>
-inline custom_alloc_handler<Handler> make_custom_alloc_handler(
-    handler_memory& m, Handler h)
+template <typename Memory, typename Handler>
+inline custom_alloc_handler<Handler, Memory> make_custom_alloc_handler(
+    Memory& m, Handler h)
 {
-    return custom_alloc_handler<Handler>(m, h);
+    return custom_alloc_handler<Handler, Memory>(m, h);
 }
 
-class session
-    : public std::enable_shared_from_this<session>
+template <typename Memory>
+class basic_session
+    : public std::enable_shared_from_this<basic_session<Memory>>
 {
 
 public:
-    session(ip::tcp::socket socket)
+    basic_session(ip::tcp::socket socket)
         : socket_(std::move(socket))
     {
     }
@@ -151,9 +504,14 @@ public:
         do_read();
     }
 
+    const Memory& memory() const
+    {
+        return handler_memory_;
+    }
+
     void do_read()
     {
-        auto self(shared_from_this());
+        auto self(this->shared_from_this());
         socket_.async_read_some(boost::asio::buffer(data_),
             make_custom_alloc_handler(handler_memory_,
                 [this, self](boost::system::error_code ec, std::size_t length)
@@ -167,7 +525,7 @@ public:
 
     void do_write(std::size_t length)
     {
-        auto self(shared_from_this());
+        auto self(this->shared_from_this());
         boost::asio::async_write(socket_, boost::asio::buffer(data_, length),
             make_custom_alloc_handler(handler_memory_,
                 [this, self](boost::system::error_code ec, std::size_t /*length*/)
@@ -186,18 +544,57 @@ private:
     std::array<char, 1024> data_;
 
     // The memory to use for handler-based custom memory allocation.
-    handler_memory handler_memory_;
+    Memory handler_memory_;
 };
 
-class server
+typedef basic_session<handler_memory> session;
+
+#if defined(SO_REUSEPORT)
+// Lets several sockets bind the same address and port. The kernel then spreads
+// incoming connections across their listen queues.
+typedef boost::asio::detail::socket_option::boolean<
+    SOL_SOCKET, SO_REUSEPORT> reuse_port;
+#endif // defined(SO_REUSEPORT)
+
+template <typename Session>
+class basic_server
 {
 public:
-    server(boost::asio::io_service& io_service, short port)
-        : acceptor_(io_service, ip::tcp::endpoint(ip::tcp::v4(), port))
+    basic_server(boost::asio::io_service& io_service, unsigned short port,
+        bool share_port = false)
+        : acceptor_(io_service)
     {
+        ip::tcp::endpoint endpoint(ip::tcp::v4(), port);
+        acceptor_.open(endpoint.protocol());
+        acceptor_.set_option(ip::tcp::acceptor::reuse_address(true));
+        if (share_port)
+        {
+#if defined(SO_REUSEPORT)
+            acceptor_.set_option(reuse_port(true));
+#else // defined(SO_REUSEPORT)
+            throw boost::system::system_error(
+                boost::asio::error::operation_not_supported);
+#endif // defined(SO_REUSEPORT)
+        }
+        acceptor_.bind(endpoint);
+        acceptor_.listen();
         do_accept();
     }
 
+    // The port the server is listening on, useful when constructed with 0.
+    unsigned short port() const
+    {
+        return acceptor_.local_endpoint().port();
+    }
+
+    // Stop accepting connections. Sessions already running finish when their
+    // clients disconnect, after which io_service::run() returns.
+    void stop()
+    {
+        boost::system::error_code ignored_ec;
+        acceptor_.close(ignored_ec);
+    }
+
 private:
     void do_accept()
     {
@@ -206,108 +603,1170 @@ private:
             {
                 if (!ec)
                 {
-                    std::make_shared<session>(std::move(socket))->start();
+                    std::make_shared<Session>(std::move(socket))->start();
                 }
 
-                do_accept();
+                if (acceptor_.is_open())
+                {
+                    do_accept();
+                }
             });
     }
 
     ip::tcp::acceptor acceptor_;
 };
 
+typedef basic_server<session> server;
 
-TEST(asio, Allocator)
+// Echo server sharded over several threads, each running its own io_context.
+// Every shard owns a server whose acceptor is bound to the same port with
+// SO_REUSEPORT, so connections are spread by the kernel rather than through a
+// shared accept lock, and a session never leaves the shard that accepted it.
+class sharded_server
 {
-    boost::asio::io_service io_service;
-    server s(io_service, 8080);
-    io_service.run();
-}
+public:
+    // A port of 0 picks an ephemeral port for all shards. A thread count of 0
+    // uses one shard per hardware thread.
+    sharded_server(unsigned short port, std::size_t threads,
+        bool pin_threads = true)
+    {
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+
+        for (std::size_t i = 0; i < threads; ++i)
+        {
+            shards_.emplace_back(new shard(port));
+            port = shards_.back()->server_.port();
+        }
 
+        for (std::size_t i = 0; i < threads; ++i)
+        {
+            shard& s = *shards_[i];
+            s.thread_ = std::thread([&s] { s.io_context_.run(); });
+            if (pin_threads)
+                pin_to_cpu(s.thread_, i);
+        }
+    }
 
-class shared_const_buffer
-{
-public:
-    // Construct from a std::string.
-    explicit shared_const_buffer(const std::string& data)
-        : data_(new std::vector<char>(data.begin(), data.end())),
-        buffer_(boost::asio::buffer(*data_))
+    sharded_server(const sharded_server&) = delete;
+    sharded_server& operator=(const sharded_server&) = delete;
+
+    ~sharded_server()
     {
+        stop();
     }
 
-    // Implement the ConstBufferSequence requirements.
-    typedef boost::asio::const_buffer value_type;
-    typedef const boost::asio::const_buffer* const_iterator;
-    const const_iterator begin() const { return &buffer_; }
-    const const_iterator end() const { return &buffer_ + 1; }
+    unsigned short port() const
+    {
+        return shards_.front()->server_.port();
+    }
 
-private:
-    std::shared_ptr<std::vector<char> > data_;
-    boost::asio::const_buffer buffer_;
-};
+    std::size_t thread_count() const
+    {
+        return shards_.size();
+    }
 
+    // Stop every shard and wait for its thread to exit. Sessions still open are
+    // destroyed along with their io_context.
+    void stop()
+    {
+        for (auto& s : shards_)
+            s->io_context_.stop();
+        for (auto& s : shards_)
+            if (s->thread_.joinable())
+                s->thread_.join();
+    }
 
-TEST(asio, Buffer)
-{
-    class session
-        : public std::enable_shared_from_this<session>
+private:
+    struct shard
     {
-    public:
-        session(boost::asio::ip::tcp::socket socket)
-            : socket_(std::move(socket))
+        explicit shard(unsigned short port)
+            : server_(io_context_, port, true)
         {
         }
 
-        void start()
-        {
-            do_write();
-        }
+        boost::asio::io_context io_context_;
+        server server_;
+        std::thread thread_;
+    };
 
-    private:
-        void do_write()
-        {
-            std::time_t now = std::time(0);
-            shared_const_buffer buffer(std::ctime(&now));
+    static void pin_to_cpu(std::thread& thread, std::size_t index)
+    {
+#if defined(__linux__)
+        unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(index % cpus, &set);
+        ::pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#else // defined(__linux__)
+        (void)thread;
+        (void)index;
+#endif // defined(__linux__)
+    }
 
-            auto self(shared_from_this());
-            boost::asio::async_write(socket_, buffer,
-                [self](boost::system::error_code /*ec*/, std::size_t /*length*/)
-                {
-                });
-        }
+    std::vector<std::unique_ptr<shard>> shards_;
+};
 
-        boost::asio::ip::tcp::socket socket_;
-    };
 
-    class server
+// Echo session for uring_server. It reads and writes through the server's
+// io_uring queue, using one of the queue's registered buffers in place of
+// data_, so a read and the following write each cost a submission entry
+// rather than a readiness wait plus a system call.
+class uring_session
+    : public std::enable_shared_from_this<uring_session>
+{
+public:
+    uring_session(ip::tcp::socket socket, uring_queue& queue)
+        : socket_(std::move(socket)), queue_(queue), index_(-1)
     {
-    public:
-        server(boost::asio::io_context& io_context, short port)
-            : acceptor_(io_context, 
-                boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port))
+    }
+
+    ~uring_session()
+    {
+        if (index_ != -1)
+            queue_.release_buffer(index_);
+    }
+
+    void start()
+    {
+        index_ = queue_.acquire_buffer();
+        if (index_ != -1)
         {
-            do_accept();
+            do_read();
         }
+    }
 
-    private:
-        void do_accept()
-        {
-            acceptor_.async_accept(
-                [this](boost::system::error_code ec, boost::asio::ip::tcp::socket socket)
+private:
+    void do_read()
+    {
+        auto self(shared_from_this());
+        queue_.async_read_fixed(socket_.native_handle(),
+            queue_.buffer(index_), index_, 0,
+            [this, self](boost::system::error_code ec, std::size_t length)
+            {
+                if (!ec)
                 {
-                    if (!ec)
-                    {
-                        std::make_shared<session>(std::move(socket))->start();
-                    }
+                    do_write(0, length);
+                }
+            });
+    }
 
-                    do_accept();
-                });
-        }
+    void do_write(std::size_t offset, std::size_t length)
+    {
+        auto self(shared_from_this());
+        queue_.async_write_fixed(socket_.native_handle(),
+            boost::asio::buffer(queue_.buffer(index_) + offset, length - offset),
+            index_, 0,
+            [this, self, offset, length](boost::system::error_code ec,
+                std::size_t written)
+            {
+                if (!ec)
+                {
+                    // Finish a short write before reading again.
+                    if (offset + written < length)
+                        do_write(offset + written, length);
+                    else
+                        do_read();
+                }
+            });
+    }
 
-        boost::asio::ip::tcp::acceptor acceptor_;
-    };
+    ip::tcp::socket socket_;
+    uring_queue& queue_;
+    int index_;
+};
 
-    boost::asio::io_service io_service;
-    server s(io_service, 8080);
-    io_service.run();
+// Echo server whose sessions do their I/O through io_uring. Where the kernel
+// or the build has no io_uring it falls back to the epoll-driven session, so it
+// can stand in for server anywhere.
+class uring_server
+{
+public:
+    uring_server(boost::asio::io_service& io_service, unsigned short port,
+        std::size_t max_sessions = 256)
+        : acceptor_(io_service, ip::tcp::endpoint(ip::tcp::v4(), port)),
+        queue_(io_service, 512, 1024, max_sessions)
+    {
+        do_accept();
+    }
+
+    // Whether sessions use io_uring rather than the reactor.
+    bool uses_uring() const
+    {
+        return queue_.is_open();
+    }
+
+    unsigned short port() const
+    {
+        return acceptor_.local_endpoint().port();
+    }
+
+    void stop()
+    {
+        boost::system::error_code ignored_ec;
+        acceptor_.close(ignored_ec);
+    }
+
+private:
+    void do_accept()
+    {
+        acceptor_.async_accept(
+            [this](boost::system::error_code ec, ip::tcp::socket socket)
+            {
+                if (!ec)
+                {
+                    if (queue_.is_open())
+                        std::make_shared<uring_session>(
+                            std::move(socket), queue_)->start();
+                    else
+                        std::make_shared<session>(std::move(socket))->start();
+                }
+
+                if (acceptor_.is_open())
+                {
+                    do_accept();
+                }
+            });
+    }
+
+    ip::tcp::acceptor acceptor_;
+    uring_queue queue_;
+};
+
+
+// Settings for echo_load_generator.
+struct load_options
+{
+    // Number of concurrent connections.
+    std::size_t connections = 8;
+
+    // Size of each request; the echo reply has the same size.
+    std::size_t message_size = 64;
+
+    // Requests each connection keeps in flight.
+    std::size_t pipeline_depth = 4;
+
+    // How long to keep issuing new requests.
+    std::chrono::milliseconds duration = std::chrono::milliseconds(1000);
+};
+
+// Results of a load run.
+struct load_report
+{
+    std::uint64_t requests = 0;
+    double seconds = 0;
+
+    // Round-trip latency of each request in nanoseconds.
+    latency_histogram latency;
+
+    void merge(const load_report& other)
+    {
+        requests += other.requests;
+        seconds = std::max(seconds, other.seconds);
+        latency.merge(other.latency);
+    }
+
+    void print(std::ostream& os, const char* name) const
+    {
+        os << name << ": " << requests << " requests in " << seconds << "s ("
+            << (seconds > 0 ? requests / seconds : 0) << " req/s) ";
+        latency.print(os);
+        os << std::endl;
+    }
+};
+
+// Client driver for the echo servers. It opens a number of connections to the
+// server, keeps a pipeline of fixed-size requests going on each one for a set
+// duration and records the latency of every round trip. Once the duration is
+// over each connection drains its outstanding replies and closes, and the
+// completion callback runs when the last one is done.
+class echo_load_generator
+{
+public:
+    echo_load_generator(boost::asio::io_context& io_context,
+        const ip::tcp::endpoint& endpoint, const load_options& options)
+        : options_(options), remaining_(0)
+    {
+        for (std::size_t i = 0; i < options.connections; ++i)
+            connections_.emplace_back(
+                new connection(*this, io_context, endpoint));
+    }
+
+    // Start the run; on_complete is called once every connection has closed.
+    void start(std::function<void()> on_complete)
+    {
+        on_complete_ = std::move(on_complete);
+        start_ = std::chrono::steady_clock::now();
+        deadline_ = start_ + options_.duration;
+        remaining_ = connections_.size();
+        for (auto& c : connections_)
+            c->start();
+    }
+
+    // Results gathered over all connections.
+    load_report report() const
+    {
+        load_report r;
+        r.seconds = std::chrono::duration<double>(finish_ - start_).count();
+        for (auto& c : connections_)
+        {
+            r.requests += c->latency_.count();
+            r.latency.merge(c->latency_);
+        }
+        return r;
+    }
+
+private:
+    class connection
+    {
+    public:
+        connection(echo_load_generator& owner,
+            boost::asio::io_context& io_context, const ip::tcp::endpoint& endpoint)
+            : owner_(owner),
+            socket_(io_context),
+            request_(owner.options_.message_size, 'x'),
+            reply_(owner.options_.message_size, '\0'),
+            writing_(false)
+        {
+            socket_.connect(endpoint);
+            socket_.set_option(ip::tcp::no_delay(true));
+        }
+
+        void start()
+        {
+            do_write();
+            do_read();
+        }
+
+    private:
+        friend class echo_load_generator;
+
+        void do_write()
+        {
+            if (writing_ || in_flight_.size() >= owner_.options_.pipeline_depth)
+                return;
+
+            auto now = std::chrono::steady_clock::now();
+            if (now >= owner_.deadline_)
+            {
+                if (in_flight_.empty())
+                    finish();
+                return;
+            }
+
+            writing_ = true;
+            in_flight_.push_back(now);
+            boost::asio::async_write(socket_, boost::asio::buffer(request_),
+                [this](boost::system::error_code ec, std::size_t /*length*/)
+                {
+                    writing_ = false;
+                    if (!ec)
+                    {
+                        do_write();
+                    }
+                });
+        }
+
+        void do_read()
+        {
+            boost::asio::async_read(socket_,
+                boost::asio::buffer(&reply_[0], reply_.size()),
+                [this](boost::system::error_code ec, std::size_t /*length*/)
+                {
+                    if (ec)
+                    {
+                        finish();
+                        return;
+                    }
+
+                    std::chrono::nanoseconds rtt =
+                        std::chrono::steady_clock::now() - in_flight_.front();
+                    in_flight_.pop_front();
+                    latency_.record(rtt.count());
+
+                    if (in_flight_.empty()
+                        && std::chrono::steady_clock::now() >= owner_.deadline_)
+                    {
+                        finish();
+                    }
+                    else
+                    {
+                        do_read();
+                        do_write();
+                    }
+                });
+        }
+
+        void finish()
+        {
+            if (!socket_.is_open())
+                return;
+
+            boost::system::error_code ignored_ec;
+            socket_.shutdown(ip::tcp::socket::shutdown_both, ignored_ec);
+            socket_.close(ignored_ec);
+            owner_.connection_done();
+        }
+
+        echo_load_generator& owner_;
+        ip::tcp::socket socket_;
+        std::string request_;
+        std::string reply_;
+        bool writing_;
+        std::deque<std::chrono::steady_clock::time_point> in_flight_;
+        latency_histogram latency_;
+    };
+
+    void connection_done()
+    {
+        if (--remaining_ == 0)
+        {
+            finish_ = std::chrono::steady_clock::now();
+            if (on_complete_)
+                on_complete_();
+        }
+    }
+
+    load_options options_;
+    std::vector<std::unique_ptr<connection>> connections_;
+    std::size_t remaining_;
+    std::function<void()> on_complete_;
+    std::chrono::steady_clock::time_point start_;
+    std::chrono::steady_clock::time_point deadline_;
+    std::chrono::steady_clock::time_point finish_;
+};
+
+// Run the load generator against a server on the same io_service and stop the
+// server once the run is over.
+template <typename Server>
+load_report run_echo_load(boost::asio::io_service& io_service, Server& s,
+    const load_options& options = load_options())
+{
+    echo_load_generator load(io_service,
+        ip::tcp::endpoint(ip::address_v4::loopback(), s.port()), options);
+    load.start([&s] { s.stop(); });
+    io_service.run();
+    return load.report();
+}
+
+TEST(asio, Allocator)
+{
+    {
+        boost::asio::io_service io_service;
+        server s(io_service, 0);
+        run_echo_load(io_service, s).print(std::cout, "handler_memory");
+    }
+
+    {
+        boost::asio::io_service io_service;
+        basic_server<basic_session<recycling_handler_memory>> s(io_service, 0);
+        run_echo_load(io_service, s).print(std::cout, "recycling_handler_memory");
+    }
+}
+
+// Echo client that keeps a write and a read outstanding at the same time, both
+// allocating their handlers from the same handler_memory.
+class duplex_echo_client
+{
+public:
+    duplex_echo_client(ip::tcp::socket socket,
+        std::size_t message_size, std::size_t message_count)
+        : socket_(std::move(socket)),
+        message_(message_size, 'x'),
+        bytes_to_read_(message_size * message_count),
+        messages_to_write_(message_count)
+    {
+    }
+
+    void start()
+    {
+        do_write();
+        do_read();
+    }
+
+    const handler_memory& memory() const
+    {
+        return handler_memory_;
+    }
+
+private:
+    void do_write()
+    {
+        if (messages_to_write_ == 0)
+            return;
+
+        --messages_to_write_;
+        boost::asio::async_write(socket_, boost::asio::buffer(message_),
+            make_custom_alloc_handler(handler_memory_,
+                [this](boost::system::error_code ec, std::size_t /*length*/)
+                {
+                    if (!ec)
+                    {
+                        do_write();
+                    }
+                }));
+    }
+
+    void do_read()
+    {
+        socket_.async_read_some(boost::asio::buffer(data_),
+            make_custom_alloc_handler(handler_memory_,
+                [this](boost::system::error_code ec, std::size_t length)
+                {
+                    if (ec)
+                        return;
+
+                    bytes_to_read_ -= length;
+                    if (bytes_to_read_ > 0)
+                    {
+                        do_read();
+                    }
+                    else
+                    {
+                        // Closing the socket lets the server session see EOF.
+                        socket_.close();
+                    }
+                }));
+    }
+
+    ip::tcp::socket socket_;
+    std::string message_;
+    std::size_t bytes_to_read_;
+    std::size_t messages_to_write_;
+    std::array<char, 1024> data_;
+    handler_memory handler_memory_;
+};
+
+TEST(asio, AllocatorPool)
+{
+    const std::size_t message_size = 64;
+    const std::size_t message_count = 100000;
+
+    boost::asio::io_context io_context;
+    ip::tcp::acceptor acceptor(io_context,
+        ip::tcp::endpoint(ip::address_v4::loopback(), 0));
+
+    ip::tcp::socket client_socket(io_context);
+    client_socket.connect(acceptor.local_endpoint());
+    ip::tcp::socket server_socket(io_context);
+    acceptor.accept(server_socket);
+
+    auto echo = std::make_shared<session>(std::move(server_socket));
+    duplex_echo_client client(std::move(client_socket),
+        message_size, message_count);
+
+    auto start = std::chrono::steady_clock::now();
+    echo->start();
+    client.start();
+    io_context.run();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    std::cout << message_count << " messages in " << elapsed.count() << "s ("
+        << message_count / elapsed.count() << " msg/s)\n"
+        << "server: " << echo->memory().hits() << " hits, "
+        << echo->memory().fallbacks() << " fallbacks\n"
+        << "client: " << client.memory().hits() << " hits, "
+        << client.memory().fallbacks() << " fallbacks" << std::endl;
+
+    EXPECT_EQ(0u, echo->memory().fallbacks());
+    EXPECT_EQ(0u, client.memory().fallbacks());
+    EXPECT_GE(client.memory().hits(), message_count);
+}
+
+// Resident set size of the process in bytes, or 0 where it is not available.
+std::size_t resident_set_size()
+{
+#if defined(__linux__)
+    std::size_t pages = 0;
+    if (FILE* f = std::fopen("/proc/self/statm", "r"))
+    {
+        unsigned long size = 0, resident = 0;
+        if (std::fscanf(f, "%lu %lu", &size, &resident) == 2)
+            pages = resident;
+        std::fclose(f);
+    }
+    return pages * static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+#else // defined(__linux__)
+    return 0;
+#endif // defined(__linux__)
+}
+
+// Models a mostly idle session: it owns its handler memory and keeps a single
+// read handler outstanding.
+template <typename Memory>
+struct idle_session
+{
+    Memory memory;
+    void* pending_read = nullptr;
+};
+
+template <typename Memory>
+void bench_idle_sessions(const char* name, std::size_t count)
+{
+    // Sizes of the read and write handlers of the echo session.
+    const std::size_t read_size = 160;
+    const std::size_t write_size = 200;
+    const int passes = 4;
+
+    std::size_t rss_before = resident_set_size();
+    std::unique_ptr<idle_session<Memory>[]> sessions(
+        new idle_session<Memory>[count]);
+    for (std::size_t i = 0; i < count; ++i)
+        sessions[i].pending_read = sessions[i].memory.allocate(read_size);
+    std::size_t rss_after = resident_set_size();
+
+    // Each pass completes the outstanding read on every session, runs a write
+    // and re-arms the read, as an echo round trip would.
+    auto start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < passes; ++pass)
+    {
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            idle_session<Memory>& s = sessions[i];
+            s.memory.deallocate(s.pending_read);
+            s.memory.deallocate(s.memory.allocate(write_size));
+            s.pending_read = s.memory.allocate(read_size);
+        }
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    for (std::size_t i = 0; i < count; ++i)
+        sessions[i].memory.deallocate(sessions[i].pending_read);
+
+    double allocations = 2.0 * passes * count;
+    std::cout << name << " " << count << " sessions: "
+        << (rss_after - rss_before) / (1024 * 1024) << " MB resident, "
+        << allocations / elapsed.count() << " alloc/s" << std::endl;
+}
+
+TEST(asio, RecyclingAllocator)
+{
+    // The recycling backend drives a real echo session.
+    {
+        boost::asio::io_context io_context;
+        ip::tcp::acceptor acceptor(io_context,
+            ip::tcp::endpoint(ip::address_v4::loopback(), 0));
+        ip::tcp::socket client_socket(io_context);
+        client_socket.connect(acceptor.local_endpoint());
+        ip::tcp::socket server_socket(io_context);
+        acceptor.accept(server_socket);
+
+        std::make_shared<basic_session<recycling_handler_memory>>(
+            std::move(server_socket))->start();
+        duplex_echo_client client(std::move(client_socket), 64, 1000);
+        client.start();
+        io_context.run();
+
+        const handler_block_cache::statistics& stats =
+            handler_block_cache::local().stats();
+        EXPECT_GT(stats.hits, stats.misses);
+        EXPECT_EQ(0u, stats.fallbacks);
+    }
+
+    // Blocks freed on another thread find their way back to the owner.
+    {
+        recycling_handler_memory memory;
+        std::vector<void*> blocks;
+        for (int i = 0; i < 16; ++i)
+            blocks.push_back(memory.allocate(100));
+
+        std::thread([&]
+            {
+                recycling_handler_memory remote;
+                for (void* p : blocks)
+                    remote.deallocate(p);
+            }).join();
+
+        std::size_t remote_frees = handler_block_cache::local().stats().remote_frees;
+        for (void*& p : blocks)
+            p = memory.allocate(100);
+        EXPECT_EQ(remote_frees + 16, handler_block_cache::local().stats().remote_frees);
+        for (void* p : blocks)
+            memory.deallocate(p);
+    }
+
+    // A million embedded sessions take a few GB, so that count is only run
+    // when the large benchmarks are enabled.
+#if defined(ASIO_TEST_LARGE_BENCHMARKS)
+    const std::size_t counts[] = { 10000, 100000, 1000000 };
+#else // defined(ASIO_TEST_LARGE_BENCHMARKS)
+    const std::size_t counts[] = { 10000, 100000 };
+#endif // defined(ASIO_TEST_LARGE_BENCHMARKS)
+    for (std::size_t count : counts)
+    {
+        bench_idle_sessions<handler_memory>("embedded ", count);
+        bench_idle_sessions<recycling_handler_memory>("recycling", count);
+    }
+}
+
+
+TEST(asio, ShardedServer)
+{
+    const unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2)
+    {
+        sharded_server echo(0, threads);
+        ip::tcp::endpoint endpoint(ip::address_v4::loopback(), echo.port());
+
+        // Drive the load from as many client threads as there are shards.
+        load_options options;
+        options.connections = 4;
+        options.pipeline_depth = 1;
+
+        std::vector<std::unique_ptr<boost::asio::io_context>> contexts;
+        std::vector<std::unique_ptr<echo_load_generator>> loads;
+        for (unsigned t = 0; t < threads; ++t)
+        {
+            contexts.emplace_back(new boost::asio::io_context(1));
+            loads.emplace_back(
+                new echo_load_generator(*contexts.back(), endpoint, options));
+            loads.back()->start(nullptr);
+        }
+
+        std::vector<std::thread> client_threads;
+        for (auto& context : contexts)
+        {
+            boost::asio::io_context* io = context.get();
+            client_threads.emplace_back([io] { io->run(); });
+        }
+        for (auto& t : client_threads)
+            t.join();
+        echo.stop();
+
+        load_report report;
+        for (auto& load : loads)
+            report.merge(load->report());
+        ASSERT_GT(report.requests, 0u);
+
+        std::ostringstream name;
+        name << threads << " threads";
+        report.print(std::cout, name.str().c_str());
+    }
+}
+
+
+TEST(asio, UringEchoServer)
+{
+    load_options options;
+    options.connections = 16;
+    options.pipeline_depth = 4;
+
+    {
+        boost::asio::io_service io_service;
+        server s(io_service, 0);
+        run_echo_load(io_service, s, options).print(std::cout, "epoll");
+    }
+
+    {
+        boost::asio::io_service io_service;
+        uring_server s(io_service, 0);
+        load_report report = run_echo_load(io_service, s, options);
+        ASSERT_GT(report.requests, 0u);
+        report.print(std::cout, s.uses_uring() ? "io_uring" : "io_uring (epoll fallback)");
+    }
+}
+
+
+class shared_const_buffer
+{
+public:
+    // Construct from a std::string.
+    explicit shared_const_buffer(const std::string& data)
+        : data_(new std::vector<char>(data.begin(), data.end())),
+        buffer_(boost::asio::buffer(*data_))
+    {
+    }
+
+    // Implement the ConstBufferSequence requirements.
+    typedef boost::asio::const_buffer value_type;
+    typedef const boost::asio::const_buffer* const_iterator;
+    const const_iterator begin() const { return &buffer_; }
+    const const_iterator end() const { return &buffer_ + 1; }
+
+private:
+    std::shared_ptr<std::vector<char> > data_;
+    boost::asio::const_buffer buffer_;
+};
+
+
+class buffer_pool;
+
+// A reference-counted piece of message payload. A chunk either owns a copy of
+// the bytes, stored in the same pool block right after the header, or refers
+// to memory owned elsewhere and optionally calls a release function once the
+// last reference is gone.
+class buffer_chunk
+{
+public:
+    typedef void (*release_function)(void* context);
+
+    buffer_chunk(const buffer_chunk&) = delete;
+    buffer_chunk& operator=(const buffer_chunk&) = delete;
+
+    const void* data() const noexcept
+    {
+        return data_;
+    }
+
+    std::size_t size() const noexcept
+    {
+        return size_;
+    }
+
+    void add_ref() noexcept
+    {
+        refs_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    inline void release() noexcept;
+
+private:
+    friend class buffer_pool;
+
+    buffer_chunk(buffer_pool& pool, const void* data, std::size_t size,
+        release_function release, void* context)
+        : refs_(1), pool_(pool), data_(data), size_(size),
+        release_(release), context_(context)
+    {
+    }
+
+    std::atomic<std::size_t> refs_;
+    buffer_pool& pool_;
+    const void* data_;
+    std::size_t size_;
+    release_function release_;
+    void* context_;
+};
+
+// Slab pool from which buffer_chunk objects are carved. Payloads up to the
+// block size share one recycled block with their header; larger payloads get
+// a block of their own from the heap. Chunks may be released on any thread.
+class buffer_pool
+{
+public:
+    explicit buffer_pool(std::size_t block_size = 2048)
+        : block_size_(block_size)
+    {
+    }
+
+    buffer_pool(const buffer_pool&) = delete;
+    buffer_pool& operator=(const buffer_pool&) = delete;
+
+    ~buffer_pool()
+    {
+        for (void* block : blocks_)
+            ::operator delete(block);
+        for (void* header : headers_)
+            ::operator delete(header);
+    }
+
+    // Create a chunk holding a copy of the given bytes.
+    buffer_chunk* copy(const void* data, std::size_t size)
+    {
+        void* block = size <= block_size_
+            ? take(blocks_, header_size + block_size_)
+            : ::operator new(header_size + size);
+        char* payload = static_cast<char*>(block) + header_size;
+        std::memcpy(payload, data, size);
+        return new (block) buffer_chunk(*this, payload, size, nullptr, nullptr);
+    }
+
+    // Create a chunk referring to existing memory without copying it. The
+    // memory must stay valid until release is called, or for the lifetime of
+    // every chunk reference when no release function is given.
+    buffer_chunk* wrap(const void* data, std::size_t size,
+        buffer_chunk::release_function release = nullptr,
+        void* context = nullptr)
+    {
+        void* header = take(headers_, header_size);
+        return new (header) buffer_chunk(*this, data, size, release, context);
+    }
+
+private:
+    friend class buffer_chunk;
+
+    // Header size, rounded up so the payload that follows is well aligned.
+    static constexpr std::size_t header_size =
+        (sizeof(buffer_chunk) + alignof(std::max_align_t) - 1)
+            / alignof(std::max_align_t) * alignof(std::max_align_t);
+
+    void* take(std::vector<void*>& list, std::size_t size)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!list.empty())
+            {
+                void* block = list.back();
+                list.pop_back();
+                return block;
+            }
+        }
+        return ::operator new(size);
+    }
+
+    void recycle(buffer_chunk* chunk)
+    {
+        bool owns_payload = static_cast<const char*>(chunk->data_)
+            == reinterpret_cast<const char*>(chunk) + header_size;
+        bool pooled = !owns_payload || chunk->size_ <= block_size_;
+        chunk->~buffer_chunk();
+
+        if (!pooled)
+        {
+            ::operator delete(chunk);
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        (owns_payload ? blocks_ : headers_).push_back(chunk);
+    }
+
+    std::size_t block_size_;
+    std::mutex mutex_;
+
+    // Free payload blocks and free bare headers for wrapped chunks.
+    std::vector<void*> blocks_;
+    std::vector<void*> headers_;
+};
+
+inline void buffer_chunk::release() noexcept
+{
+    if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        if (release_)
+            release_(context_);
+        pool_.recycle(this);
+    }
+}
+
+// A scatter/gather sequence of up to max_chunks pooled chunks. Copies share the
+// chunks through their intrusive reference counts, so one payload can be
+// handed to thousands of async_write calls without copying the bytes or
+// allocating per recipient.
+class pooled_const_buffer
+{
+public:
+    static constexpr std::size_t max_chunks = 4;
+
+    pooled_const_buffer() noexcept
+        : count_(0)
+    {
+    }
+
+    // Construct from a std::string, copying it into a pooled chunk.
+    pooled_const_buffer(buffer_pool& pool, const std::string& data)
+        : count_(0)
+    {
+        append(pool.copy(data.data(), data.size()));
+    }
+
+    pooled_const_buffer(const pooled_const_buffer& other) noexcept
+        : count_(other.count_)
+    {
+        for (std::size_t i = 0; i < count_; ++i)
+        {
+            chunks_[i] = other.chunks_[i];
+            chunks_[i]->add_ref();
+            buffers_[i] = other.buffers_[i];
+        }
+    }
+
+    pooled_const_buffer& operator=(const pooled_const_buffer& other) noexcept
+    {
+        if (this != &other)
+        {
+            clear();
+            append(other);
+        }
+        return *this;
+    }
+
+    ~pooled_const_buffer()
+    {
+        clear();
+    }
+
+    // Append a chunk, taking over the caller's reference.
+    void append(buffer_chunk* chunk)
+    {
+        if (count_ == max_chunks)
+        {
+            chunk->release();
+            throw std::length_error("pooled_const_buffer: too many chunks");
+        }
+        chunks_[count_] = chunk;
+        buffers_[count_] = boost::asio::const_buffer(chunk->data(), chunk->size());
+        ++count_;
+    }
+
+    // Append all chunks of another sequence, sharing them.
+    void append(const pooled_const_buffer& other)
+    {
+        for (std::size_t i = 0; i < other.count_; ++i)
+        {
+            other.chunks_[i]->add_ref();
+            append(other.chunks_[i]);
+        }
+    }
+
+    void clear() noexcept
+    {
+        for (std::size_t i = 0; i < count_; ++i)
+            chunks_[i]->release();
+        count_ = 0;
+    }
+
+    // Implement the ConstBufferSequence requirements.
+    typedef boost::asio::const_buffer value_type;
+    typedef const boost::asio::const_buffer* const_iterator;
+    const_iterator begin() const { return buffers_; }
+    const_iterator end() const { return buffers_ + count_; }
+
+private:
+    buffer_chunk* chunks_[max_chunks];
+    boost::asio::const_buffer buffers_[max_chunks];
+    std::size_t count_;
+};
+
+
+TEST(asio, Buffer)
+{
+    // Echo session that sends every reply through a shared_const_buffer.
+    class session
+        : public std::enable_shared_from_this<session>
+    {
+    public:
+        session(boost::asio::ip::tcp::socket socket)
+            : socket_(std::move(socket))
+        {
+        }
+
+        void start()
+        {
+            do_read();
+        }
+
+    private:
+        void do_read()
+        {
+            auto self(shared_from_this());
+            socket_.async_read_some(boost::asio::buffer(data_),
+                [this, self](boost::system::error_code ec, std::size_t length)
+                {
+                    if (!ec)
+                    {
+                        do_write(std::string(data_.data(), length));
+                    }
+                });
+        }
+
+        void do_write(const std::string& reply)
+        {
+            shared_const_buffer buffer(reply);
+
+            auto self(shared_from_this());
+            boost::asio::async_write(socket_, buffer,
+                [this, self](boost::system::error_code ec, std::size_t /*length*/)
+                {
+                    if (!ec)
+                    {
+                        do_read();
+                    }
+                });
+        }
+
+        boost::asio::ip::tcp::socket socket_;
+        std::array<char, 1024> data_;
+    };
+
+    boost::asio::io_service io_service;
+    basic_server<session> s(io_service, 0);
+    run_echo_load(io_service, s).print(std::cout, "shared_const_buffer");
+}
+
+TEST(asio, PooledBuffer)
+{
+    buffer_pool pool;
+    const std::string header = "broadcast: ";
+    const std::string body(512, 'b');
+
+    // A header copied into the pool followed by a body used in place.
+    pooled_const_buffer message;
+    message.append(pool.copy(header.data(), header.size()));
+    message.append(pool.wrap(body.data(), body.size()));
+    EXPECT_EQ(header.size() + body.size(), boost::asio::buffer_size(message));
+
+    boost::asio::io_context io_context;
+    ip::tcp::acceptor acceptor(io_context,
+        ip::tcp::endpoint(ip::address_v4::loopback(), 0));
+    ip::tcp::socket sender(io_context);
+    sender.connect(acceptor.local_endpoint());
+    ip::tcp::socket receiver(io_context);
+    acceptor.accept(receiver);
+
+    boost::asio::async_write(sender, message,
+        [](boost::system::error_code ec, std::size_t /*length*/)
+        {
+            EXPECT_FALSE(ec);
+        });
+    std::string received(header.size() + body.size(), '\0');
+    boost::asio::async_read(receiver, boost::asio::buffer(&received[0], received.size()),
+        [](boost::system::error_code ec, std::size_t /*length*/)
+        {
+            EXPECT_FALSE(ec);
+        });
+    io_context.run();
+    EXPECT_EQ(header + body, received);
+
+    // Fan a payload out to many recipients, each holding its own reference
+    // until its write would complete.
+    const std::size_t recipients = 1000;
+    const std::size_t messages = 1000;
+    const std::string payload(512, 'p');
+
+    // Once a second thread has existed std::shared_ptr stops taking its single
+    // threaded shortcut, which is how it behaves inside a real server.
+    std::thread([] {}).join();
+
+    auto bench = [&](const char* name, std::function<void(std::size_t)> fan_out)
+        {
+            auto start = std::chrono::steady_clock::now();
+            for (std::size_t m = 0; m < messages; ++m)
+                fan_out(m);
+            std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+            std::cout << name << ": "
+                << messages * recipients / elapsed.count() << " sends/s"
+                << std::endl;
+        };
+
+    std::vector<shared_const_buffer> shared_pending;
+    shared_pending.reserve(recipients);
+    bench("shared_const_buffer per recipient", [&](std::size_t)
+        {
+            for (std::size_t r = 0; r < recipients; ++r)
+                shared_pending.push_back(shared_const_buffer(payload));
+            shared_pending.clear();
+        });
+
+    bench("shared_const_buffer shared", [&](std::size_t)
+        {
+            shared_const_buffer buffer(payload);
+            for (std::size_t r = 0; r < recipients; ++r)
+                shared_pending.push_back(buffer);
+            shared_pending.clear();
+        });
+
+    std::vector<pooled_const_buffer> pooled_pending;
+    pooled_pending.reserve(recipients);
+    bench("pooled_const_buffer shared", [&](std::size_t)
+        {
+            pooled_const_buffer buffer(pool, payload);
+            for (std::size_t r = 0; r < recipients; ++r)
+                pooled_pending.push_back(buffer);
+            pooled_pending.clear();
+        });
 }
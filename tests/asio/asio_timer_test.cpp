@@ -2,9 +2,21 @@
 #include <gtest/gtest.h>
 
 #include <boost/asio.hpp>
+#include <boost/asio/use_future.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <algorithm>
+#include <cstdint>
 #include <ctime>
 #include <chrono>
+#include <future>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 
 // A custom implementation of the Clock concept from the standard C++ library.
@@ -121,3 +133,918 @@ TEST(asio, AsyncTimer)
 
     io.run();
 }
+
+namespace services {
+
+    /// A wait handler bound to its result, keeping the handler's associated
+    /// allocator for the executor to allocate with.
+    template <typename Handler>
+    struct wait_binder
+    {
+        wait_binder(Handler&& handler, const boost::system::error_code& ec)
+            : handler_(std::move(handler)), ec_(ec)
+        {
+        }
+
+        void operator()()
+        {
+            handler_(ec_);
+        }
+
+        Handler handler_;
+        boost::system::error_code ec_;
+    };
+
+} // namespace services
+
+namespace boost {
+namespace asio {
+
+    template <typename Handler, typename Allocator>
+    struct associated_allocator<services::wait_binder<Handler>, Allocator>
+    {
+        typedef typename associated_allocator<Handler, Allocator>::type type;
+
+        static type get(const services::wait_binder<Handler>& h,
+            const Allocator& a = Allocator())
+        {
+            return associated_allocator<Handler, Allocator>::get(h.handler_, a);
+        }
+    };
+
+} // namespace asio
+} // namespace boost
+
+namespace services {
+
+    /// A timer driven by a timing wheel. It waits like boost::asio::steady_timer
+    /// but arming, re-arming and cancelling are O(1) however many timers are
+    /// pending. Use the services::wheel_timer typedef.
+    template <typename Service>
+    class basic_wheel_timer
+        : private boost::noncopyable
+    {
+    public:
+        /// The type of the service that will be used to provide timer operations.
+        typedef Service service_type;
+
+        /// The native implementation type of the timer.
+        typedef typename service_type::impl_type impl_type;
+
+        /// The clock type.
+        typedef typename service_type::clock_type clock_type;
+
+        /// The duration type of the clock.
+        typedef typename clock_type::duration duration;
+
+        /// The time point type of the clock.
+        typedef typename clock_type::time_point time_point;
+
+        /// Constructor. The timer has no expiry set.
+        explicit basic_wheel_timer(boost::asio::io_context& io_context)
+            : service_(boost::asio::use_service<Service>(io_context)),
+            impl_(service_.null())
+        {
+            service_.create(impl_);
+        }
+
+        /// Constructor to set an expiry time relative to now.
+        basic_wheel_timer(boost::asio::io_context& io_context,
+            const duration& expiry_time)
+            : service_(boost::asio::use_service<Service>(io_context)),
+            impl_(service_.null())
+        {
+            service_.create(impl_);
+            expires_after(expiry_time);
+        }
+
+        /// Destructor. Pending waits complete with operation_aborted.
+        ~basic_wheel_timer()
+        {
+            service_.destroy(impl_);
+        }
+
+        /// Get the io_context associated with the object.
+        boost::asio::io_context& get_io_context()
+        {
+            return service_.get_io_context();
+        }
+
+        /// Get the timer's expiry time as an absolute time.
+        time_point expiry() const
+        {
+            return service_.expiry(impl_);
+        }
+
+        /// Set the expiry time as an absolute time. Pending waits complete with
+        /// operation_aborted; returns how many there were.
+        std::size_t expires_at(const time_point& expiry_time)
+        {
+            return service_.expires_at(impl_, expiry_time);
+        }
+
+        /// Set the expiry time relative to now.
+        std::size_t expires_after(const duration& expiry_time)
+        {
+            return service_.expires_at(impl_, clock_type::now() + expiry_time);
+        }
+
+        /// Cancel pending waits; returns how many there were.
+        std::size_t cancel()
+        {
+            return service_.cancel(impl_);
+        }
+
+        /// Block until the timer has expired.
+        void wait()
+        {
+            std::this_thread::sleep_until(expiry());
+        }
+
+        /// Start an asynchronous wait. The completion signature is
+        /// void(boost::system::error_code); the handler runs on its associated
+        /// executor.
+        template <typename WaitHandler>
+        BOOST_ASIO_INITFN_RESULT_TYPE(WaitHandler,
+            void (boost::system::error_code))
+        async_wait(WaitHandler&& handler)
+        {
+            return boost::asio::async_initiate<WaitHandler,
+                void (boost::system::error_code)>(
+                    initiate_async_wait(this), handler);
+        }
+
+    private:
+        class initiate_async_wait
+        {
+        public:
+            explicit initiate_async_wait(basic_wheel_timer* self)
+                : self_(self)
+            {
+            }
+
+            template <typename WaitHandler>
+            void operator()(WaitHandler&& handler) const
+            {
+                self_->service_.async_wait(self_->impl_,
+                    std::forward<WaitHandler>(handler));
+            }
+
+        private:
+            basic_wheel_timer* self_;
+        };
+
+        service_type& service_;
+        impl_type impl_;
+    };
+
+    /// Service implementation for the wheel timer.
+    ///
+    /// Timers are kept in a hierarchy of wheels of 256 slots each, one tick
+    /// per slot in the first wheel and 256 times more per slot in each wheel
+    /// above it. Arming a timer links it into the slot covering its expiry;
+    /// cancelling unlinks it, with no search and no rebalancing. When the
+    /// first wheel turns over, the next slot of the wheel above is spread out
+    /// over it. Four wheels cover 2^32 ticks; later expiries wait in the last
+    /// wheel and are placed again when they come round.
+    ///
+    /// Expiry is rounded up to the next tick, so a timer never fires early but
+    /// may fire up to one tick late. The wheel is driven by a single
+    /// steady_timer set to the next tick that has timers, or to the next turn
+    /// of the first wheel if only the wheels above have any.
+    ///
+    /// Expired handlers are dispatched to their associated executor, so with
+    /// the io_context's own executor they are called directly, and aborted
+    /// ones are posted to it. Operations are allocated with the handler's
+    /// associated allocator. The service must be used from one thread at a
+    /// time.
+    class timer_wheel_service
+        : public boost::asio::io_context::service
+    {
+    public:
+        /// The unique service identifier.
+        static boost::asio::io_context::id id;
+
+        /// The clock the timers are measured against.
+        typedef std::chrono::steady_clock clock_type;
+
+        enum { wheel_bits = 8, wheel_size = 1 << wheel_bits, wheel_count = 4 };
+
+    private:
+        /// A pending async_wait.
+        class wait_op
+        {
+        public:
+            wait_op() : next_(0) {}
+
+            /// Dispatch the handler to its executor and free the operation.
+            virtual void complete(const boost::system::error_code& ec) = 0;
+
+            /// Post the handler to its executor and free the operation.
+            virtual void post(const boost::system::error_code& ec) = 0;
+
+            /// Free the operation without calling the handler.
+            virtual void destroy() = 0;
+
+            wait_op* next_;
+
+        protected:
+            ~wait_op() {}
+        };
+
+        template <typename Handler>
+        class handler_op : public wait_op
+        {
+        public:
+            typedef typename boost::asio::associated_executor<Handler,
+                boost::asio::io_context::executor_type>::type executor_type;
+
+            typedef typename std::allocator_traits<
+                typename boost::asio::associated_allocator<Handler>::type
+                >::template rebind_alloc<handler_op> allocator_type;
+
+            /// Allocate an operation with the handler's associated allocator.
+            /// The handler's executor counts it as outstanding work until the
+            /// handler has been called.
+            static handler_op* create(Handler& handler,
+                boost::asio::io_context& io_context)
+            {
+                allocator_type alloc(
+                    boost::asio::get_associated_allocator(handler));
+                handler_op* op =
+                    std::allocator_traits<allocator_type>::allocate(alloc, 1);
+                try
+                {
+                    return new (op) handler_op(handler, io_context);
+                }
+                catch (...)
+                {
+                    std::allocator_traits<allocator_type>::deallocate(
+                        alloc, op, 1);
+                    throw;
+                }
+            }
+
+            void complete(const boost::system::error_code& ec)
+            {
+                wait_binder<Handler> bound(std::move(handler_), ec);
+                boost::asio::executor_work_guard<executor_type> work(
+                    std::move(work_));
+                free(bound.handler_);
+                boost::asio::dispatch(work.get_executor(), std::move(bound));
+            }
+
+            void post(const boost::system::error_code& ec)
+            {
+                wait_binder<Handler> bound(std::move(handler_), ec);
+                boost::asio::executor_work_guard<executor_type> work(
+                    std::move(work_));
+                free(bound.handler_);
+                boost::asio::post(work.get_executor(), std::move(bound));
+            }
+
+            void destroy()
+            {
+                free(handler_);
+            }
+
+        private:
+            handler_op(Handler& handler, boost::asio::io_context& io_context)
+                : handler_(std::move(handler)),
+                work_(boost::asio::get_associated_executor(
+                    handler_, io_context.get_executor()))
+            {
+            }
+
+            ~handler_op() {}
+
+            /// Destroy and deallocate the operation, taking the allocator from
+            /// the handler that is about to be called or destroyed.
+            void free(const Handler& handler)
+            {
+                allocator_type alloc(
+                    boost::asio::get_associated_allocator(handler));
+                this->~handler_op();
+                std::allocator_traits<allocator_type>::deallocate(
+                    alloc, this, 1);
+            }
+
+            Handler handler_;
+            boost::asio::executor_work_guard<executor_type> work_;
+        };
+
+    public:
+        /// The backend implementation of a timer: a node in one of the wheel
+        /// slots while it has waits pending.
+        struct timer_impl
+        {
+            timer_impl()
+                : tick(0), prev(0), next(0), wheel(-1), slot(0), ops(0),
+                last_op(0) {}
+
+            clock_type::time_point expiry;
+
+            /// Expiry in ticks of the wheel, rounded up.
+            std::uint64_t tick;
+
+            timer_impl* prev;
+            timer_impl* next;
+
+            /// Where the timer is linked; wheel is -1 if it is not.
+            int wheel;
+            std::size_t slot;
+
+            /// Waits to complete when the timer expires, in the order they
+            /// were started.
+            wait_op* ops;
+            wait_op* last_op;
+        };
+
+        /// The type for an implementation of the timer.
+        typedef timer_impl* impl_type;
+
+        /// Constructor.
+        timer_wheel_service(boost::asio::io_context& io_context)
+            : boost::asio::io_context::service(io_context),
+            io_context_(io_context),
+            driver_(io_context),
+            origin_(clock_type::now()),
+            resolution_(std::chrono::milliseconds(1)),
+            now_(0),
+            wake_tick_(never),
+            count_(0)
+        {
+            std::fill(&slots_[0][0], &slots_[0][0] + wheel_count * wheel_size,
+                static_cast<timer_impl*>(0));
+            std::fill(occupied_, occupied_ + wheel_size / 64, std::uint64_t(0));
+        }
+
+        /// Destroy the handlers of all pending waits without calling them.
+        void shutdown()
+        {
+            for (int wheel = 0; wheel < wheel_count; ++wheel)
+            {
+                for (std::size_t slot = 0; slot < wheel_size; ++slot)
+                {
+                    while (timer_impl* t = slots_[wheel][slot])
+                    {
+                        unlink(t);
+                        destroy_ops(t);
+                    }
+                }
+            }
+        }
+
+        /// Get the io_context associated with the service.
+        boost::asio::io_context& get_io_context()
+        {
+            return io_context_;
+        }
+
+        /// Length of a tick, 1ms by default. Only to be changed while no timer
+        /// is waiting.
+        clock_type::duration resolution() const
+        {
+            return resolution_;
+        }
+
+        void set_resolution(const clock_type::duration& resolution)
+        {
+            origin_ = clock_type::now();
+            resolution_ = resolution;
+            now_ = 0;
+        }
+
+        /// Number of timers with waits pending.
+        std::size_t pending() const
+        {
+            return count_;
+        }
+
+        /// Return a null timer implementation.
+        impl_type null() const
+        {
+            return 0;
+        }
+
+        /// Create a new timer implementation.
+        void create(impl_type& impl)
+        {
+            impl = new timer_impl;
+        }
+
+        /// Destroy a timer implementation.
+        void destroy(impl_type& impl)
+        {
+            cancel(impl);
+            delete impl;
+            impl = null();
+        }
+
+        clock_type::time_point expiry(const impl_type& impl) const
+        {
+            return impl->expiry;
+        }
+
+        std::size_t expires_at(impl_type& impl,
+            const clock_type::time_point& expiry_time)
+        {
+            std::size_t count = cancel(impl);
+            impl->expiry = expiry_time;
+            impl->tick = to_tick(expiry_time);
+            return count;
+        }
+
+        std::size_t cancel(impl_type& impl)
+        {
+            if (impl->wheel < 0)
+                return 0;
+
+            unlink(impl);
+            std::size_t count = 0;
+            while (wait_op* op = impl->ops)
+            {
+                impl->ops = op->next_;
+                op->post(boost::asio::error::operation_aborted);
+                ++count;
+            }
+            impl->last_op = 0;
+
+            // Nothing left to wake for; let the io_context run out.
+            if (count_ == 0 && wake_tick_ != never)
+            {
+                wake_tick_ = never;
+                driver_.cancel();
+            }
+            return count;
+        }
+
+        template <typename WaitHandler>
+        void async_wait(impl_type& impl, WaitHandler&& handler)
+        {
+            typedef typename std::decay<WaitHandler>::type handler_type;
+            handler_type h(std::forward<WaitHandler>(handler));
+            wait_op* op = handler_op<handler_type>::create(h, io_context_);
+            if (impl->last_op)
+                impl->last_op->next_ = op;
+            else
+                impl->ops = op;
+            impl->last_op = op;
+            if (impl->wheel < 0)
+            {
+                if (count_ == 0)
+                    now_ = std::max(now_, current_tick());
+                link(impl);
+            }
+        }
+
+    private:
+        static const std::uint64_t never =
+            std::numeric_limits<std::uint64_t>::max();
+
+        std::uint64_t current_tick() const
+        {
+            return (clock_type::now() - origin_) / resolution_;
+        }
+
+        std::uint64_t to_tick(const clock_type::time_point& t) const
+        {
+            if (t <= origin_)
+                return 0;
+            clock_type::duration d = t - origin_;
+            return (d + resolution_ - clock_type::duration(1)) / resolution_;
+        }
+
+        void link(timer_impl* t)
+        {
+            std::uint64_t tick = std::max(t->tick, now_);
+            std::uint64_t delta = tick - now_;
+            int wheel = 0;
+            while (wheel < wheel_count - 1
+                && delta >> (wheel_bits * (wheel + 1)) != 0)
+                ++wheel;
+            if (delta >> (wheel_bits * wheel_count) != 0)
+                tick = now_ + (std::uint64_t(1) << (wheel_bits * wheel_count)) - 1;
+
+            std::size_t slot = (tick >> (wheel_bits * wheel)) & (wheel_size - 1);
+            timer_impl*& head = slots_[wheel][slot];
+            t->prev = 0;
+            t->next = head;
+            if (head)
+                head->prev = t;
+            head = t;
+            t->wheel = wheel;
+            t->slot = slot;
+            if (wheel == 0)
+                occupied_[slot / 64] |= std::uint64_t(1) << (slot % 64);
+            ++count_;
+
+            std::uint64_t wake = wheel == 0 ? tick : next_turn();
+            if (wake < wake_tick_)
+                schedule(wake);
+        }
+
+        void unlink(timer_impl* t)
+        {
+            if (t->prev)
+                t->prev->next = t->next;
+            else
+                slots_[t->wheel][t->slot] = t->next;
+            if (t->next)
+                t->next->prev = t->prev;
+            if (t->wheel == 0 && !slots_[0][t->slot])
+                occupied_[t->slot / 64] &= ~(std::uint64_t(1) << (t->slot % 64));
+            t->prev = t->next = 0;
+            t->wheel = -1;
+            --count_;
+        }
+
+        void destroy_ops(timer_impl* t)
+        {
+            while (wait_op* op = t->ops)
+            {
+                t->ops = op->next_;
+                op->destroy();
+            }
+            t->last_op = 0;
+        }
+
+        /// The first tick of the next turn of the first wheel.
+        std::uint64_t next_turn() const
+        {
+            return (now_ | (wheel_size - 1)) + 1;
+        }
+
+        /// The first occupied slot of the first wheel at or after slot, or
+        /// wheel_size if there is none before the wheel turns over.
+        std::size_t next_occupied(std::size_t slot) const
+        {
+            for (std::size_t word = slot / 64; word < wheel_size / 64; ++word)
+            {
+                std::uint64_t bits = occupied_[word];
+                if (word == slot / 64)
+                    bits &= ~std::uint64_t(0) << (slot % 64);
+                if (bits)
+                    return word * 64 + __builtin_ctzll(bits);
+            }
+            return wheel_size;
+        }
+
+        void schedule(std::uint64_t tick)
+        {
+            wake_tick_ = tick;
+            driver_.expires_at(origin_ + tick * resolution_);
+            driver_.async_wait(
+                [this](const boost::system::error_code& ec)
+                {
+                    if (ec != boost::asio::error::operation_aborted)
+                        on_wake();
+                });
+        }
+
+        void on_wake()
+        {
+            wake_tick_ = never;
+            wait_op* ready = advance(current_tick());
+
+            if (count_ > 0)
+            {
+                std::size_t slot = next_occupied(now_ & (wheel_size - 1));
+                schedule(slot < wheel_size
+                    ? (now_ & ~std::uint64_t(wheel_size - 1)) + slot
+                    : next_turn());
+            }
+
+            while (ready)
+            {
+                wait_op* op = ready;
+                ready = op->next_;
+                op->complete(boost::system::error_code());
+            }
+        }
+
+        /// Move the wheels on to target, returning the waits of the timers
+        /// that expired in the order they are due.
+        wait_op* advance(std::uint64_t target)
+        {
+            wait_op* ready = 0;
+            wait_op** ready_tail = &ready;
+            while (now_ <= target)
+            {
+                std::size_t slot = next_occupied(now_ & (wheel_size - 1));
+                std::uint64_t tick =
+                    (now_ & ~std::uint64_t(wheel_size - 1)) + slot;
+                if (slot == wheel_size || tick > target)
+                {
+                    // Nothing due in what is left of the target. Stop short of
+                    // ticks still in the future, so that timers armed later are
+                    // measured from the right place.
+                    move_to(std::min(tick, target + 1));
+                    continue;
+                }
+
+                now_ = tick;
+                while (timer_impl* t = slots_[0][slot])
+                {
+                    unlink(t);
+                    if (t->tick > now_)
+                    {
+                        // Beyond the reach of the wheels when it was armed.
+                        link(t);
+                        continue;
+                    }
+                    *ready_tail = t->ops;
+                    ready_tail = &t->last_op->next_;
+                    t->ops = t->last_op = 0;
+                }
+                move_to(now_ + 1);
+            }
+            return ready;
+        }
+
+        /// Set the next tick to process, which is at most the next turn of the
+        /// first wheel. On the turn itself the wheels above are cascaded at
+        /// once, so that the first wheel holds everything due in the new turn
+        /// before the next wake is chosen from it.
+        void move_to(std::uint64_t tick)
+        {
+            now_ = tick;
+            if ((now_ & (wheel_size - 1)) == 0)
+                cascade(1);
+        }
+
+        /// Spread the current slot of a wheel over the wheels below it, first
+        /// refilling it from the wheel above if that one turned over too.
+        void cascade(int wheel)
+        {
+            std::size_t slot = (now_ >> (wheel_bits * wheel)) & (wheel_size - 1);
+            if (slot == 0 && wheel < wheel_count - 1)
+                cascade(wheel + 1);
+
+            timer_impl* t = slots_[wheel][slot];
+            while (t)
+            {
+                timer_impl* next = t->next;
+                unlink(t);
+                link(t);
+                t = next;
+            }
+        }
+
+        boost::asio::io_context& io_context_;
+        boost::asio::steady_timer driver_;
+        clock_type::time_point origin_;
+        clock_type::duration resolution_;
+
+        /// The next tick to process.
+        std::uint64_t now_;
+
+        /// The tick driver_ is set for, or never.
+        std::uint64_t wake_tick_;
+
+        std::size_t count_;
+        timer_impl* slots_[wheel_count][wheel_size];
+
+        /// Which slots of the first wheel have timers.
+        std::uint64_t occupied_[wheel_size / 64];
+    };
+
+    boost::asio::io_context::id timer_wheel_service::id;
+
+    typedef basic_wheel_timer<timer_wheel_service> wheel_timer;
+} // namespace services
+
+TEST(asio, WheelTimer)
+{
+    boost::asio::io_context io_context;
+    // A fine tick, so that the wheels above the first are reached quickly.
+    boost::asio::use_service<services::timer_wheel_service>(io_context)
+        .set_resolution(std::chrono::microseconds(10));
+
+    typedef std::chrono::steady_clock clock;
+    const std::chrono::milliseconds delays[] = {
+        std::chrono::milliseconds(150), std::chrono::milliseconds(1),
+        std::chrono::milliseconds(700), std::chrono::milliseconds(20),
+        std::chrono::milliseconds(3) };
+    const std::size_t count = sizeof(delays) / sizeof(delays[0]);
+
+    std::vector<std::unique_ptr<services::wheel_timer>> timers;
+    std::vector<clock::time_point> fired(count);
+    std::vector<std::size_t> order;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        timers.emplace_back(new services::wheel_timer(io_context, delays[i]));
+        timers[i]->async_wait(
+            [&, i](const boost::system::error_code& ec)
+            {
+                EXPECT_FALSE(ec);
+                fired[i] = clock::now();
+                order.push_back(i);
+            });
+    }
+
+    // Cancelled, re-armed and destroyed timers complete with operation_aborted.
+    std::size_t aborted = 0;
+    auto count_aborted = [&aborted](const boost::system::error_code& ec)
+    {
+        EXPECT_EQ(boost::asio::error::operation_aborted, ec);
+        ++aborted;
+    };
+    services::wheel_timer cancelled(io_context, std::chrono::milliseconds(5));
+    cancelled.async_wait(count_aborted);
+    EXPECT_EQ(1u, cancelled.cancel());
+    EXPECT_EQ(0u, cancelled.cancel());
+
+    services::wheel_timer rearmed(io_context, std::chrono::milliseconds(10));
+    rearmed.async_wait(count_aborted);
+    EXPECT_EQ(1u, rearmed.expires_after(std::chrono::milliseconds(200)));
+    clock::time_point rearmed_fired;
+    rearmed.async_wait(
+        [&rearmed_fired](const boost::system::error_code& ec)
+        {
+            EXPECT_FALSE(ec);
+            rearmed_fired = clock::now();
+        });
+
+    std::unique_ptr<services::wheel_timer> destroyed(
+        new services::wheel_timer(io_context, std::chrono::milliseconds(5)));
+    destroyed->async_wait(count_aborted);
+    destroyed.reset();
+
+    io_context.run();
+
+    EXPECT_EQ(3u, aborted);
+    ASSERT_EQ(count, order.size());
+    for (std::size_t i = 1; i < count; ++i)
+        EXPECT_LE(delays[order[i - 1]], delays[order[i]]);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        EXPECT_GE(fired[i], timers[i]->expiry());
+        EXPECT_LT(fired[i], timers[i]->expiry() + std::chrono::milliseconds(50));
+    }
+    EXPECT_GE(rearmed_fired, rearmed.expiry());
+}
+
+TEST(asio, WheelTimerTurnBoundary)
+{
+    // A wakes on the last tick of a turn of the first wheel, so the wheel
+    // turns over as A fires and B has to be cascaded down from the wheel
+    // above before the next wake is chosen.
+    boost::asio::io_context io_context;
+    boost::asio::use_service<services::timer_wheel_service>(io_context)
+        .set_resolution(std::chrono::milliseconds(1));
+
+    typedef std::chrono::steady_clock clock;
+    services::wheel_timer a(io_context, std::chrono::microseconds(254500));
+    services::wheel_timer b(io_context, std::chrono::milliseconds(300));
+    clock::time_point a_fired, b_fired;
+    a.async_wait(
+        [&a_fired](const boost::system::error_code& ec)
+        {
+            EXPECT_FALSE(ec);
+            a_fired = clock::now();
+        });
+    b.async_wait(
+        [&b_fired](const boost::system::error_code& ec)
+        {
+            EXPECT_FALSE(ec);
+            b_fired = clock::now();
+        });
+
+    io_context.run();
+
+    EXPECT_GE(a_fired, a.expiry());
+    EXPECT_GE(b_fired, b.expiry());
+    EXPECT_LT(b_fired, b.expiry() + std::chrono::milliseconds(50));
+}
+
+TEST(asio, WheelTimerLateWakeOrder)
+{
+    // The io_context is held up past every expiry, so all the timers are
+    // found due on the same wake and have to fire in order of expiry, as
+    // steady_timer's do. Waits on one timer fire in the order they started.
+    boost::asio::io_context io_context;
+    boost::asio::use_service<services::timer_wheel_service>(io_context)
+        .set_resolution(std::chrono::milliseconds(1));
+
+    std::vector<int> fired;
+    auto record = [&fired](int n)
+        {
+            return [&fired, n](const boost::system::error_code& ec)
+                {
+                    EXPECT_FALSE(ec);
+                    fired.push_back(n);
+                };
+        };
+    services::wheel_timer t2(io_context, std::chrono::milliseconds(2));
+    services::wheel_timer t5(io_context, std::chrono::milliseconds(5));
+    services::wheel_timer t8(io_context, std::chrono::milliseconds(8));
+    t8.async_wait(record(8));
+    t2.async_wait(record(2));
+    t5.async_wait(record(5));
+    t5.async_wait(record(6));
+    t5.async_wait(record(7));
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    io_context.run();
+
+    std::vector<int> expected = { 2, 5, 6, 7, 8 };
+    EXPECT_EQ(expected, fired);
+}
+
+TEST(asio, WheelTimerAssociatedExecutor)
+{
+    boost::asio::io_context io_context;
+    boost::asio::io_context::strand strand(io_context);
+
+    // A handler bound to a strand runs inside it.
+    services::wheel_timer expired(io_context, std::chrono::milliseconds(5));
+    bool in_strand = false;
+    expired.async_wait(boost::asio::bind_executor(strand,
+        [&](const boost::system::error_code& ec)
+        {
+            EXPECT_FALSE(ec);
+            in_strand = strand.running_in_this_thread();
+        }));
+
+    services::wheel_timer cancelled(io_context, std::chrono::seconds(5));
+    bool aborted_in_strand = false;
+    cancelled.async_wait(boost::asio::bind_executor(strand,
+        [&](const boost::system::error_code& ec)
+        {
+            EXPECT_EQ(boost::asio::error::operation_aborted, ec);
+            aborted_in_strand = strand.running_in_this_thread();
+        }));
+    cancelled.cancel();
+
+    io_context.run();
+    EXPECT_TRUE(in_strand);
+    EXPECT_TRUE(aborted_in_strand);
+
+    // Completion tokens go through async_initiate.
+    io_context.restart();
+    services::wheel_timer waited(io_context, std::chrono::milliseconds(5));
+    std::future<void> done = waited.async_wait(boost::asio::use_future);
+    io_context.run();
+    EXPECT_NO_THROW(done.get());
+
+    io_context.restart();
+    services::wheel_timer aborted(io_context, std::chrono::seconds(5));
+    std::future<void> failed = aborted.async_wait(boost::asio::use_future);
+    aborted.cancel();
+    io_context.run();
+    EXPECT_THROW(failed.get(), boost::system::system_error);
+}
+
+// Arms per second for a timer type with count timers pending. Each arm is an
+// idle-timeout reset: a new expiry, which aborts the pending wait, and a new
+// wait.
+template <typename Timer>
+double timer_arm_rate(std::size_t count, std::chrono::milliseconds duration)
+{
+    boost::asio::io_context io_context;
+    const std::chrono::seconds timeout(30);
+    auto handler = [](const boost::system::error_code&) {};
+
+    std::vector<std::unique_ptr<Timer>> timers;
+    timers.reserve(count);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        timers.emplace_back(new Timer(io_context, timeout));
+        timers.back()->async_wait(handler);
+    }
+
+    enum { batch = 1024 };
+    std::size_t arms = 0;
+    std::size_t next = 0;
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed;
+    do
+    {
+        for (int i = 0; i < batch; ++i)
+        {
+            Timer& timer = *timers[next];
+            timer.expires_after(timeout);
+            timer.async_wait(handler);
+            if (++next == count)
+                next = 0;
+        }
+        arms += batch;
+        io_context.poll();
+        elapsed = std::chrono::steady_clock::now() - start;
+    } while (elapsed < duration);
+    return arms / elapsed.count();
+}
+
+TEST(asio, WheelTimerArmRate)
+{
+    const std::chrono::milliseconds duration(1000);
+    for (std::size_t count : { 10000, 100000, 1000000 })
+    {
+        double heap = timer_arm_rate<boost::asio::steady_timer>(count, duration);
+        double wheel = timer_arm_rate<services::wheel_timer>(count, duration);
+        EXPECT_GT(wheel, 0);
+        std::cout << count << " timers: steady_timer " << heap
+            << " arms/s, wheel_timer " << wheel << " arms/s" << std::endl;
+    }
+}
@@ -24,17 +24,26 @@ using boost::asio::ip::tcp;
 using boost::asio::windows::overlapped_ptr;
 using boost::asio::windows::random_access_handle;
 
-// A wrapper for the TransmitFile overlapped I/O operation.
+#include <algorithm>
+#include <sstream>
+
+// A wrapper for the TransmitFile overlapped I/O operation. Sends length bytes
+// of the file starting at offset; a length of 0 sends to the end of the file.
+// TransmitFile takes a 32-bit length, so larger ranges have to be sent in
+// several calls.
 template <typename Handler>
 void transmit_file(tcp::socket& socket,
-    random_access_handle& file, Handler handler)
+    random_access_handle& file, boost::uint64_t offset, DWORD length,
+    Handler handler)
 {
   // Construct an OVERLAPPED-derived object to contain the handler.
   overlapped_ptr overlapped(GET_IO_SERVICE(socket), handler);
+  overlapped.get()->Offset = static_cast<DWORD>(offset);
+  overlapped.get()->OffsetHigh = static_cast<DWORD>(offset >> 32);
 
   // Initiate the TransmitFile operation.
   BOOL ok = ::TransmitFile(socket.native_handle(),
-      file.native_handle(), 0, 0, overlapped.get(), 0, 0);
+      file.native_handle(), length, 0, overlapped.get(), 0, 0);
   DWORD last_error = ::GetLastError();
 
   // Check if the operation completed immediately.
@@ -72,6 +81,9 @@ public:
     return socket_;
   }
 
+  // Serve range requests until the client closes the connection. A request
+  // is a line "<offset> <length>", where a length of 0 asks for the rest of
+  // the file; the reply is a line with the number of bytes that follow.
   void start()
   {
     boost::system::error_code ec;
@@ -79,10 +91,7 @@ public:
           OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, 0), ec);
     if (file_.is_open())
     {
-      transmit_file(socket_, file_,
-          std::bind(&connection::handle_write, shared_from_this(),
-            std::placeholders::_1,
-              std::placeholders::_2));
+      read_request();
     }
   }
 
@@ -90,20 +99,101 @@ public:
   connection(boost::asio::io_service& io_service, const std::wstring& filename)
     : socket_(io_service),
       filename_(filename),
-      file_(io_service)
+      file_(io_service),
+      request_(128),
+      offset_(0),
+      remaining_(0)
+  {
+  }
+
+  void read_request()
+  {
+    boost::asio::async_read_until(socket_, request_, '\n',
+        std::bind(&connection::handle_request, shared_from_this(),
+          std::placeholders::_1));
+  }
+
+  void handle_request(const boost::system::error_code& error)
+  {
+    std::istream is(&request_);
+    std::string line;
+    std::getline(is, line);
+    std::istringstream fields(line);
+    boost::uint64_t length;
+    LARGE_INTEGER size;
+    if (error || !(fields >> offset_ >> length)
+        || !::GetFileSizeEx(file_.native_handle(), &size))
+    {
+      shutdown();
+      return;
+    }
+
+    offset_ = (std::min)(offset_, boost::uint64_t(size.QuadPart));
+    if (length == 0 || length > size.QuadPart - offset_)
+      length = size.QuadPart - offset_;
+    remaining_ = length;
+
+    header_ = std::to_string(length) + "\n";
+    boost::asio::async_write(socket_, boost::asio::buffer(header_),
+        std::bind(&connection::handle_header, shared_from_this(),
+          std::placeholders::_1));
+  }
+
+  void handle_header(const boost::system::error_code& error)
+  {
+    if (error)
+      shutdown();
+    else
+      send_chunk();
+  }
+
+  // Send the range in chunks of at most max_chunk bytes.
+  void send_chunk()
+  {
+    if (remaining_ == 0)
+    {
+      read_request();
+      return;
+    }
+
+    transmit_file(socket_, file_, offset_,
+        static_cast<DWORD>((std::min)(remaining_, boost::uint64_t(max_chunk))),
+        std::bind(&connection::handle_write, shared_from_this(),
+          std::placeholders::_1,
+            std::placeholders::_2));
+  }
+
+  void handle_write(const boost::system::error_code& error,
+      size_t bytes_transferred)
   {
+    // No progress means the file shrank under us; the client is owed more
+    // bytes than there are, so the connection cannot be reused.
+    if (error || bytes_transferred == 0)
+    {
+      shutdown();
+      return;
+    }
+
+    offset_ += bytes_transferred;
+    remaining_ -= bytes_transferred;
+    send_chunk();
   }
 
-  void handle_write(const boost::system::error_code& /*error*/,
-      size_t /*bytes_transferred*/)
+  void shutdown()
   {
     boost::system::error_code ignored_ec;
     socket_.shutdown(tcp::socket::shutdown_both, ignored_ec);
   }
 
+  enum { max_chunk = 1 << 30 };
+
   tcp::socket socket_;
   std::wstring filename_;
   random_access_handle file_;
+  boost::asio::streambuf request_;
+  std::string header_;
+  boost::uint64_t offset_;
+  boost::uint64_t remaining_;
 };
 
 class server
@@ -177,6 +267,904 @@ TEST(asio, TransmitFile)
   }
 }
 
-#else // defined(BOOST_ASIO_HAS_WINDOWS_OVERLAPPED_PTR)
+#elif defined(__linux__)
+
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "uring_queue.hpp"
+
+// The Linux counterpart of the TransmitFile server. The classes live in a
+// namespace of their own as other tests in this program define a server too.
+namespace zero_copy {
+
+using boost::asio::ip::tcp;
+
+// Composed operation behind transmit_file. The kernel moves the data straight
+// from the file's page cache, or from a pipe's buffers, to the socket:
+// sendfile for anything that can be mapped, splice for pipes. The socket is
+// non-blocking, so each call sends what fits in the socket buffer; when it is
+// full the operation waits for the socket to become writable (or, for a pipe,
+// readable) through the reactor and carries on.
+template <typename Handler>
+class transmit_file_op
+{
+public:
+  transmit_file_op(tcp::socket& socket, int fd, std::uint64_t offset,
+      std::uint64_t length,
+      std::shared_ptr<boost::asio::posix::stream_descriptor> pipe,
+      Handler handler)
+    : socket_(socket),
+      fd_(fd),
+      offset_(offset),
+      remaining_(length),
+      sent_(0),
+      pipe_(pipe),
+      handler_(std::move(handler)),
+      started_(false)
+  {
+  }
+
+  void operator()(boost::system::error_code ec = boost::system::error_code())
+  {
+    bool first_call = !started_;
+    started_ = true;
+
+    // However large the range, send at most this much before letting other
+    // handlers run.
+    std::size_t budget = max_bytes_per_turn;
+    while (!ec && remaining_ > 0)
+    {
+      if (budget == 0)
+      {
+        socket_.async_wait(tcp::socket::wait_write, std::move(*this));
+        return;
+      }
+
+      std::size_t chunk = static_cast<std::size_t>(
+          std::min<std::uint64_t>(remaining_, budget));
+      ssize_t n;
+      if (pipe_)
+      {
+        n = ::splice(fd_, 0, socket_.native_handle(), 0, chunk,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      }
+      else
+      {
+        off_t offset = static_cast<off_t>(offset_);
+        n = ::sendfile(socket_.native_handle(), fd_, &offset, chunk);
+      }
+
+      if (n > 0)
+      {
+        offset_ += n;
+        remaining_ -= n;
+        sent_ += n;
+        budget -= n;
+      }
+      else if (n == 0)
+      {
+        // End of file, or the writing end of the pipe was closed.
+        break;
+      }
+      else if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        if (pipe_ && !readable(fd_))
+          pipe_->async_wait(boost::asio::posix::stream_descriptor::wait_read,
+              std::move(*this));
+        else
+          socket_.async_wait(tcp::socket::wait_write, std::move(*this));
+        return;
+      }
+      else if (errno != EINTR)
+      {
+        ec = boost::system::error_code(errno,
+            boost::asio::error::get_system_category());
+      }
+    }
+
+    // Never call the handler from within transmit_file itself.
+    if (first_call)
+    {
+      boost::asio::post(socket_.get_executor(),
+          std::bind(std::move(handler_), ec, std::size_t(sent_)));
+    }
+    else
+    {
+      handler_(ec, std::size_t(sent_));
+    }
+  }
+
+private:
+  enum { max_bytes_per_turn = 4 << 20 };
+
+  static bool readable(int fd)
+  {
+    pollfd p = { fd, POLLIN, 0 };
+    return ::poll(&p, 1, 0) > 0;
+  }
+
+  tcp::socket& socket_;
+  int fd_;
+  std::uint64_t offset_;
+  std::uint64_t remaining_;
+  std::uint64_t sent_;
+  std::shared_ptr<boost::asio::posix::stream_descriptor> pipe_;
+  Handler handler_;
+  bool started_;
+};
+
+// Send length bytes of fd, starting at offset, to the socket. fd is a regular
+// file or the reading end of a pipe, for which the offset is ignored and a
+// length of 0 means until the writer closes it. The transfer also ends early
+// at the end of the file. The handler has the signature of the Windows
+// wrapper's:
+// void(const boost::system::error_code&, std::size_t bytes_transferred).
+// The file descriptor must stay open until the handler is called. A pipe is
+// switched to non-blocking mode, and as that is a property of the open pipe
+// rather than of one descriptor, fd is left non-blocking afterwards.
+template <typename Handler>
+void transmit_file(tcp::socket& socket, int fd, std::uint64_t offset,
+    std::uint64_t length, Handler handler)
+{
+  boost::system::error_code ec;
+  socket.native_non_blocking(true, ec);
+
+  struct stat st;
+  if (!ec && ::fstat(fd, &st) != 0)
+    ec = boost::system::error_code(errno,
+        boost::asio::error::get_system_category());
+
+  // A pipe has no length and cannot be mapped: splice it until the writer
+  // closes it, waiting for data through a descriptor of our own.
+  std::shared_ptr<boost::asio::posix::stream_descriptor> pipe;
+  if (!ec && S_ISFIFO(st.st_mode))
+  {
+    offset = 0;
+    if (length == 0)
+      length = ~std::uint64_t(0);
+    pipe = std::make_shared<boost::asio::posix::stream_descriptor>(
+        socket.get_executor());
+    int pipe_fd = ::dup(fd);
+    if (pipe_fd == -1)
+    {
+      ec = boost::system::error_code(errno,
+          boost::asio::error::get_system_category());
+    }
+    else
+    {
+      pipe->assign(pipe_fd, ec);
+      if (ec)
+        ::close(pipe_fd);
+      else
+        pipe->non_blocking(true, ec);
+    }
+  }
+
+  if (ec)
+  {
+    boost::asio::post(socket.get_executor(),
+        std::bind(std::move(handler), ec, std::size_t(0)));
+    return;
+  }
+
+  transmit_file_op<Handler>(socket, fd, offset, length, pipe,
+      std::move(handler))();
+}
+
+// Send all of fd to the socket.
+template <typename Handler>
+void transmit_file(tcp::socket& socket, int fd, Handler handler)
+{
+  transmit_file(socket, fd, 0, ~std::uint64_t(0), std::move(handler));
+}
+
+// A range request is a line "<offset> <length>", where a length of 0 asks for
+// everything from offset to the end of the file. The reply is a line holding
+// the number of bytes that follow, which is less than asked for when the
+// range runs past the end of the file. A connection serves requests until the
+// client closes it, so clients can fetch parts of a file in parallel over
+// several connections, or resume an interrupted transfer.
+bool parse_range(boost::asio::streambuf& request, int fd,
+    std::uint64_t& offset, std::uint64_t& length)
+{
+  std::istream is(&request);
+  std::string line;
+  std::getline(is, line);
+  std::istringstream fields(line);
+  struct stat st;
+  if (!(fields >> offset >> length) || ::fstat(fd, &st) != 0)
+    return false;
+
+  std::uint64_t size = st.st_size;
+  offset = std::min(offset, size);
+  if (length == 0 || length > size - offset)
+    length = size - offset;
+  return true;
+}
+
+// The longest request line a connection accepts.
+enum { max_request_size = 128 };
+
+class connection
+  : public std::enable_shared_from_this<connection>
+{
+public:
+  typedef std::shared_ptr<connection> pointer;
+
+  static pointer create(boost::asio::io_context& io_context,
+      const std::string& filename)
+  {
+    return std::make_shared<connection>(io_context, filename);
+  }
+
+  connection(boost::asio::io_context& io_context, const std::string& filename)
+    : socket_(io_context),
+      filename_(filename),
+      fd_(-1),
+      request_(max_request_size),
+      length_(0)
+  {
+  }
+
+  ~connection()
+  {
+    if (fd_ != -1)
+      ::close(fd_);
+  }
+
+  tcp::socket& socket()
+  {
+    return socket_;
+  }
+
+  void start()
+  {
+    fd_ = ::open(filename_.c_str(), O_RDONLY);
+    if (fd_ != -1)
+    {
+      read_request();
+    }
+  }
+
+  void handle_write(const boost::system::error_code& error,
+      size_t bytes_transferred)
+  {
+    // If the file shrank under us the client is owed more bytes than there
+    // are, so the connection cannot be used for another request.
+    if (!error && bytes_transferred == length_)
+    {
+      read_request();
+    }
+    else
+    {
+      boost::system::error_code ignored_ec;
+      socket_.shutdown(tcp::socket::shutdown_both, ignored_ec);
+    }
+  }
+
+private:
+  void read_request()
+  {
+    boost::asio::async_read_until(socket_, request_, '\n',
+        std::bind(&connection::handle_request, shared_from_this(),
+          std::placeholders::_1));
+  }
+
+  void handle_request(const boost::system::error_code& error)
+  {
+    std::uint64_t offset;
+    if (error || !parse_range(request_, fd_, offset, length_))
+    {
+      boost::system::error_code ignored_ec;
+      socket_.shutdown(tcp::socket::shutdown_both, ignored_ec);
+      return;
+    }
+
+    header_ = std::to_string(length_) + "\n";
+    auto self(shared_from_this());
+    boost::asio::async_write(socket_, boost::asio::buffer(header_),
+        [this, self, offset](const boost::system::error_code& ec, std::size_t)
+        {
+          if (ec || length_ == 0)
+            return handle_write(ec, 0);
+          transmit_file(socket_, fd_, offset, length_,
+              std::bind(&connection::handle_write, shared_from_this(),
+                std::placeholders::_1,
+                  std::placeholders::_2));
+        });
+  }
+
+  tcp::socket socket_;
+  std::string filename_;
+  int fd_;
+  boost::asio::streambuf request_;
+  std::string header_;
+  std::uint64_t length_;
+};
+
+// A connection that sends file ranges through io_uring instead of sendfile.
+// A range is read in chunks into two of the queue's registered buffers, so
+// the next chunk is being read while the previous one is being written, and
+// the reads and writes of every connection are submitted to the kernel
+// together once per turn of the io_context. The server owns the queue, and a
+// connection left in the io_context after the server is gone does nothing.
+class uring_connection
+  : public std::enable_shared_from_this<uring_connection>
+{
+public:
+  typedef std::shared_ptr<uring_connection> pointer;
+
+  uring_connection(boost::asio::io_context& io_context,
+      const std::string& filename, const std::shared_ptr<uring_queue>& queue)
+    : socket_(io_context),
+      filename_(filename),
+      queue_(queue),
+      fd_(-1),
+      request_(max_request_size),
+      end_(0),
+      read_offset_(0),
+      write_offset_(0),
+      reads_(0),
+      writing_(false),
+      truncated_(false)
+  {
+    for (chunk& c : chunks_)
+    {
+      c.index = -1;
+      c.offset = 0;
+      c.size = 0;
+      c.ready = false;
+    }
+  }
+
+  ~uring_connection()
+  {
+    if (std::shared_ptr<uring_queue> queue = queue_.lock())
+      for (chunk& c : chunks_)
+        if (c.index != -1)
+          queue->release_buffer(c.index);
+    if (fd_ != -1)
+      ::close(fd_);
+  }
+
+  tcp::socket& socket()
+  {
+    return socket_;
+  }
+
+  void start()
+  {
+    std::shared_ptr<uring_queue> queue = queue_.lock();
+    if (!queue)
+      return;
+    fd_ = ::open(filename_.c_str(), O_RDONLY);
+    if (fd_ == -1)
+      return;
+
+    for (chunk& c : chunks_)
+      c.index = queue->acquire_buffer();
+    if (chunks_[0].index != -1 && chunks_[1].index != -1)
+      read_request();
+  }
+
+private:
+  struct chunk
+  {
+    int index;
+    std::uint64_t offset;
+    std::size_t size;
+    bool ready;
+  };
+
+  void read_request()
+  {
+    auto self(shared_from_this());
+    boost::asio::async_read_until(socket_, request_, '\n',
+        [this, self](const boost::system::error_code& ec, std::size_t)
+        {
+          std::uint64_t offset, length;
+          if (ec || !parse_range(request_, fd_, offset, length))
+            return finish();
+
+          header_ = std::to_string(length) + "\n";
+          boost::asio::async_write(socket_, boost::asio::buffer(header_),
+              [this, self, offset, length](const boost::system::error_code& ec,
+                std::size_t)
+              {
+                if (ec)
+                  return finish();
+                send_range(offset, length);
+              });
+        });
+  }
+
+  void send_range(std::uint64_t offset, std::uint64_t length)
+  {
+    read_offset_ = write_offset_ = offset;
+    end_ = offset + length;
+    for (chunk& c : chunks_)
+      read_chunk(c);
+    write_next();
+  }
+
+  void read_chunk(chunk& c)
+  {
+    c.ready = false;
+    if (read_offset_ >= end_)
+      return;
+    std::shared_ptr<uring_queue> queue = queue_.lock();
+    if (!queue)
+      return finish();
+
+    boost::asio::mutable_buffer b = queue->buffer(c.index);
+    c.offset = read_offset_;
+    c.size = static_cast<std::size_t>(
+        std::min<std::uint64_t>(b.size(), end_ - read_offset_));
+    read_offset_ += c.size;
+    ++reads_;
+
+    auto self(shared_from_this());
+    queue->async_read_fixed(fd_, boost::asio::buffer(b, c.size), c.index,
+        c.offset,
+        [this, self, &c](const boost::system::error_code& ec, std::size_t n)
+        {
+          --reads_;
+          if (ec && ec != boost::asio::error::eof)
+            return finish();
+
+          // A short read means the file shrank; send what was read.
+          if (n < c.size && c.offset + n < end_)
+          {
+            end_ = c.offset + n;
+            truncated_ = true;
+          }
+          c.size = n;
+          c.ready = true;
+          write_next();
+        });
+  }
+
+  // Chunks may finish reading out of order; write them in file order. Once
+  // the range is done, wait for the next request.
+  void write_next()
+  {
+    if (writing_)
+      return;
+    if (write_offset_ >= end_)
+    {
+      if (reads_ == 0)
+      {
+        if (truncated_)
+          return finish();
+        read_request();
+      }
+      return;
+    }
+    for (chunk& c : chunks_)
+    {
+      if (c.ready && c.size > 0 && c.offset == write_offset_)
+      {
+        writing_ = true;
+        write_chunk(c, 0);
+        return;
+      }
+    }
+  }
+
+  void write_chunk(chunk& c, std::size_t done)
+  {
+    std::shared_ptr<uring_queue> queue = queue_.lock();
+    if (!queue)
+      return finish();
+
+    auto self(shared_from_this());
+    queue->async_write_fixed(socket_.native_handle(),
+        boost::asio::buffer(queue->buffer(c.index) + done, c.size - done),
+        c.index, 0,
+        [this, self, &c, done](const boost::system::error_code& ec,
+          std::size_t n)
+        {
+          if (ec)
+            return finish();
+          if (done + n < c.size)
+            return write_chunk(c, done + n);
+
+          writing_ = false;
+          write_offset_ += c.size;
+          c.ready = false;
+          read_chunk(c);
+          write_next();
+        });
+  }
+
+  void finish()
+  {
+    boost::system::error_code ignored_ec;
+    socket_.shutdown(tcp::socket::shutdown_both, ignored_ec);
+  }
+
+  tcp::socket socket_;
+  std::string filename_;
+  std::weak_ptr<uring_queue> queue_;
+  int fd_;
+  boost::asio::streambuf request_;
+  std::string header_;
+  std::uint64_t end_;
+  std::uint64_t read_offset_;
+  std::uint64_t write_offset_;
+  std::size_t reads_;
+  bool writing_;
+  bool truncated_;
+  chunk chunks_[2];
+};
+
+class server
+{
+public:
+  // With use_uring the file is sent through io_uring where the kernel
+  // supports it, and with sendfile otherwise.
+  server(boost::asio::io_context& io_context,
+      unsigned short port, const std::string& filename, bool use_uring = false)
+    : acceptor_(io_context, tcp::endpoint(tcp::v4(), port)),
+      filename_(filename)
+  {
+    if (use_uring)
+    {
+      queue_.reset(new uring_queue(io_context, 256, 256 << 10, 64));
+      if (!queue_->is_open())
+        queue_.reset();
+    }
+    start_accept();
+  }
+
+  bool uses_uring() const
+  {
+    return queue_ != nullptr;
+  }
+
+  unsigned short port() const
+  {
+    return acceptor_.local_endpoint().port();
+  }
+
+private:
+  void start_accept()
+  {
+    if (queue_)
+    {
+      uring_connection::pointer new_connection =
+        std::make_shared<uring_connection>(GET_IO_SERVICE(acceptor_),
+            filename_, queue_);
+
+      acceptor_.async_accept(new_connection->socket(),
+          std::bind(&server::handle_accept<uring_connection::pointer>,
+              this, new_connection, std::placeholders::_1
+              ));
+      return;
+    }
+
+    connection::pointer new_connection =
+      connection::create(GET_IO_SERVICE(acceptor_), filename_);
+
+    acceptor_.async_accept(new_connection->socket(),
+        std::bind(&server::handle_accept<connection::pointer>,
+            this, new_connection, std::placeholders::_1
+            ));
+  }
+
+  template <typename Pointer>
+  void handle_accept(Pointer new_connection,
+      const boost::system::error_code& error)
+  {
+    if (!error)
+    {
+      new_connection->start();
+    }
+
+    start_accept();
+  }
+
+  tcp::acceptor acceptor_;
+  std::string filename_;
+  std::shared_ptr<uring_queue> queue_;
+};
+
+// Read everything the peer sends until it closes the connection.
+std::string receive_all(unsigned short port)
+{
+  boost::asio::io_context io_context;
+  tcp::socket socket(io_context);
+  socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), port));
+
+  std::string data;
+  std::vector<char> buffer(1 << 16);
+  boost::system::error_code ec;
+  for (;;)
+  {
+    std::size_t n = socket.read_some(boost::asio::buffer(buffer), ec);
+    data.append(buffer.data(), n);
+    if (ec)
+      break;
+  }
+  return data;
+}
+
+// Blocking client for the range protocol, keeping one connection open across
+// requests.
+class range_client
+{
+public:
+  explicit range_client(unsigned short port)
+    : socket_(io_context_)
+  {
+    socket_.connect(
+        tcp::endpoint(boost::asio::ip::address_v4::loopback(), port));
+  }
+
+  std::string fetch(std::uint64_t offset, std::uint64_t length)
+  {
+    std::string request =
+      std::to_string(offset) + " " + std::to_string(length) + "\n";
+    boost::asio::write(socket_, boost::asio::buffer(request));
+
+    // Part of the data may have arrived along with the header.
+    std::size_t header = boost::asio::read_until(socket_, reply_, '\n');
+    std::string size_line(
+        boost::asio::buffers_begin(reply_.data()),
+        boost::asio::buffers_begin(reply_.data()) + header);
+    reply_.consume(header);
+
+    std::string data(std::stoull(size_line), '\0');
+    std::size_t buffered = std::min(data.size(), reply_.size());
+    boost::asio::buffer_copy(boost::asio::buffer(&data[0], buffered),
+        reply_.data());
+    reply_.consume(buffered);
+    if (buffered < data.size())
+      boost::asio::read(socket_,
+          boost::asio::buffer(&data[buffered], data.size() - buffered));
+    return data;
+  }
+
+private:
+  boost::asio::io_context io_context_;
+  tcp::socket socket_;
+  boost::asio::streambuf reply_;
+};
+
+std::string make_test_data(std::size_t size)
+{
+  std::string data(size, '\0');
+  std::uint32_t x = 12345;
+  for (char& c : data)
+  {
+    x = x * 1103515245 + 12345;
+    c = static_cast<char>(x >> 16);
+  }
+  return data;
+}
+
+} // namespace zero_copy
+
+TEST(asio, TransmitFile)
+{
+  using namespace zero_copy;
+
+  const char* path = "transmit_file_test.bin";
+  std::string data = make_test_data(32 << 20);
+  {
+    std::ofstream os(path, std::ios::binary);
+    os.write(data.data(), data.size());
+  }
+
+  for (bool use_uring : { false, true })
+  {
+    boost::asio::io_context io_context;
+    server s(io_context, 0, path, use_uring);
+    std::thread io_thread([&io_context]() { io_context.run(); });
+    const char* name = s.uses_uring() ? "io_uring"
+      : use_uring ? "sendfile (no io_uring)" : "sendfile";
+
+    // Several clients, one after the other, each get the whole file.
+    for (int i = 0; i < 3; ++i)
+    {
+      auto start = std::chrono::steady_clock::now();
+      std::string received = range_client(s.port()).fetch(0, 0);
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+      EXPECT_EQ(data.size(), received.size());
+      EXPECT_TRUE(data == received);
+      std::cout << name << ": "
+        << data.size() / elapsed.count() / 1e6 << " MB/s" << std::endl;
+    }
+
+    io_context.stop();
+    io_thread.join();
+  }
+  std::remove(path);
+}
+
+TEST(asio, TransmitRange)
+{
+  using namespace zero_copy;
+
+  const char* path = "transmit_range_test.bin";
+  std::string data = make_test_data(12 << 20);
+  {
+    std::ofstream os(path, std::ios::binary);
+    os.write(data.data(), data.size());
+  }
+
+  for (bool use_uring : { false, true })
+  {
+    boost::asio::io_context io_context;
+    server s(io_context, 0, path, use_uring);
+    std::thread io_thread([&io_context]() { io_context.run(); });
+
+    // Several requests over one connection, including ranges that run past
+    // the end of the file.
+    {
+      range_client client(s.port());
+      EXPECT_EQ(data.substr(0, 100), client.fetch(0, 100));
+      EXPECT_EQ(data.substr(5 << 20, 3 << 20), client.fetch(5 << 20, 3 << 20));
+      EXPECT_EQ(data.substr(data.size() - 10),
+          client.fetch(data.size() - 10, 100));
+      EXPECT_EQ("", client.fetch(data.size() + 1, 100));
+      EXPECT_EQ(data.substr(1000), client.fetch(1000, 0));
+    }
+
+    // Fetch quarters of the file in parallel and put them back together.
+    {
+      const std::size_t parts = 4;
+      const std::size_t part_size = data.size() / parts;
+      std::vector<std::string> received(parts);
+      std::vector<std::thread> fetchers;
+      for (std::size_t i = 0; i < parts; ++i)
+      {
+        fetchers.emplace_back([&, i]()
+            {
+              range_client client(s.port());
+              received[i] = client.fetch(i * part_size,
+                  i + 1 == parts ? 0 : part_size);
+            });
+      }
+      for (auto& t : fetchers)
+        t.join();
+
+      std::string whole;
+      for (auto& part : received)
+        whole += part;
+      EXPECT_TRUE(data == whole);
+    }
+
+    // Resume on a new connection after the first one went away.
+    {
+      std::string received = range_client(s.port()).fetch(0, 7 << 20);
+      received += range_client(s.port()).fetch(received.size(), 0);
+      EXPECT_TRUE(data == received);
+    }
+
+    // Stop with a client still connected, so its connection is destroyed
+    // along with the io_context, after the server.
+    range_client idle(s.port());
+    EXPECT_EQ(data.substr(0, 100), idle.fetch(0, 100));
+
+    io_context.stop();
+    io_thread.join();
+  }
+  std::remove(path);
+}
+
+TEST(asio, TransmitPipe)
+{
+  using namespace zero_copy;
+
+  boost::asio::io_context io_context;
+  tcp::acceptor acceptor(io_context, tcp::endpoint(tcp::v4(), 0));
+  unsigned short port = acceptor.local_endpoint().port();
+
+  int fds[2];
+  ASSERT_EQ(0, ::pipe(fds));
+  std::string data = make_test_data(4 << 20);
+
+  // A slow producer, so that the transfer has to wait on the pipe as well as
+  // on the socket.
+  std::thread producer([&data, &fds]()
+      {
+        for (std::size_t pos = 0; pos < data.size(); )
+        {
+          ssize_t n = ::write(fds[1], data.data() + pos,
+              std::min<std::size_t>(data.size() - pos, 1 << 20));
+          if (n <= 0)
+            break;
+          pos += n;
+          std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        ::close(fds[1]);
+      });
+
+  std::string received;
+  std::thread client([&received, port]() { received = receive_all(port); });
+
+  tcp::socket socket(io_context);
+  acceptor.accept(socket);
+  boost::system::error_code result = boost::asio::error::would_block;
+  std::size_t transferred = 0;
+  transmit_file(socket, fds[0],
+      [&](const boost::system::error_code& ec, std::size_t n)
+      {
+        result = ec;
+        transferred = n;
+        socket.shutdown(tcp::socket::shutdown_both);
+      });
+  io_context.run();
+
+  producer.join();
+  client.join();
+
+  // The pipe's non-blocking mode is shared with the caller's descriptor.
+  EXPECT_NE(0, ::fcntl(fds[0], F_GETFL) & O_NONBLOCK);
+  ::close(fds[0]);
+  EXPECT_FALSE(result);
+  EXPECT_EQ(data.size(), transferred);
+  EXPECT_TRUE(data == received);
+}
+
+TEST(asio, UringQueueClose)
+{
+  boost::asio::io_context io_context;
+  int fds[2];
+  ASSERT_EQ(0, ::pipe(fds));
+
+  // Reads that nothing will satisfy, some handed to the kernel and one not,
+  // are cancelled when the queue goes away and their handlers are dropped.
+  bool called = false;
+  {
+    uring_queue queue(io_context, 8, 4096, 4);
+    if (!queue.is_open())
+    {
+      ::close(fds[0]);
+      ::close(fds[1]);
+      return;
+    }
+    auto handler = [&called](const boost::system::error_code&, std::size_t)
+      {
+        called = true;
+      };
+    for (int i = 0; i < 3; ++i)
+    {
+      int index = queue.acquire_buffer();
+      queue.async_read_fixed(fds[0], queue.buffer(index), index, 0, handler);
+    }
+    io_context.poll();
+    int index = queue.acquire_buffer();
+    queue.async_read_fixed(fds[0], queue.buffer(index), index, 0, handler);
+  }
+
+  // None of the reads is left to take data written afterwards.
+  char c = 'x';
+  ASSERT_EQ(1, ::write(fds[1], &c, 1));
+  c = 0;
+  EXPECT_EQ(1, ::read(fds[0], &c, 1));
+  EXPECT_EQ('x', c);
+  io_context.poll();
+  EXPECT_FALSE(called);
+  ::close(fds[0]);
+  ::close(fds[1]);
+}
+
+#else // defined(__linux__)
 # error Overlapped I/O not available on this platform
 #endif // defined(BOOST_ASIO_HAS_WINDOWS_OVERLAPPED_PTR)
@@ -1,32 +1,67 @@
 
 #include <gtest/gtest.h>
 
-#define BOOST_ASIO_ENABLE_HANDLER_TRACKING
-
 #include <boost/asio.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/filter.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#endif // defined(__linux__)
+
 using boost::asio::ip::udp;
 
+// The largest payload a UDP datagram over IPv4 can carry. Servers default to
+// it so that nothing they receive is cut short.
+enum { max_datagram_size = 65507 };
+
 class async_udp_server
 {
 public:
-    async_udp_server(boost::asio::io_context& io_context, short port)
-        : socket_(io_context, udp::endpoint(udp::v4(), port))
+    async_udp_server(boost::asio::io_context& io_context, unsigned short port,
+        std::size_t max_length = max_datagram_size)
+        : socket_(io_context, udp::endpoint(udp::v4(), port)),
+        data_(max_length)
     {
         do_receive();
     }
 
+    // The port the server is bound to, useful when constructed with 0.
+    unsigned short port() const
+    {
+        return socket_.local_endpoint().port();
+    }
+
+    void stop()
+    {
+        boost::system::error_code ignored_ec;
+        socket_.close(ignored_ec);
+    }
+
     void do_receive()
     {
         socket_.async_receive_from(
-            boost::asio::buffer(data_, max_length), sender_endpoint_,
+            boost::asio::buffer(data_), sender_endpoint_,
             [this](boost::system::error_code ec, std::size_t bytes_recvd)
             {
                 if (!ec && bytes_recvd > 0)
                 {
                     do_send(bytes_recvd);
                 }
-                else
+                else if (socket_.is_open())
                 {
                     do_receive();
                 }
@@ -39,17 +74,936 @@ public:
             boost::asio::buffer(data_, length), sender_endpoint_,
             [this](boost::system::error_code /*ec*/, std::size_t /*bytes_sent*/)
             {
-                do_receive();
+                if (socket_.is_open())
+                {
+                    do_receive();
+                }
+            });
+    }
+
+private:
+    udp::socket socket_;
+    udp::endpoint sender_endpoint_;
+    std::vector<char> data_;
+};
+
+#if defined(__linux__)
+
+// Echo server that moves datagrams in batches. Each time the socket becomes
+// readable it pulls up to batch_size datagrams with one recvmmsg into buffers
+// allocated up front, and answers all of them with one sendmmsg, so a busy
+// socket costs two system calls per batch rather than two per datagram plus a
+// trip through the reactor. A batch the socket cannot take in one go is
+// finished once it becomes writable again.
+//
+// With share_port the socket is bound with SO_REUSEPORT, so that several
+// servers can share the port and the kernel spreads datagrams across them.
+//
+// Every slot holds max_length bytes. Larger datagrams are cut short by the
+// kernel; truncated() counts them.
+class batched_udp_server
+{
+public:
+    batched_udp_server(boost::asio::io_context& io_context,
+        unsigned short port, std::size_t batch_size = 64,
+        bool share_port = false, std::size_t max_length = 1024)
+        : socket_(io_context),
+        batch_size_(batch_size),
+        max_length_(max_length),
+        buffers_(batch_size * max_length),
+        iovecs_(batch_size),
+        addresses_(batch_size),
+        messages_(batch_size),
+        batches_(0),
+        truncated_(0)
+    {
+        udp::endpoint endpoint(udp::v4(), port);
+        socket_.open(endpoint.protocol());
+        if (share_port)
+        {
+            typedef boost::asio::detail::socket_option::boolean<
+                SOL_SOCKET, SO_REUSEPORT> reuse_port;
+            socket_.set_option(reuse_port(true));
+        }
+        socket_.bind(endpoint);
+        socket_.non_blocking(true);
+        for (std::size_t i = 0; i < batch_size; ++i)
+        {
+            msghdr& h = messages_[i].msg_hdr;
+            std::memset(&h, 0, sizeof(h));
+            h.msg_name = &addresses_[i];
+            h.msg_iov = &iovecs_[i];
+            h.msg_iovlen = 1;
+        }
+        do_receive();
+    }
+
+    unsigned short port() const
+    {
+        return socket_.local_endpoint().port();
+    }
+
+    void stop()
+    {
+        boost::system::error_code ignored_ec;
+        socket_.close(ignored_ec);
+    }
+
+    // Number of batches received so far.
+    std::size_t batches() const
+    {
+        return batches_;
+    }
+
+    // Number of datagrams that did not fit in a slot.
+    std::size_t truncated() const
+    {
+        return truncated_;
+    }
+
+    udp::socket& socket()
+    {
+        return socket_;
+    }
+
+private:
+    void do_receive()
+    {
+        socket_.async_wait(udp::socket::wait_read,
+            [this](boost::system::error_code ec)
+            {
+                if (!ec)
+                {
+                    receive_batch();
+                }
             });
     }
 
+    // A full batch means more is probably waiting, so read again straight
+    // away instead of going back to the reactor first, up to max_rounds
+    // batches so the other handlers get a turn.
+    void receive_batch()
+    {
+        for (int round = 0; round < max_rounds; ++round)
+        {
+            for (std::size_t i = 0; i < batch_size_; ++i)
+            {
+                iovecs_[i].iov_base = &buffers_[i * max_length_];
+                iovecs_[i].iov_len = max_length_;
+                messages_[i].msg_hdr.msg_namelen = sizeof(addresses_[i]);
+            }
+
+            int n;
+            do
+            {
+                n = ::recvmmsg(socket_.native_handle(), messages_.data(),
+                    static_cast<unsigned>(batch_size_), MSG_DONTWAIT, 0);
+            } while (n < 0 && errno == EINTR);
+
+            // Nothing there after all, or an error such as ECONNREFUSED left
+            // by an earlier send. Wait for the next datagram either way.
+            if (n <= 0)
+                break;
+
+            ++batches_;
+            for (int i = 0; i < n; ++i)
+            {
+                iovecs_[i].iov_len = messages_[i].msg_len;
+                if (messages_[i].msg_hdr.msg_flags & MSG_TRUNC)
+                    ++truncated_;
+            }
+            if (!send_batch(0, n))
+                return;
+            if (n < static_cast<int>(batch_size_))
+                break;
+        }
+        do_receive();
+    }
+
+    // Returns false if the socket filled up, in which case the rest of the
+    // batch is sent, and receiving resumes, once it is writable again.
+    bool send_batch(int first, int count)
+    {
+        while (first < count)
+        {
+            int n = ::sendmmsg(socket_.native_handle(), &messages_[first],
+                count - first, MSG_DONTWAIT);
+            if (n > 0)
+            {
+                first += n;
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                socket_.async_wait(udp::socket::wait_write,
+                    [this, first, count](boost::system::error_code ec)
+                    {
+                        if (!ec && send_batch(first, count))
+                        {
+                            receive_batch();
+                        }
+                    });
+                return false;
+            }
+            else if (errno != EINTR)
+            {
+                // Drop the datagram that cannot be sent and carry on.
+                ++first;
+            }
+        }
+        return true;
+    }
+
+    enum { max_rounds = 16 };
+
+    udp::socket socket_;
+    std::size_t batch_size_;
+    std::size_t max_length_;
+    std::vector<char> buffers_;
+    std::vector<iovec> iovecs_;
+    std::vector<sockaddr_storage> addresses_;
+    std::vector<mmsghdr> messages_;
+    std::size_t batches_;
+    std::size_t truncated_;
+};
+
+// Options for sharded_udp_server.
+struct udp_shard_options
+{
+    // Number of shards, each with its own socket, io_context and thread. 0
+    // uses one per hardware thread.
+    std::size_t threads = 0;
+
+    // Datagrams moved per recvmmsg/sendmmsg.
+    std::size_t batch_size = 64;
+
+    // Size of each receive slot; longer datagrams are truncated.
+    std::size_t max_length = 1024;
+
+    // Pin shard i's thread to CPU i.
+    bool pin_threads = true;
+
+    // Deliver each datagram to the shard for the CPU that received it, rather
+    // than by the kernel's hash of the addresses. Together with pin_threads
+    // this keeps a datagram on one CPU from the NIC queue to the reply.
+    bool steer_by_cpu = false;
+};
+
+// UDP echo server sharded over several threads. Every shard owns a
+// batched_udp_server whose socket shares the port through SO_REUSEPORT, with
+// its own io_context and its own preallocated buffers, so shards share
+// nothing and the kernel does the load balancing.
+class sharded_udp_server
+{
+public:
+    sharded_udp_server(unsigned short port,
+        const udp_shard_options& options = udp_shard_options())
+    {
+        std::size_t threads = options.threads;
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+
+        for (std::size_t i = 0; i < threads; ++i)
+        {
+            shards_.emplace_back(
+                new shard(port, options.batch_size, options.max_length));
+            port = shards_.back()->server_.port();
+        }
+
+        if (options.steer_by_cpu)
+            steer_by_cpu();
+
+        for (std::size_t i = 0; i < threads; ++i)
+        {
+            shard& s = *shards_[i];
+            s.thread_ = std::thread([&s] { s.io_context_.run(); });
+            if (options.pin_threads)
+                pin_to_cpu(s.thread_, i);
+        }
+    }
+
+    sharded_udp_server(const sharded_udp_server&) = delete;
+    sharded_udp_server& operator=(const sharded_udp_server&) = delete;
+
+    ~sharded_udp_server()
+    {
+        stop();
+    }
+
+    unsigned short port() const
+    {
+        return shards_.front()->server_.port();
+    }
+
+    std::size_t thread_count() const
+    {
+        return shards_.size();
+    }
+
+    // Batches received by each shard, to see how the load was spread.
+    std::vector<std::size_t> batches() const
+    {
+        std::vector<std::size_t> result;
+        for (auto& s : shards_)
+            result.push_back(s->server_.batches());
+        return result;
+    }
+
+    void stop()
+    {
+        for (auto& s : shards_)
+            s->io_context_.stop();
+        for (auto& s : shards_)
+            if (s->thread_.joinable())
+                s->thread_.join();
+    }
+
+private:
+    struct shard
+    {
+        shard(unsigned short port, std::size_t batch_size,
+            std::size_t max_length)
+            : server_(io_context_, port, batch_size, true, max_length)
+        {
+        }
+
+        boost::asio::io_context io_context_;
+        batched_udp_server server_;
+        std::thread thread_;
+    };
+
+    // A classic BPF program for the reuseport group that picks the socket by
+    // the current CPU: index = cpu % shards. Sockets are numbered in the
+    // order they were bound, which is the order of the shards.
+    void steer_by_cpu()
+    {
+        sock_filter code[] = {
+            { BPF_LD | BPF_W | BPF_ABS, 0, 0,
+                static_cast<__u32>(SKF_AD_OFF + SKF_AD_CPU) },
+            { BPF_ALU | BPF_MOD | BPF_K, 0, 0,
+                static_cast<__u32>(shards_.size()) },
+            { BPF_RET | BPF_A, 0, 0, 0 },
+        };
+        sock_fprog program = { sizeof(code) / sizeof(code[0]), code };
+        if (::setsockopt(shards_.front()->server_.socket().native_handle(),
+                SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                &program, sizeof(program)) != 0)
+        {
+            boost::asio::detail::throw_error(boost::system::error_code(errno,
+                boost::asio::error::get_system_category()), "steer_by_cpu");
+        }
+    }
+
+    static void pin_to_cpu(std::thread& thread, std::size_t index)
+    {
+        unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(index % cpus, &set);
+        ::pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+    }
+
+    std::vector<std::unique_ptr<shard>> shards_;
+};
+
+// UDP_GRO asks the kernel to hand a socket several datagrams of one flow as a
+// single buffer, with the size of the datagrams in a control message; all but
+// the last have that size. UDP_SEGMENT is the sending side: one send of a
+// large buffer goes out as datagrams of the given size. Either way the cost of
+// the system call and of the trip through the stack is paid once per buffer
+// instead of once per datagram. A buffer carries at most 64 KB and, on older
+// kernels, at most 64 segments.
+
+// Receive GRO buffers from now on.
+inline void enable_udp_gro(udp::socket& socket)
+{
+    int on = 1;
+    if (::setsockopt(socket.native_handle(), SOL_UDP, UDP_GRO,
+            &on, sizeof(on)) != 0)
+    {
+        boost::asio::detail::throw_error(boost::system::error_code(errno,
+            boost::asio::error::get_system_category()), "enable_udp_gro");
+    }
+}
+
+// A buffer received with receive_segments.
+struct udp_segments
+{
+    std::size_t size = 0;
+    std::size_t segment_size = 0;
+    bool truncated = false;
+
+    std::size_t count() const
+    {
+        return segment_size ? (size + segment_size - 1) / segment_size : 0;
+    }
+};
+
+// Receive one buffer into data. Without a segment size from the kernel, the
+// buffer is a single datagram and segment_size is its length.
+inline udp_segments receive_segments(udp::socket& socket, void* data,
+    std::size_t size, udp::endpoint& sender, boost::system::error_code& ec,
+    int flags = 0)
+{
+    iovec iov = { data, size };
+    char control[CMSG_SPACE(sizeof(int))];
+    msghdr h;
+    std::memset(&h, 0, sizeof(h));
+    h.msg_name = sender.data();
+    h.msg_namelen = static_cast<socklen_t>(sender.capacity());
+    h.msg_iov = &iov;
+    h.msg_iovlen = 1;
+    h.msg_control = control;
+    h.msg_controllen = sizeof(control);
+
+    udp_segments result;
+    ssize_t n;
+    do
+    {
+        n = ::recvmsg(socket.native_handle(), &h, flags);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+    {
+        ec = boost::system::error_code(errno,
+            boost::asio::error::get_system_category());
+        return result;
+    }
+
+    ec = boost::system::error_code();
+    sender.resize(h.msg_namelen);
+    result.size = n;
+    result.segment_size = n;
+    result.truncated = (h.msg_flags & MSG_TRUNC) != 0;
+    for (cmsghdr* c = CMSG_FIRSTHDR(&h); c; c = CMSG_NXTHDR(&h, c))
+    {
+        if (c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO)
+        {
+            int segment_size;
+            std::memcpy(&segment_size, CMSG_DATA(c), sizeof(segment_size));
+            result.segment_size = segment_size;
+        }
+    }
+    return result;
+}
+
+// Call f(data, length) for every datagram in a received buffer.
+template <typename Function>
+void for_each_segment(const char* data, const udp_segments& segments,
+    Function f)
+{
+    for (std::size_t offset = 0; offset < segments.size;
+        offset += segments.segment_size)
+    {
+        f(data + offset,
+            std::min(segments.segment_size, segments.size - offset));
+    }
+}
+
+// Send size bytes to the destination as datagrams of segment_size bytes, the
+// last one possibly shorter, with one system call.
+inline std::size_t send_segments(udp::socket& socket, const void* data,
+    std::size_t size, std::size_t segment_size,
+    const udp::endpoint& destination, boost::system::error_code& ec,
+    int flags = 0)
+{
+    iovec iov = { const_cast<void*>(data), size };
+    char control[CMSG_SPACE(sizeof(std::uint16_t))];
+    std::memset(control, 0, sizeof(control));
+    msghdr h;
+    std::memset(&h, 0, sizeof(h));
+    h.msg_name = const_cast<sockaddr*>(destination.data());
+    h.msg_namelen = static_cast<socklen_t>(destination.size());
+    h.msg_iov = &iov;
+    h.msg_iovlen = 1;
+
+    // A buffer that fits in one datagram goes out as it is.
+    if (segment_size < size)
+    {
+        h.msg_control = control;
+        h.msg_controllen = sizeof(control);
+        cmsghdr* c = CMSG_FIRSTHDR(&h);
+        c->cmsg_level = SOL_UDP;
+        c->cmsg_type = UDP_SEGMENT;
+        c->cmsg_len = CMSG_LEN(sizeof(std::uint16_t));
+        std::uint16_t gso_size = static_cast<std::uint16_t>(segment_size);
+        std::memcpy(CMSG_DATA(c), &gso_size, sizeof(gso_size));
+    }
+
+    ssize_t n;
+    do
+    {
+        n = ::sendmsg(socket.native_handle(), &h, flags);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+    {
+        ec = boost::system::error_code(errno,
+            boost::asio::error::get_system_category());
+        return 0;
+    }
+    ec = boost::system::error_code();
+    return n;
+}
+
+// Echo server for large and coalesced datagrams. It receives with UDP_GRO
+// into one buffer of max_length bytes and sends each buffer back as it came,
+// with UDP_SEGMENT set to the received segment size, so the client gets the
+// same datagrams back for one receive and one send.
+class segmented_udp_server
+{
+public:
+    segmented_udp_server(boost::asio::io_context& io_context,
+        unsigned short port, std::size_t max_length = 65536)
+        : socket_(io_context, udp::endpoint(udp::v4(), port)),
+        data_(max_length),
+        buffers_(0),
+        datagrams_(0),
+        truncated_(0)
+    {
+        enable_udp_gro(socket_);
+        socket_.non_blocking(true);
+        do_receive();
+    }
+
+    unsigned short port() const
+    {
+        return socket_.local_endpoint().port();
+    }
+
+    void stop()
+    {
+        boost::system::error_code ignored_ec;
+        socket_.close(ignored_ec);
+    }
+
+    // Receive calls that returned data, and datagrams they held.
+    std::size_t buffers() const
+    {
+        return buffers_;
+    }
+
+    std::size_t datagrams() const
+    {
+        return datagrams_;
+    }
+
+    std::size_t truncated() const
+    {
+        return truncated_;
+    }
+
 private:
+    void do_receive()
+    {
+        socket_.async_wait(udp::socket::wait_read,
+            [this](boost::system::error_code ec)
+            {
+                if (!ec)
+                {
+                    receive();
+                }
+            });
+    }
+
+    // Keep reading while there is data, up to max_rounds buffers at a time.
+    void receive()
+    {
+        for (int round = 0; round < max_rounds; ++round)
+        {
+            boost::system::error_code ec;
+            segments_ = receive_segments(socket_, data_.data(), data_.size(),
+                sender_endpoint_, ec, MSG_DONTWAIT);
+            if (ec)
+                break;
+
+            ++buffers_;
+            datagrams_ += segments_.count();
+            if (segments_.truncated)
+                ++truncated_;
+            if (!send())
+                return;
+        }
+        do_receive();
+    }
+
+    // Returns false if the socket is full, in which case the buffer is sent,
+    // and receiving resumes, once it is writable again.
+    bool send()
+    {
+        boost::system::error_code ec;
+        send_segments(socket_, data_.data(), segments_.size,
+            segments_.segment_size, sender_endpoint_, ec, MSG_DONTWAIT);
+        if (ec == boost::asio::error::would_block)
+        {
+            socket_.async_wait(udp::socket::wait_write,
+                [this](boost::system::error_code ec)
+                {
+                    if (!ec && send())
+                    {
+                        receive();
+                    }
+                });
+            return false;
+        }
+        return true;
+    }
+
+    enum { max_rounds = 64 };
+
     udp::socket socket_;
     udp::endpoint sender_endpoint_;
-    enum { max_length = 1024 };
-    char data_[max_length];
+    std::vector<char> data_;
+    udp_segments segments_;
+    std::size_t buffers_;
+    std::size_t datagrams_;
+    std::size_t truncated_;
 };
 
+// Packets-per-second load for the echo servers. The client keeps a window of
+// datagrams in flight and tops it up as echoes come back, moving them with
+// sendmmsg and recvmmsg itself so that the server is what gets measured. A
+// window that goes quiet for the receive timeout is assumed lost and refilled.
+std::size_t udp_echo_load(unsigned short port, std::size_t message_size,
+    std::size_t window, std::chrono::milliseconds duration)
+{
+    boost::asio::io_context io_context;
+    udp::socket socket(io_context, udp::endpoint(udp::v4(), 0));
+    socket.connect(udp::endpoint(boost::asio::ip::address_v4::loopback(), port));
+    int buffer_size = 4 << 20;
+    ::setsockopt(socket.native_handle(), SOL_SOCKET, SO_RCVBUF,
+        &buffer_size, sizeof(buffer_size));
+    timeval timeout = { 0, 100000 };
+    ::setsockopt(socket.native_handle(), SOL_SOCKET, SO_RCVTIMEO,
+        &timeout, sizeof(timeout));
+
+    std::vector<char> buffers(window * message_size, 'x');
+    std::vector<iovec> iovecs(window);
+    std::vector<mmsghdr> messages(window);
+    for (std::size_t i = 0; i < window; ++i)
+    {
+        iovecs[i].iov_base = &buffers[i * message_size];
+        iovecs[i].iov_len = message_size;
+        std::memset(&messages[i], 0, sizeof(messages[i]));
+        messages[i].msg_hdr.msg_iov = &iovecs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    std::size_t echoed = 0;
+    std::size_t in_flight = 0;
+    auto deadline = std::chrono::steady_clock::now() + duration;
+    while (std::chrono::steady_clock::now() < deadline)
+    {
+        if (in_flight < window)
+        {
+            int sent = ::sendmmsg(socket.native_handle(), messages.data(),
+                static_cast<unsigned>(window - in_flight), 0);
+            if (sent > 0)
+                in_flight += sent;
+        }
+
+        int received = ::recvmmsg(socket.native_handle(), messages.data(),
+            static_cast<unsigned>(in_flight), MSG_WAITFORONE, 0);
+        if (received > 0)
+        {
+            echoed += received;
+            in_flight -= received;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            in_flight = 0;
+        }
+    }
+    return echoed;
+}
+
+template <typename Server>
+double udp_echo_rate(std::size_t message_size, std::size_t window,
+    std::chrono::milliseconds duration)
+{
+    boost::asio::io_context io_context;
+    Server s(io_context, 0);
+    std::thread server_thread([&io_context]() { io_context.run(); });
+
+    auto start = std::chrono::steady_clock::now();
+    std::size_t echoed = udp_echo_load(s.port(), message_size, window, duration);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    boost::asio::post(io_context, [&s]() { s.stop(); });
+    server_thread.join();
+    return echoed / elapsed.count();
+}
+
+TEST(asio, BatchedUdpServer)
+{
+    // Every datagram comes back, in order, from a single sendmmsg.
+    {
+        boost::asio::io_context io_context;
+        batched_udp_server s(io_context, 0, 16);
+        udp::socket client(io_context, udp::endpoint(udp::v4(), 0));
+        udp::endpoint server(boost::asio::ip::address_v4::loopback(), s.port());
+        for (int i = 0; i < 10; ++i)
+        {
+            std::string message = "message " + std::to_string(i);
+            client.send_to(boost::asio::buffer(message), server);
+        }
+        io_context.run_one();
+
+        for (int i = 0; i < 10; ++i)
+        {
+            char reply[64];
+            udp::endpoint sender;
+            std::size_t n = client.receive_from(boost::asio::buffer(reply), sender);
+            EXPECT_EQ("message " + std::to_string(i), std::string(reply, n));
+            EXPECT_EQ(s.port(), sender.port());
+        }
+        EXPECT_EQ(1u, s.batches());
+    }
+
+    const std::chrono::milliseconds duration(1000);
+    const std::size_t message_size = 128;
+    for (std::size_t window : { 1, 64 })
+    {
+        double single = udp_echo_rate<async_udp_server>(
+            message_size, window, duration);
+        double batched = udp_echo_rate<batched_udp_server>(
+            message_size, window, duration);
+        EXPECT_GT(batched, 0);
+        std::cout << "window " << window << ": one at a time "
+            << single << " pkt/s, recvmmsg/sendmmsg " << batched << " pkt/s"
+            << std::endl;
+    }
+}
+
+TEST(asio, ShardedUdpServer)
+{
+    const unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    const std::size_t senders = 4;
+    const std::size_t message_size = 128;
+    const std::chrono::milliseconds duration(1000);
+
+    for (bool steer : { false, true })
+    {
+        for (unsigned threads = 1; threads <= max_threads; threads *= 2)
+        {
+            udp_shard_options options;
+            options.threads = threads;
+            options.steer_by_cpu = steer;
+            sharded_udp_server echo(0, options);
+
+            // Each sender has its own source port, so the kernel's hash
+            // spreads them over the shards.
+            std::atomic<std::size_t> echoed(0);
+            std::vector<std::thread> clients;
+            auto start = std::chrono::steady_clock::now();
+            for (std::size_t i = 0; i < senders; ++i)
+            {
+                clients.emplace_back([&]()
+                    {
+                        echoed += udp_echo_load(echo.port(), message_size, 64,
+                            duration);
+                    });
+            }
+            for (auto& t : clients)
+                t.join();
+            std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+            echo.stop();
+            EXPECT_GT(echoed.load(), 0u);
+
+            std::cout << threads << " threads" << (steer ? " (by cpu)" : "")
+                << ": " << echoed / elapsed.count() << " pkt/s, batches per shard";
+            for (std::size_t b : echo.batches())
+                std::cout << " " << b;
+            std::cout << std::endl;
+        }
+    }
+}
+
+TEST(asio, SegmentedUdpServer)
+{
+    boost::asio::io_context io_context;
+    udp::socket client(io_context, udp::endpoint(udp::v4(), 0));
+    enable_udp_gro(client);
+    timeval timeout = { 1, 0 };
+    ::setsockopt(client.native_handle(), SOL_SOCKET, SO_RCVTIMEO,
+        &timeout, sizeof(timeout));
+
+    // Ten full datagrams and a short one, sent with one system call and
+    // echoed by the server in as many as the kernel coalesced them into.
+    {
+        segmented_udp_server s(io_context, 0);
+        udp::endpoint server(boost::asio::ip::address_v4::loopback(), s.port());
+        const std::size_t segment_size = 1000;
+        std::string data;
+        for (int i = 0; i < 11; ++i)
+            data.append(i < 10 ? segment_size : 500, static_cast<char>('a' + i));
+        boost::system::error_code ec;
+        EXPECT_EQ(data.size(), send_segments(client, data.data(), data.size(),
+            segment_size, server, ec));
+        EXPECT_FALSE(ec);
+        io_context.restart();
+        io_context.run_one();
+
+        std::vector<std::string> datagrams;
+        std::vector<char> buffer(65536);
+        while (!ec && datagrams.size() < 11)
+        {
+            udp::endpoint sender;
+            udp_segments segments = receive_segments(client, buffer.data(),
+                buffer.size(), sender, ec);
+            for_each_segment(buffer.data(), segments,
+                [&datagrams](const char* p, std::size_t n)
+                {
+                    datagrams.emplace_back(p, n);
+                });
+        }
+        ASSERT_EQ(11u, datagrams.size());
+        for (int i = 0; i < 11; ++i)
+            EXPECT_EQ(data.substr(i * segment_size, datagrams[i].size()), datagrams[i]);
+        EXPECT_EQ(500u, datagrams.back().size());
+        EXPECT_EQ(11u, s.datagrams());
+        EXPECT_EQ(0u, s.truncated());
+        std::cout << s.datagrams() << " datagrams in " << s.buffers()
+            << " receive calls" << std::endl;
+    }
+
+    // A datagram far larger than the old 1024 byte buffer comes back whole.
+    {
+        async_udp_server s(io_context, 0);
+        udp::endpoint server(boost::asio::ip::address_v4::loopback(), s.port());
+        std::string data(60000, 'x');
+        client.send_to(boost::asio::buffer(data), server);
+        io_context.restart();
+        io_context.run_one();
+        io_context.run_one();
+
+        std::vector<char> buffer(65536);
+        udp::endpoint sender;
+        EXPECT_EQ(data.size(), client.receive_from(boost::asio::buffer(buffer), sender));
+    }
+}
+
+// One-way stream of segment_size datagrams over loopback for the given
+// duration. The segmented stream sends them in 64 KB buffers with
+// UDP_SEGMENT and receives them with UDP_GRO; the plain one moves one
+// datagram per system call. Returns the datagrams received per second.
+double udp_stream_rate(bool segmented, std::size_t segment_size,
+    std::chrono::milliseconds duration)
+{
+    boost::asio::io_context io_context;
+    udp::socket receiver(io_context,
+        udp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    if (segmented)
+        enable_udp_gro(receiver);
+    int buffer_size = 4 << 20;
+    ::setsockopt(receiver.native_handle(), SOL_SOCKET, SO_RCVBUF,
+        &buffer_size, sizeof(buffer_size));
+    timeval timeout = { 0, 100000 };
+    ::setsockopt(receiver.native_handle(), SOL_SOCKET, SO_RCVTIMEO,
+        &timeout, sizeof(timeout));
+
+    std::atomic<bool> done(false);
+    std::size_t received = 0;
+    std::thread reader([&]()
+        {
+            std::vector<char> buffer(65536);
+            udp::endpoint sender;
+            boost::system::error_code ec;
+            while (!done)
+            {
+                udp_segments segments = receive_segments(receiver,
+                    buffer.data(), buffer.size(), sender, ec);
+                if (!ec)
+                    received += segments.count();
+            }
+        });
+
+    udp::socket sender(io_context, udp::endpoint(udp::v4(), 0));
+    udp::endpoint destination = receiver.local_endpoint();
+    std::size_t per_send = segmented
+        ? std::min<std::size_t>(64, 65000 / segment_size) : 1;
+    std::vector<char> data(per_send * segment_size, 'x');
+
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + duration;
+    boost::system::error_code ec;
+    while (std::chrono::steady_clock::now() < deadline)
+        send_segments(sender, data.data(), data.size(), segment_size,
+            destination, ec);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    done = true;
+    reader.join();
+    return received / elapsed.count();
+}
+
+TEST(asio, UdpGroGsoStream)
+{
+    const std::chrono::milliseconds duration(1000);
+    for (std::size_t segment_size : { 512, 1200 })
+    {
+        double plain = udp_stream_rate(false, segment_size, duration);
+        double segmented = udp_stream_rate(true, segment_size, duration);
+        EXPECT_GT(segmented, 0);
+        std::cout << segment_size << " byte datagrams: one per call "
+            << plain << " pkt/s, GSO/GRO " << segmented << " pkt/s" << std::endl;
+    }
+}
+
+#if defined(BOOST_ASIO_CUSTOM_HANDLER_TRACKING)
+
+// Only built with ENABLE_HANDLER_STATS, which has asio pull in
+// handler_stats.hpp.
+TEST(asio, HandlerStats)
+{
+    handler_stats::reset();
+    handler_stats::enable();
+
+    double rate = udp_echo_rate<async_udp_server>(64, 16,
+        std::chrono::milliseconds(300));
+    {
+        boost::asio::io_context io_context;
+        boost::asio::steady_timer timer(io_context);
+        for (int i = 0; i < 100; ++i)
+        {
+            timer.expires_after(std::chrono::microseconds(100));
+            timer.async_wait([](boost::system::error_code) {});
+            io_context.restart();
+            io_context.run();
+        }
+    }
+
+    handler_stats::enable(false);
+    std::vector<handler_stats::operation_stats> stats = handler_stats::snapshot();
+
+    const handler_stats::operation_stats* receive = 0;
+    const handler_stats::operation_stats* wait = 0;
+    for (const handler_stats::operation_stats& s : stats)
+    {
+        if (s.operation == "async_receive_from")
+            receive = &s;
+        if (s.object_type == "deadline_timer" && s.operation == "async_wait")
+            wait = &s;
+    }
+    ASSERT_TRUE(receive != 0);
+    ASSERT_TRUE(wait != 0);
+    EXPECT_GT(rate, 0);
+    EXPECT_GT(receive->invoked, 0u);
+    EXPECT_EQ(receive->invoked, receive->queued.count());
+    EXPECT_EQ(receive->invoked, receive->run.count());
+    EXPECT_EQ(100u, wait->created);
+    EXPECT_EQ(100u, wait->invoked);
+    EXPECT_EQ(100u, wait->queued.count());
+
+    handler_stats::print(std::cout, stats);
+    handler_stats::write_json(std::cout, stats);
+    std::cout << std::endl;
+}
+
+#endif // defined(BOOST_ASIO_CUSTOM_HANDLER_TRACKING)
+
+#endif // defined(__linux__)
+
 TEST(asio, AsyncUdpServer)
 {
     try
@@ -64,18 +1018,17 @@ TEST(asio, AsyncUdpServer)
     }
 }
 
-enum { max_length = 1024 };
-
-void blocking_udp_server(boost::asio::io_context& io_context, unsigned short port)
+void blocking_udp_server(boost::asio::io_context& io_context, unsigned short port,
+    std::size_t max_length = max_datagram_size)
 {
     udp::socket sock(io_context, udp::endpoint(udp::v4(), port));
+    std::vector<char> data(max_length);
     for (;;)
     {
-        char data[max_length];
         udp::endpoint sender_endpoint;
         size_t length = sock.receive_from(
-            boost::asio::buffer(data, max_length), sender_endpoint);
-        sock.send_to(boost::asio::buffer(data, length), sender_endpoint);
+            boost::asio::buffer(data), sender_endpoint);
+        sock.send_to(boost::asio::buffer(data.data(), length), sender_endpoint);
     }
 }
 
@@ -0,0 +1,542 @@
+//
+// handler_stats.hpp
+// ~~~~~~~~~~~~~~~~~
+//
+
+#ifndef HANDLER_STATS_HPP
+#define HANDLER_STATS_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <boost/system/error_code.hpp>
+
+#include "latency_histogram.hpp"
+
+namespace boost {
+namespace asio {
+
+class execution_context;
+
+} // namespace asio
+} // namespace boost
+
+// Lightweight handler tracking for asio, plugged in through
+// BOOST_ASIO_CUSTOM_HANDLER_TRACKING (see the ENABLE_HANDLER_STATS option in
+// CMakeLists). Unlike BOOST_ASIO_ENABLE_HANDLER_TRACKING it writes nothing as
+// it goes. For every kind of operation, such as socket async_receive_from or
+// io_context post, it counts the handlers created and invoked and records two
+// latencies:
+//
+// - queued: from the moment the reactor finished the operation's I/O until
+//   its handler starts. For operations that do no reactor I/O, such as posts
+//   and timer waits, it is measured from when the operation was started.
+// - run: how long the handler itself runs.
+//
+// Each thread records into its own tables, so the cost per handler is a few
+// clock reads and an uncontended lock. Recording is off until enable() is
+// called, or the ASIO_HANDLER_STATS environment variable is set when the first
+// io_context is created. snapshot() merges the tables of all threads.
+//
+// The option changes the layout of asio's operation objects, so it has to be
+// set for every translation unit of a program or for none.
+namespace handler_stats {
+
+// Counters and histograms for one kind of operation.
+struct operation_stats
+{
+  std::string object_type;
+  std::string operation;
+  std::uint64_t created = 0;
+  std::uint64_t invoked = 0;
+  latency_histogram queued;
+  latency_histogram run;
+};
+
+namespace detail {
+
+inline std::uint64_t now()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline std::atomic<bool>& enabled_flag()
+{
+  static std::atomic<bool> flag(false);
+  return flag;
+}
+
+// Operation kinds are numbered in a table shared by all threads, keyed by
+// the object type and operation name asio passes in.
+struct kind
+{
+  std::string object_type;
+  std::string operation;
+};
+
+class kind_table
+{
+public:
+  enum { max_kinds = 128 };
+
+  static kind_table& instance()
+  {
+    static kind_table table;
+    return table;
+  }
+
+  std::size_t find_or_add(const char* object_type, const char* operation)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (std::size_t i = 0; i < kinds_.size(); ++i)
+      if (kinds_[i].object_type == object_type
+          && kinds_[i].operation == operation)
+        return i;
+    if (kinds_.size() == max_kinds - 1)
+      return max_kinds - 1;
+    kinds_.push_back(kind{ object_type, operation });
+    return kinds_.size() - 1;
+  }
+
+  kind get(std::size_t index)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (index < kinds_.size())
+      return kinds_[index];
+    return kind{ "other", "other" };
+  }
+
+private:
+  std::mutex mutex_;
+  std::vector<kind> kinds_;
+};
+
+// What one thread recorded. The owning thread takes the lock for every
+// update; it is only ever contended by a snapshot.
+struct thread_table
+{
+  struct entry
+  {
+    std::uint64_t created = 0;
+    std::uint64_t invoked = 0;
+    std::unique_ptr<latency_histogram> queued;
+    std::unique_ptr<latency_histogram> run;
+  };
+
+  std::mutex mutex;
+  entry entries[kind_table::max_kinds];
+
+  // Cache of the last few name pointers looked up, to skip the shared table.
+  struct cached_kind
+  {
+    const char* object_type;
+    const char* operation;
+    std::size_t index;
+  };
+  enum { cache_size = 16 };
+  cached_kind cache[cache_size];
+  std::size_t cache_next = 0;
+
+  thread_table()
+  {
+    std::memset(cache, 0, sizeof(cache));
+  }
+
+  std::size_t kind_of(const char* object_type, const char* operation)
+  {
+    for (std::size_t i = 0; i < cache_size; ++i)
+      if (cache[i].operation == operation
+          && cache[i].object_type == object_type)
+        return cache[i].index;
+
+    std::size_t index =
+      kind_table::instance().find_or_add(object_type, operation);
+    cached_kind& c = cache[cache_next++ % cache_size];
+    c.object_type = object_type;
+    c.operation = operation;
+    c.index = index;
+    return index;
+  }
+
+  void merge_into(std::vector<operation_stats>& result)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (std::size_t i = 0; i < kind_table::max_kinds; ++i)
+    {
+      entry& e = entries[i];
+      if (e.created == 0 && e.invoked == 0)
+        continue;
+      if (result.size() <= i)
+        result.resize(i + 1);
+      operation_stats& s = result[i];
+      s.created += e.created;
+      s.invoked += e.invoked;
+      if (e.queued)
+        s.queued.merge(*e.queued);
+      if (e.run)
+        s.run.merge(*e.run);
+    }
+  }
+
+  void reset()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (entry& e : entries)
+    {
+      e.created = e.invoked = 0;
+      if (e.queued)
+        e.queued->reset();
+      if (e.run)
+        e.run->reset();
+    }
+  }
+};
+
+// The tables of all threads. When a thread exits, its table is folded into
+// the retired totals so that nothing it recorded is lost.
+class registry
+{
+public:
+  static registry& instance()
+  {
+    static registry r;
+    return r;
+  }
+
+  void add(thread_table* t)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tables_.push_back(t);
+  }
+
+  void retire(thread_table* t)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    t->merge_into(retired_);
+    tables_.erase(std::remove(tables_.begin(), tables_.end(), t),
+        tables_.end());
+  }
+
+  std::vector<operation_stats> collect()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<operation_stats> result(retired_.size());
+    for (std::size_t i = 0; i < retired_.size(); ++i)
+      add_to(result[i], retired_[i]);
+    for (thread_table* t : tables_)
+      t->merge_into(result);
+    return result;
+  }
+
+  void reset()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    retired_.clear();
+    for (thread_table* t : tables_)
+      t->reset();
+  }
+
+private:
+  static void add_to(operation_stats& to, const operation_stats& from)
+  {
+    to.created += from.created;
+    to.invoked += from.invoked;
+    to.queued.merge(from.queued);
+    to.run.merge(from.run);
+  }
+
+  std::mutex mutex_;
+  std::vector<thread_table*> tables_;
+  std::vector<operation_stats> retired_;
+};
+
+class thread_table_owner
+{
+public:
+  thread_table_owner()
+  {
+    registry::instance().add(&table_);
+  }
+
+  ~thread_table_owner()
+  {
+    registry::instance().retire(&table_);
+  }
+
+  thread_table& table()
+  {
+    return table_;
+  }
+
+private:
+  thread_table table_;
+};
+
+inline thread_table& this_thread_table()
+{
+  static thread_local thread_table_owner owner;
+  return owner.table();
+}
+
+} // namespace detail
+
+// Turn recording on or off. Handlers created while it was off are not
+// counted when they run.
+inline void enable(bool on = true)
+{
+  detail::enabled_flag().store(on, std::memory_order_relaxed);
+}
+
+inline bool enabled()
+{
+  return detail::enabled_flag().load(std::memory_order_relaxed);
+}
+
+// Everything recorded so far, one entry per kind of operation seen.
+inline std::vector<operation_stats> snapshot()
+{
+  std::vector<operation_stats> result =
+    detail::registry::instance().collect();
+  for (std::size_t i = 0; i < result.size(); ++i)
+  {
+    detail::kind k = detail::kind_table::instance().get(i);
+    result[i].object_type = k.object_type;
+    result[i].operation = k.operation;
+  }
+  result.erase(std::remove_if(result.begin(), result.end(),
+        [](const operation_stats& s) { return s.created == 0 && s.invoked == 0; }),
+      result.end());
+  return result;
+}
+
+// Clear what has been recorded, keeping the enabled state.
+inline void reset()
+{
+  detail::registry::instance().reset();
+}
+
+// Human-readable table of a snapshot, latencies in microseconds.
+inline void print(std::ostream& os,
+    const std::vector<operation_stats>& stats = snapshot())
+{
+  for (const operation_stats& s : stats)
+  {
+    os << s.object_type << "." << s.operation
+      << ": created=" << s.created << " invoked=" << s.invoked
+      << "\n  queued ";
+    s.queued.print(os);
+    os << "\n  run    ";
+    s.run.print(os);
+    os << "\n";
+  }
+}
+
+// A snapshot as JSON, latencies in nanoseconds.
+inline void write_json(std::ostream& os,
+    const std::vector<operation_stats>& stats = snapshot())
+{
+  struct histogram
+  {
+    static void write(std::ostream& os, const latency_histogram& h)
+    {
+      os << "{\"count\":" << h.count()
+        << ",\"mean\":" << h.mean()
+        << ",\"p50\":" << h.percentile(50.0)
+        << ",\"p99\":" << h.percentile(99.0)
+        << ",\"p999\":" << h.percentile(99.9)
+        << ",\"max\":" << h.max() << "}";
+    }
+  };
+
+  os << "[";
+  for (std::size_t i = 0; i < stats.size(); ++i)
+  {
+    const operation_stats& s = stats[i];
+    os << (i ? "," : "")
+      << "{\"object\":\"" << s.object_type
+      << "\",\"operation\":\"" << s.operation
+      << "\",\"created\":" << s.created
+      << ",\"invoked\":" << s.invoked
+      << ",\"queued_ns\":";
+    histogram::write(os, s.queued);
+    os << ",\"run_ns\":";
+    histogram::write(os, s.run);
+    os << "}";
+  }
+  os << "]";
+}
+
+// The hooks asio calls. tracked_handler is a base of every asio operation.
+struct tracked_handler
+{
+  tracked_handler() : kind_(0), ready_(0), tracked_(false) {}
+
+  std::size_t kind_;
+  mutable std::uint64_t ready_;
+  bool tracked_;
+};
+
+inline void init()
+{
+  const char* env = std::getenv("ASIO_HANDLER_STATS");
+  if (env && *env && std::strcmp(env, "0") != 0)
+    enable();
+}
+
+inline void creation(boost::asio::execution_context& /*context*/,
+    tracked_handler& h, const char* object_type, void* /*object*/,
+    std::uintmax_t /*native_handle*/, const char* operation)
+{
+  if (!enabled())
+    return;
+
+  detail::thread_table& t = detail::this_thread_table();
+  h.kind_ = t.kind_of(object_type, operation);
+  h.ready_ = detail::now();
+  h.tracked_ = true;
+  std::lock_guard<std::mutex> lock(t.mutex);
+  ++t.entries[h.kind_].created;
+}
+
+// The reactor finished the I/O; the handler is queued from here on.
+inline void reactor_operation(const tracked_handler& h,
+    const char* /*operation*/, const boost::system::error_code& /*ec*/)
+{
+  if (h.tracked_)
+    h.ready_ = detail::now();
+}
+
+inline void reactor_operation(const tracked_handler& h,
+    const char* operation, const boost::system::error_code& ec,
+    std::size_t /*bytes_transferred*/)
+{
+  reactor_operation(h, operation, ec);
+}
+
+class completion
+{
+public:
+  explicit completion(const tracked_handler& h)
+    : kind_(h.kind_), ready_(h.ready_), begin_(0), tracked_(h.tracked_)
+  {
+  }
+
+  template <typename... Args>
+  void invocation_begin(Args&&... /*args*/)
+  {
+    if (!tracked_)
+      return;
+
+    begin_ = detail::now();
+    record(&detail::thread_table::entry::queued, begin_ - ready_, true);
+  }
+
+  void invocation_end()
+  {
+    if (!tracked_ || begin_ == 0)
+      return;
+
+    record(&detail::thread_table::entry::run, detail::now() - begin_, false);
+  }
+
+private:
+  void record(std::unique_ptr<latency_histogram> detail::thread_table::entry::*h,
+      std::uint64_t value, bool invoked)
+  {
+    detail::thread_table& t = detail::this_thread_table();
+    std::lock_guard<std::mutex> lock(t.mutex);
+    detail::thread_table::entry& e = t.entries[kind_];
+    if (invoked)
+      ++e.invoked;
+    if (!(e.*h))
+      (e.*h).reset(new latency_histogram);
+    (e.*h)->record(value);
+  }
+
+  std::size_t kind_;
+  std::uint64_t ready_;
+  std::uint64_t begin_;
+  bool tracked_;
+};
+
+inline void operation(boost::asio::execution_context& /*context*/,
+    const char* /*object_type*/, void* /*object*/,
+    std::uintmax_t /*native_handle*/, const char* /*operation*/)
+{
+}
+
+inline void reactor_registration(boost::asio::execution_context& /*context*/,
+    std::uintmax_t /*native_handle*/, std::uintmax_t /*registration*/)
+{
+}
+
+inline void reactor_deregistration(boost::asio::execution_context& /*context*/,
+    std::uintmax_t /*native_handle*/, std::uintmax_t /*registration*/)
+{
+}
+
+inline void reactor_events(boost::asio::execution_context& /*context*/,
+    std::uintmax_t /*registration*/, unsigned /*events*/)
+{
+}
+
+} // namespace handler_stats
+
+#if defined(BOOST_ASIO_CUSTOM_HANDLER_TRACKING)
+
+# define BOOST_ASIO_INHERIT_TRACKED_HANDLER \
+  : public ::handler_stats::tracked_handler
+
+# define BOOST_ASIO_ALSO_INHERIT_TRACKED_HANDLER \
+  , public ::handler_stats::tracked_handler
+
+# define BOOST_ASIO_HANDLER_TRACKING_INIT \
+  ::handler_stats::init()
+
+# define BOOST_ASIO_HANDLER_LOCATION(args) \
+  (void)0
+
+# define BOOST_ASIO_HANDLER_CREATION(args) \
+  ::handler_stats::creation args
+
+# define BOOST_ASIO_HANDLER_COMPLETION(args) \
+  ::handler_stats::completion tracked_completion args
+
+# define BOOST_ASIO_HANDLER_INVOCATION_BEGIN(args) \
+  tracked_completion.invocation_begin args
+
+# define BOOST_ASIO_HANDLER_INVOCATION_END \
+  tracked_completion.invocation_end()
+
+# define BOOST_ASIO_HANDLER_OPERATION(args) \
+  ::handler_stats::operation args
+
+# define BOOST_ASIO_HANDLER_REACTOR_REGISTRATION(args) \
+  ::handler_stats::reactor_registration args
+
+# define BOOST_ASIO_HANDLER_REACTOR_DEREGISTRATION(args) \
+  ::handler_stats::reactor_deregistration args
+
+# define BOOST_ASIO_HANDLER_REACTOR_READ_EVENT 1
+# define BOOST_ASIO_HANDLER_REACTOR_WRITE_EVENT 2
+# define BOOST_ASIO_HANDLER_REACTOR_ERROR_EVENT 4
+
+# define BOOST_ASIO_HANDLER_REACTOR_EVENTS(args) \
+  ::handler_stats::reactor_events args
+
+# define BOOST_ASIO_HANDLER_REACTOR_OPERATION(args) \
+  ::handler_stats::reactor_operation args
+
+#endif // defined(BOOST_ASIO_CUSTOM_HANDLER_TRACKING)
+
+#endif // HANDLER_STATS_HPP
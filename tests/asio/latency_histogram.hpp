@@ -0,0 +1,150 @@
+//
+// latency_histogram.hpp
+// ~~~~~~~~~~~~~~~~~~~~~
+//
+
+#ifndef LATENCY_HISTOGRAM_HPP
+#define LATENCY_HISTOGRAM_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <ostream>
+#include <vector>
+
+// Log-linear histogram in the style of HdrHistogram. Values below 2^sub_bits
+// are counted exactly; larger values are bucketed by their power of two and
+// then split into 2^sub_bits linear sub-buckets, so every recorded value is
+// reported with a relative error below 1/2^sub_bits (about 1.6%) anywhere in
+// the 64-bit range. Recording is a few arithmetic operations and one
+// increment, so a histogram can sit on the hot path of a benchmark.
+//
+// A histogram is not thread-safe. Keep one per thread or per connection and
+// merge them once the run is over.
+class latency_histogram
+{
+public:
+  latency_histogram()
+    : counts_(bucket_count, 0),
+      total_(0),
+      sum_(0),
+      min_(std::numeric_limits<std::uint64_t>::max()),
+      max_(0)
+  {
+  }
+
+  // Record one value, typically a latency in nanoseconds.
+  void record(std::uint64_t value)
+  {
+    ++counts_[index_of(value)];
+    ++total_;
+    sum_ += value;
+    min_ = std::min(min_, value);
+    max_ = std::max(max_, value);
+  }
+
+  // Add all values recorded in another histogram.
+  void merge(const latency_histogram& other)
+  {
+    for (std::size_t i = 0; i < bucket_count; ++i)
+      counts_[i] += other.counts_[i];
+    total_ += other.total_;
+    sum_ += other.sum_;
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+  }
+
+  void reset()
+  {
+    std::fill(counts_.begin(), counts_.end(), 0);
+    total_ = 0;
+    sum_ = 0;
+    min_ = std::numeric_limits<std::uint64_t>::max();
+    max_ = 0;
+  }
+
+  std::uint64_t count() const { return total_; }
+  std::uint64_t min() const { return total_ ? min_ : 0; }
+  std::uint64_t max() const { return max_; }
+  double mean() const { return total_ ? double(sum_) / total_ : 0.0; }
+
+  // The value at or below which the given percentage of values fall, e.g.
+  // percentile(99.9). The result is the highest value equivalent to the
+  // bucket that holds the percentile, clamped to the recorded maximum.
+  std::uint64_t percentile(double percent) const
+  {
+    if (total_ == 0)
+      return 0;
+
+    std::uint64_t rank = static_cast<std::uint64_t>(
+        percent / 100.0 * total_ + 0.5);
+    rank = std::max<std::uint64_t>(1, std::min(rank, total_));
+
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < bucket_count; ++i)
+    {
+      seen += counts_[i];
+      if (seen >= rank)
+        return std::min(highest_equivalent(i), max_);
+    }
+    return max_;
+  }
+
+  // Print count, mean and tail percentiles with values scaled by 1/divisor,
+  // e.g. a divisor of 1000 turns nanoseconds into microseconds.
+  void print(std::ostream& os, double divisor = 1000.0,
+      const char* unit = "us") const
+  {
+    os << "n=" << count()
+      << " mean=" << mean() / divisor << unit
+      << " p50=" << percentile(50.0) / divisor << unit
+      << " p99=" << percentile(99.0) / divisor << unit
+      << " p999=" << percentile(99.9) / divisor << unit
+      << " max=" << max() / divisor << unit;
+  }
+
+private:
+  enum { sub_bits = 6, sub_count = 1 << sub_bits };
+  enum { bucket_count = (64 - sub_bits + 1) * sub_count };
+
+  static int log2_floor(std::uint64_t value)
+  {
+#if defined(__GNUC__)
+    return 63 - __builtin_clzll(value);
+#else // defined(__GNUC__)
+    int result = 0;
+    while (value >>= 1)
+      ++result;
+    return result;
+#endif // defined(__GNUC__)
+  }
+
+  static std::size_t index_of(std::uint64_t value)
+  {
+    if (value < sub_count)
+      return static_cast<std::size_t>(value);
+
+    int shift = log2_floor(value) - sub_bits;
+    return static_cast<std::size_t>(shift) * sub_count
+      + static_cast<std::size_t>(value >> shift);
+  }
+
+  static std::uint64_t highest_equivalent(std::size_t index)
+  {
+    if (index < sub_count)
+      return index;
+
+    std::size_t shift = index / sub_count - 1;
+    std::uint64_t sub = index - shift * sub_count;
+    return ((sub + 1) << shift) - 1;
+  }
+
+  std::vector<std::uint64_t> counts_;
+  std::uint64_t total_;
+  std::uint64_t sum_;
+  std::uint64_t min_;
+  std::uint64_t max_;
+};
+
+#endif // LATENCY_HISTOGRAM_HPP
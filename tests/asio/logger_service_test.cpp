@@ -8,11 +8,87 @@
 #include <boost/thread/thread.hpp>
 #include <boost/bind.hpp>
 
+#if !defined(BOOST_ASIO_WINDOWS)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // !defined(BOOST_ASIO_WINDOWS)
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 namespace services {
 
+    class log_format;
+
+    /// Severity of a log message.
+    enum severity
+    {
+        severity_debug,
+        severity_info,
+        severity_warning,
+        severity_error
+    };
+
+    /// What logging does when messages arrive faster than the background thread
+    /// writes them and the ring of pending messages is full.
+    enum overload_policy
+    {
+        /// Wait for space.
+        overload_block,
+
+        /// Discard the message being logged.
+        overload_drop_newest,
+
+        /// Discard the oldest pending message to make room.
+        overload_drop_oldest,
+
+        /// Discard the message being logged if it is below a given severity,
+        /// otherwise wait for space.
+        overload_drop_below_severity
+    };
+
+    /// Options for logger_service::use_mapped_file.
+    struct mapped_file_options
+    {
+        /// When written data is forced to disk with fdatasync.
+        enum sync_policy
+        {
+            /// Leave it to the kernel.
+            sync_never,
+
+            /// After every batch the background thread writes.
+            sync_per_batch,
+
+            /// At most sync_interval after it was written.
+            sync_periodic
+        };
+
+        /// Size of each segment file.
+        std::size_t segment_size = 64 << 20;
+
+        sync_policy sync = sync_never;
+
+        std::chrono::milliseconds sync_interval = std::chrono::milliseconds(100);
+    };
+
     /// Class to provide simple logging functionality. Use the services::logger
     /// typedef.
     template <typename Service>
@@ -60,10 +136,43 @@ namespace services {
             service_.use_file(impl_, file);
         }
 
+        /// Set a binary output file for all logger instances.
+        void use_binary_file(const std::string& file)
+        {
+            service_.use_binary_file(impl_, file);
+        }
+
+        /// Write all logger instances to rotating memory-mapped segment files.
+        void use_mapped_file(const std::string& base,
+            const mapped_file_options& options = mapped_file_options())
+        {
+            service_.use_mapped_file(impl_, base, options);
+        }
+
         /// Log a message.
         void log(const std::string& message)
         {
-            service_.log(impl_, message);
+            service_.log(impl_, severity_info, message);
+        }
+
+        /// Log a message whose formatting is deferred to the service.
+        template <typename... Args>
+        void log(const log_format& format, const Args&... args)
+        {
+            service_.log(impl_, severity_info, format, args...);
+        }
+
+        /// Log a message with the given severity.
+        void log(severity level, const std::string& message)
+        {
+            service_.log(impl_, level, message);
+        }
+
+        /// Log a message with the given severity and deferred formatting.
+        template <typename... Args>
+        void log(severity level, const log_format& format, const Args&... args)
+        {
+            service_.log(impl_, level, format, args...);
         }
 
     private:
@@ -74,6 +183,655 @@ namespace services {
         impl_type impl_;
     };
 
+    /// Identifier of a format string registered with log_format. Zero stands for
+    /// a plain text message.
+    typedef std::uint32_t format_id;
+
+    /// Process-wide table of the format strings used for deferred formatting.
+    class format_registry
+        : private boost::noncopyable
+    {
+    public:
+        /// Get the registry.
+        static format_registry& instance()
+        {
+            static format_registry registry;
+            return registry;
+        }
+
+        /// Register a format string and return its id.
+        format_id add(const char* format)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            formats_.push_back(format);
+            return static_cast<format_id>(formats_.size());
+        }
+
+        /// Copy the format strings registered so far, indexed by id - 1.
+        void copy_to(std::vector<std::string>& formats) const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            formats = formats_;
+        }
+
+    private:
+        mutable std::mutex mutex_;
+        std::vector<std::string> formats_;
+    };
+
+    /// A format string for deferred logging. Each "{}" in the string is replaced
+    /// by the next argument. Construct each format once, typically as a static,
+    /// so that logging with it costs no more than copying the arguments.
+    class log_format
+    {
+    public:
+        explicit log_format(const char* format)
+            : id_(format_registry::instance().add(format))
+        {
+        }
+
+        format_id id() const
+        {
+            return id_;
+        }
+
+    private:
+        format_id id_;
+    };
+
+    /// Raw encoding of deferred log arguments. Each argument is a one byte type
+    /// tag followed by its value in native byte order; strings are a 32-bit
+    /// length followed by their bytes.
+    namespace log_args {
+
+        enum tag
+        {
+            signed_tag = 'i',
+            unsigned_tag = 'u',
+            double_tag = 'd',
+            char_tag = 'c',
+            bool_tag = 'b',
+            string_tag = 's'
+        };
+
+        /// Growable byte buffer for encoded arguments. Unlike std::string it
+        /// hands out space to write into without initializing it first, which
+        /// lets the encoders below compile down to a few stores.
+        class buffer
+            : private boost::noncopyable
+        {
+        public:
+            explicit buffer(std::size_t capacity = 0)
+                : data_(new char[capacity]), size_(0), capacity_(capacity)
+            {
+            }
+
+            const char* data() const { return data_.get(); }
+            std::size_t size() const { return size_; }
+            void clear() { size_ = 0; }
+
+            /// Add n bytes to the end of the buffer and return where they start.
+            char* extend(std::size_t n)
+            {
+                if (capacity_ - size_ < n)
+                    grow(n);
+                char* p = data_.get() + size_;
+                size_ += n;
+                return p;
+            }
+
+            void assign(const char* data, std::size_t size)
+            {
+                clear();
+                if (size != 0)
+                    std::memcpy(extend(size), data, size);
+            }
+
+        private:
+            void grow(std::size_t n)
+            {
+                std::size_t capacity = std::max(capacity_ * 2, size_ + n);
+                std::unique_ptr<char[]> data(new char[capacity]);
+                if (size_ != 0)
+                    std::memcpy(data.get(), data_.get(), size_);
+                data_.swap(data);
+                capacity_ = capacity;
+            }
+
+            std::unique_ptr<char[]> data_;
+            std::size_t size_;
+            std::size_t capacity_;
+        };
+
+        template <typename T>
+        inline void append_raw(buffer& out, char t, const T& value)
+        {
+            char* p = out.extend(1 + sizeof(T));
+            *p = t;
+            std::memcpy(p + 1, &value, sizeof(T));
+        }
+
+        template <typename T>
+        inline typename std::enable_if<std::is_integral<T>::value
+            && std::is_signed<T>::value && !std::is_same<T, char>::value>::type
+        encode(buffer& out, T value)
+        {
+            append_raw(out, signed_tag, static_cast<std::int64_t>(value));
+        }
+
+        template <typename T>
+        inline typename std::enable_if<std::is_integral<T>::value
+            && std::is_unsigned<T>::value && !std::is_same<T, char>::value
+            && !std::is_same<T, bool>::value>::type
+        encode(buffer& out, T value)
+        {
+            append_raw(out, unsigned_tag, static_cast<std::uint64_t>(value));
+        }
+
+        template <typename T>
+        inline typename std::enable_if<std::is_floating_point<T>::value>::type
+        encode(buffer& out, T value)
+        {
+            append_raw(out, double_tag, static_cast<double>(value));
+        }
+
+        inline void encode(buffer& out, char value)
+        {
+            append_raw(out, char_tag, value);
+        }
+
+        inline void encode(buffer& out, bool value)
+        {
+            append_raw(out, bool_tag, static_cast<char>(value));
+        }
+
+        inline void encode(buffer& out, const char* data, std::size_t size)
+        {
+            append_raw(out, string_tag, static_cast<std::uint32_t>(size));
+            if (size != 0)
+                std::memcpy(out.extend(size), data, size);
+        }
+
+        inline void encode(buffer& out, const char* value)
+        {
+            encode(out, value, std::strlen(value));
+        }
+
+        inline void encode(buffer& out, const std::string& value)
+        {
+            encode(out, value.data(), value.size());
+        }
+
+        inline void encode_all(buffer& /*out*/)
+        {
+        }
+
+        template <typename T, typename... Rest>
+        inline void encode_all(buffer& out, const T& first,
+            const Rest&... rest)
+        {
+            encode(out, first);
+            encode_all(out, rest...);
+        }
+
+        /// Read a value of type T at data, advancing data. Returns false if
+        /// fewer than sizeof(T) bytes remain.
+        template <typename T>
+        inline bool read_raw(const char*& data, const char* end, T& value)
+        {
+            if (static_cast<std::size_t>(end - data) < sizeof(T))
+                return false;
+            std::memcpy(&value, data, sizeof(T));
+            data += sizeof(T);
+            return true;
+        }
+
+        /// Decode one argument and append its text to out.
+        inline bool format_one(std::string& out, const char*& data,
+            const char* end)
+        {
+            char t = 0;
+            if (!read_raw(data, end, t))
+                return false;
+
+            char text[32];
+            int length = 0;
+            switch (t)
+            {
+            case signed_tag:
+            {
+                std::int64_t value;
+                if (!read_raw(data, end, value))
+                    return false;
+                length = std::snprintf(text, sizeof(text), "%lld",
+                    static_cast<long long>(value));
+                break;
+            }
+            case unsigned_tag:
+            {
+                std::uint64_t value;
+                if (!read_raw(data, end, value))
+                    return false;
+                length = std::snprintf(text, sizeof(text), "%llu",
+                    static_cast<unsigned long long>(value));
+                break;
+            }
+            case double_tag:
+            {
+                double value;
+                if (!read_raw(data, end, value))
+                    return false;
+                length = std::snprintf(text, sizeof(text), "%g", value);
+                break;
+            }
+            case char_tag:
+            case bool_tag:
+            {
+                char value;
+                if (!read_raw(data, end, value))
+                    return false;
+                if (t == char_tag)
+                    out.push_back(value);
+                else
+                    out.append(value ? "true" : "false");
+                return true;
+            }
+            case string_tag:
+            {
+                std::uint32_t size;
+                if (!read_raw(data, end, size)
+                    || static_cast<std::size_t>(end - data) < size)
+                    return false;
+                out.append(data, size);
+                data += size;
+                return true;
+            }
+            default:
+                return false;
+            }
+            out.append(text, length);
+            return true;
+        }
+
+        /// Append the format string to out with each "{}" replaced by the next
+        /// encoded argument. Placeholders left without an argument are kept as
+        /// they are.
+        inline void format(std::string& out, const std::string& format,
+            const char* data, std::size_t size)
+        {
+            const char* end = data + size;
+            std::size_t pos = 0;
+            for (;;)
+            {
+                std::size_t next = format.find("{}", pos);
+                if (next == std::string::npos)
+                    break;
+                out.append(format, pos, next - pos);
+                if (!format_one(out, data, end))
+                    out.append("{}");
+                pos = next + 2;
+            }
+            out.append(format, pos, std::string::npos);
+        }
+
+    } // namespace log_args
+
+    /// Bounded queue of preallocated records, after Dmitry Vyukov's bounded MPMC
+    /// queue. Each slot carries a sequence number that tells producers and
+    /// consumers whose turn it is, so pushing and popping take one
+    /// compare-and-swap on a shared position and no lock. Records are filled
+    /// and read in place and keep whatever buffers they own from one message to
+    /// the next, so in the steady state logging does not allocate.
+    template <typename Record>
+    class message_ring
+        : private boost::noncopyable
+    {
+    public:
+        /// Constructor. The capacity must be a power of two.
+        explicit message_ring(std::size_t capacity)
+            : slots_(new slot[capacity]),
+            mask_(capacity - 1),
+            enqueue_pos_(0),
+            dequeue_pos_(0)
+        {
+            for (std::size_t i = 0; i < capacity; ++i)
+                slots_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+
+        /// Claim the next free slot and call fill with its record. Returns false
+        /// if the ring is full.
+        template <typename Fill>
+        bool try_push(Fill fill)
+        {
+            std::size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                slot& s = slots_[pos & mask_];
+                std::size_t seq = s.sequence.load(std::memory_order_acquire);
+                std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq - pos);
+                if (diff == 0)
+                {
+                    if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                          std::memory_order_seq_cst, std::memory_order_relaxed))
+                    {
+                        fill(s.record);
+                        s.sequence.store(pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0)
+                    return false;
+                else
+                    pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+
+        /// Pop up to max records, passing each to f. Returns the number of
+        /// records popped.
+        template <typename Function>
+        std::size_t consume(std::size_t max, Function f)
+        {
+            std::size_t count = 0;
+            while (count < max)
+            {
+                std::size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+                slot* s;
+                for (;;)
+                {
+                    s = &slots_[pos & mask_];
+                    std::size_t seq = s->sequence.load(std::memory_order_acquire);
+                    std::ptrdiff_t diff =
+                        static_cast<std::ptrdiff_t>(seq - (pos + 1));
+                    if (diff == 0)
+                    {
+                        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+                              std::memory_order_relaxed))
+                            break;
+                    }
+                    else if (diff < 0)
+                        return count;
+                    else
+                        pos = dequeue_pos_.load(std::memory_order_relaxed);
+                }
+
+                f(s->record);
+                s->sequence.store(pos + mask_ + 1, std::memory_order_release);
+                ++count;
+            }
+            return count;
+        }
+
+        std::size_t capacity() const
+        {
+            return mask_ + 1;
+        }
+
+        /// Number of slots claimed by producers so far.
+        std::size_t enqueue_position() const
+        {
+            return enqueue_pos_.load(std::memory_order_seq_cst);
+        }
+
+        /// Whether every slot claimed before position has been consumed, or
+        /// is being consumed by a consume() call that has claimed it.
+        bool consumed(std::size_t position) const
+        {
+            return static_cast<std::ptrdiff_t>(
+                dequeue_pos_.load(std::memory_order_acquire) - position) >= 0;
+        }
+
+        /// Whether every slot claimed by a producer has been consumed. A slot
+        /// counts from the moment its producer claims it, before it is filled.
+        bool empty() const
+        {
+            return enqueue_pos_.load(std::memory_order_seq_cst)
+                == dequeue_pos_.load(std::memory_order_relaxed);
+        }
+
+    private:
+        struct slot
+        {
+            std::atomic<std::size_t> sequence;
+            Record record;
+        };
+
+        enum { cache_line_size = 64 };
+
+        std::unique_ptr<slot[]> slots_;
+        std::size_t mask_;
+        char pad0_[cache_line_size];
+        std::atomic<std::size_t> enqueue_pos_;
+        char pad1_[cache_line_size];
+        std::atomic<std::size_t> dequeue_pos_;
+        char pad2_[cache_line_size];
+    };
+
+    /// Decode a binary log written after logger_service::use_binary_file into
+    /// text lines, as the service would have written them with use_file.
+    /// Returns false if the input is not a complete binary log. The log is in
+    /// the byte order of the machine that wrote it.
+    inline bool decode_log(std::istream& in, std::ostream& out)
+    {
+        char magic[8];
+        if (!in.read(magic, sizeof(magic))
+            || std::memcmp(magic, "ASIOLOG1", sizeof(magic)) != 0)
+            return false;
+
+        std::map<format_id, std::string> formats;
+        std::map<std::uint64_t, std::string> identifiers;
+        std::string bytes, line;
+        auto read_bytes = [&in, &bytes]()
+            {
+                std::uint32_t size;
+                if (!in.read(reinterpret_cast<char*>(&size), sizeof(size)))
+                    return false;
+                bytes.resize(size);
+                return size == 0 || static_cast<bool>(in.read(&bytes[0], size));
+            };
+
+        char kind;
+        while (in.get(kind))
+        {
+            std::uint64_t key = 0;
+            format_id id = 0;
+            switch (kind)
+            {
+            case 'F':
+                if (!in.read(reinterpret_cast<char*>(&id), sizeof(id))
+                    || !read_bytes())
+                    return false;
+                formats[id] = bytes;
+                break;
+            case 'L':
+                if (!in.read(reinterpret_cast<char*>(&key), sizeof(key))
+                    || !read_bytes())
+                    return false;
+                identifiers[key] = bytes;
+                break;
+            case 'M':
+                if (!in.read(reinterpret_cast<char*>(&key), sizeof(key))
+                    || !in.read(reinterpret_cast<char*>(&id), sizeof(id))
+                    || !read_bytes())
+                    return false;
+                line = identifiers[key];
+                line.append(": ");
+                if (id == 0)
+                    line.append(bytes);
+                else
+                    log_args::format(line, formats[id], bytes.data(), bytes.size());
+                line.push_back('\n');
+                out.write(line.data(), line.size());
+                break;
+            default:
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /// Log file made of fixed-size segments named base.000000, base.000001 and
+    /// so on. Each segment is preallocated and mapped into memory when it is
+    /// opened, so appending is a memcpy through a write cursor with no system
+    /// call and no stdio buffering; once a segment fills up the file moves on
+    /// to the next. The last segment is truncated to the data written when the
+    /// file is closed. Segment files are POSIX only: on other platforms open()
+    /// fails and nothing is written.
+    class mapped_log_file
+        : private boost::noncopyable
+    {
+    public:
+        mapped_log_file()
+            : fd_(-1), data_(0), segment_size_(0), cursor_(0), index_(0),
+            dirty_(false), sync_on_rotate_(false)
+        {
+        }
+
+        ~mapped_log_file()
+        {
+            close();
+        }
+
+        /// Open the first segment, replacing any existing file of that name.
+        bool open(const std::string& base, std::size_t segment_size,
+            bool sync_on_rotate)
+        {
+            close();
+            base_ = base;
+            segment_size_ = segment_size;
+            sync_on_rotate_ = sync_on_rotate;
+            index_ = 0;
+            return open_segment();
+        }
+
+        bool is_open() const
+        {
+            return data_ != 0;
+        }
+
+        /// Append data, moving on to new segments as they fill up.
+        void write(const char* data, std::size_t size)
+        {
+            while (size != 0 && is_open())
+            {
+                if (cursor_ == segment_size_)
+                {
+                    if (sync_on_rotate_)
+                        sync();
+                    close();
+                    ++index_;
+                    if (!open_segment())
+                        return;
+                }
+
+                std::size_t n = std::min(size, segment_size_ - cursor_);
+                std::memcpy(data_ + cursor_, data, n);
+                cursor_ += n;
+                data += n;
+                size -= n;
+                dirty_ = true;
+            }
+        }
+
+        /// Force data written to the current segment to disk.
+        void sync()
+        {
+#if !defined(BOOST_ASIO_WINDOWS)
+            if (dirty_ && fd_ != -1)
+            {
+# if defined(__linux__)
+                ::fdatasync(fd_);
+# else // defined(__linux__)
+                ::fsync(fd_);
+# endif // defined(__linux__)
+                dirty_ = false;
+            }
+#endif // !defined(BOOST_ASIO_WINDOWS)
+        }
+
+        void close()
+        {
+#if !defined(BOOST_ASIO_WINDOWS)
+            if (data_)
+                ::munmap(data_, segment_size_);
+            if (fd_ != -1)
+            {
+                if (::ftruncate(fd_, static_cast<off_t>(cursor_)) != 0)
+                {
+                    // The segment keeps its preallocated size.
+                }
+                ::close(fd_);
+            }
+#endif // !defined(BOOST_ASIO_WINDOWS)
+            fd_ = -1;
+            data_ = 0;
+            cursor_ = 0;
+            dirty_ = false;
+        }
+
+        /// Name of the segment with the given index.
+        std::string segment_path(std::size_t index) const
+        {
+            char suffix[32];
+            std::snprintf(suffix, sizeof(suffix), ".%06lu",
+                static_cast<unsigned long>(index));
+            return base_ + suffix;
+        }
+
+        /// Index of the segment being written.
+        std::size_t segment_index() const
+        {
+            return index_;
+        }
+
+    private:
+        bool open_segment()
+        {
+#if !defined(BOOST_ASIO_WINDOWS)
+            std::string path = segment_path(index_);
+            fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd_ == -1)
+                return false;
+
+            // Reserve the blocks up front so that appending never has to
+            // allocate them, and fault the pages in now rather than on the
+            // first write to each.
+            off_t size = static_cast<off_t>(segment_size_);
+# if defined(__linux__)
+            bool reserved = ::posix_fallocate(fd_, 0, size) == 0;
+# else // defined(__linux__)
+            bool reserved = ::ftruncate(fd_, size) == 0;
+# endif // defined(__linux__)
+            int flags = MAP_SHARED;
+# if defined(MAP_POPULATE)
+            flags |= MAP_POPULATE;
+# endif // defined(MAP_POPULATE)
+            void* data = reserved
+                ? ::mmap(0, segment_size_, PROT_READ | PROT_WRITE, flags, fd_, 0)
+                : MAP_FAILED;
+            if (data == MAP_FAILED)
+            {
+                ::close(fd_);
+                fd_ = -1;
+                return false;
+            }
+            data_ = static_cast<char*>(data);
+            cursor_ = 0;
+            return true;
+#else // !defined(BOOST_ASIO_WINDOWS)
+            return false;
+#endif // !defined(BOOST_ASIO_WINDOWS)
+        }
+
+        std::string base_;
+        int fd_;
+        char* data_;
+        std::size_t segment_size_;
+        std::size_t cursor_;
+        std::size_t index_;
+        bool dirty_;
+        bool sync_on_rotate_;
+    };
+
     /// Service implementation for the logger.
     class logger_service
         : public boost::asio::execution_context::service {
@@ -84,17 +842,42 @@ namespace services {
         /// The backend implementation of a logger.
         struct logger_impl
         {
-            explicit logger_impl(const std::string& ident) : identifier(ident) {}
+            logger_impl(const std::string& ident, std::uint64_t k)
+                : identifier(ident), key(k), dropped(0) {}
             std::string identifier;
+
+            /// Names the logger in binary logs; never reused.
+            std::uint64_t key;
+
+            /// Messages from this logger dropped and not yet reported.
+            std::atomic<std::uint64_t> dropped;
         };
 
         /// The type for an implementation of the logger.
         typedef logger_impl* impl_type;
 
+        /// Number of message slots in the ring.
+        enum { ring_capacity = 4096 };
+
+        /// Text capacity preallocated in each slot.
+        enum { slot_text_capacity = 256 };
+
         /// Constructor creates a thread to run a private io_context.
         logger_service(boost::asio::execution_context& context)
             : boost::asio::execution_context::service(context),
+            ring_(ring_capacity),
+            drain_scheduled_(false),
+            drain_urgent_(false),
+            policy_(overload_block),
+            drop_below_(severity_warning),
+            drops_pending_(false),
+            next_key_(0),
             work_io_context_(),
+            flush_timer_(work_io_context_),
+            flush_interval_(std::chrono::milliseconds(10)),
+            binary_(false),
+            sync_timer_(work_io_context_),
+            sync_pending_(false),
             work_(boost::asio::make_work_guard(work_io_context_)),
             work_thread_(new boost::thread(
                 boost::bind(&boost::asio::io_context::run, &work_io_context_)))
@@ -104,6 +887,11 @@ namespace services {
         /// Destructor shuts down the private io_context.
         ~logger_service()
         {
+            /// Write out whatever is still in the ring without waiting for the
+            /// flush timer.
+            boost::asio::post(work_io_context_, boost::bind(
+                &logger_service::drain_now, this));
+
             /// Indicate that we have finished with the private io_context. Its
             /// io_context::run() function will exit once all other work has completed.
             work_.reset();
@@ -125,13 +913,20 @@ namespace services {
         /// Create a new logger implementation.
         void create(impl_type& impl, const std::string& identifier)
         {
-            impl = new logger_impl(identifier);
+            impl = new logger_impl(identifier, ++next_key_);
+            boost::asio::post(work_io_context_, boost::bind(
+                &logger_service::create_impl, this, impl));
         }
 
         /// Destroy a logger implementation.
         void destroy(impl_type& impl)
         {
-            delete impl;
+            // Records in the ring may still refer to the implementation, so the
+            // background thread deletes it only once every record claimed up to
+            // now has been consumed.
+            boost::asio::post(work_io_context_, boost::bind(
+                &logger_service::destroy_impl, this, impl,
+                ring_.enqueue_position()));
             impl = null();
         }
 
@@ -143,41 +938,459 @@ namespace services {
         {
             // Pass the work of opening the file to the background thread.
             boost::asio::post(work_io_context_, boost::bind(
-                &logger_service::use_file_impl, this, file));
+                &logger_service::use_file_impl, this, file, false));
         }
 
-        /// Log a message.
-        void log(impl_type& impl, const std::string& message)
+        /// Set a binary output file for all logger instances. Deferred messages are
+        /// written with their raw arguments and are formatted later by decode_log.
+        void use_binary_file(impl_type& /*impl*/, const std::string& file)
         {
-            // Format the text to be logged.
-            std::ostringstream os;
-            os << impl->identifier << ": " << message;
+            boost::asio::post(work_io_context_, boost::bind(
+                &logger_service::use_file_impl, this, file, true));
+        }
 
-            // Pass the work of writing to the file to the background thread.
+        /// Write all logger instances to a rotating set of memory-mapped segment
+        /// files instead of an ordinary file. Messages are written as text.
+        void use_mapped_file(impl_type& /*impl*/, const std::string& base,
+            const mapped_file_options& options)
+        {
             boost::asio::post(work_io_context_, boost::bind(
-                &logger_service::log_impl, this, os.str()));
+                &logger_service::use_mapped_file_impl, this, base, options));
+        }
+
+        /// Set how long messages may wait in the ring before the background
+        /// thread writes them out. Messages that arrive within one interval are
+        /// written together. Zero writes as soon as the background thread gets to
+        /// them.
+        void set_flush_interval(std::chrono::steady_clock::duration interval)
+        {
+            boost::asio::post(work_io_context_, boost::bind(
+                &logger_service::set_flush_interval_impl, this, interval));
+        }
+
+        /// Set the policy for when the ring of pending messages is full. For
+        /// overload_drop_below_severity, messages below the given severity are
+        /// dropped. Dropped messages are counted for each logger, and once the
+        /// background thread has caught up it writes a line saying how many
+        /// messages each logger lost.
+        void set_overload_policy(overload_policy policy,
+            severity drop_below = severity_warning)
+        {
+            drop_below_.store(drop_below, std::memory_order_relaxed);
+            policy_.store(policy, std::memory_order_relaxed);
+        }
+
+        /// Log a message.
+        void log(impl_type& impl, severity level, const std::string& message)
+        {
+            push(*impl, level, [&](log_record& record)
+                {
+                    record.impl = impl;
+                    record.format = 0;
+                    record.data.assign(message.data(), message.size());
+                });
+        }
+
+        /// Log a message with deferred formatting. Only the format's id and the
+        /// raw bytes of the arguments are copied on the caller's thread.
+        template <typename... Args>
+        void log(impl_type& impl, severity level, const log_format& format,
+            const Args&... args)
+        {
+            push(*impl, level, [&](log_record& record)
+                {
+                    record.impl = impl;
+                    record.format = format.id();
+                    record.data.clear();
+                    log_args::encode_all(record.data, args...);
+                });
         }
 
     private:
+        /// A message in the ring: plain text when format is zero, otherwise
+        /// encoded arguments for the format with that id.
+        struct log_record
+        {
+            log_record()
+                : impl(0), format(0), data(slot_text_capacity)
+            {
+            }
+
+            logger_impl* impl;
+            format_id format;
+            log_args::buffer data;
+        };
+
+        /// Fill a record in the ring and see that it gets written.
+        template <typename Fill>
+        void push(logger_impl& impl, severity level, Fill fill)
+        {
+            // When the ring is full, have the background thread drain it now
+            // rather than at the end of the flush interval, then apply the
+            // overload policy.
+            while (!ring_.try_push(fill))
+            {
+                if (!drain_urgent_.exchange(true))
+                    boost::asio::post(work_io_context_, boost::bind(
+                        &logger_service::drain_now, this));
+
+                switch (policy_.load(std::memory_order_relaxed))
+                {
+                case overload_drop_newest:
+                    count_drop(impl);
+                    return;
+                case overload_drop_below_severity:
+                    if (level < drop_below_.load(std::memory_order_relaxed))
+                    {
+                        count_drop(impl);
+                        return;
+                    }
+                    break;
+                case overload_drop_oldest:
+                    drop_oldest();
+                    continue;
+                default:
+                    break;
+                }
+                std::this_thread::yield();
+            }
+
+            // Pass the work of writing to the file to the background thread,
+            // unless a drain is already on its way. The slot was claimed with a
+            // sequentially consistent compare-and-swap before this load, and
+            // drain() clears the flag before it checks for claimed slots, so
+            // either that drain sees this message or we see the flag cleared.
+            if (!drain_scheduled_.load() && !drain_scheduled_.exchange(true))
+            {
+                boost::asio::post(work_io_context_, boost::bind(
+                    &logger_service::schedule_drain, this));
+            }
+        }
+
+        void count_drop(logger_impl& impl)
+        {
+            impl.dropped.fetch_add(1, std::memory_order_relaxed);
+            drops_pending_.store(true, std::memory_order_relaxed);
+        }
+
+        /// Take the oldest message out of the ring and count it as dropped. The
+        /// mutex keeps its logger from being deleted until it has been counted.
+        void drop_oldest()
+        {
+            std::lock_guard<std::mutex> lock(drop_mutex_);
+            ring_.consume(1, [this](const log_record& record)
+                {
+                    count_drop(*record.impl);
+                });
+        }
+
         /// Helper function used to open the output file from within the private
-/// io_context's thread.
-        void use_file_impl(const std::string& file)
+        /// io_context's thread.
+        void use_file_impl(const std::string& file, bool binary)
         {
+            mapped_file_.close();
             ofstream_.close();
             ofstream_.clear();
-            ofstream_.open(file.c_str());
+            binary_ = binary;
+            if (binary)
+            {
+                ofstream_.open(file.c_str(), std::ios::binary);
+                ofstream_.write("ASIOLOG1", 8);
+                formats_written_.clear();
+                loggers_written_.clear();
+            }
+            else
+            {
+                ofstream_.open(file.c_str());
+            }
         }
 
-        /// Helper function used to log a message from within the private io_context's
-        /// thread.
-        void log_impl(const std::string& text)
+        /// Helper function used to open the segment files from within the private
+        /// io_context's thread.
+        void use_mapped_file_impl(const std::string& base,
+            const mapped_file_options& options)
         {
-            ofstream_ << text << std::endl;
+            ofstream_.close();
+            binary_ = false;
+            mapped_options_ = options;
+            mapped_file_.open(base, options.segment_size,
+                options.sync != mapped_file_options::sync_never);
         }
 
+        /// Helper function used to delete a logger implementation from within the
+        /// private io_context's thread.
+        void destroy_impl(logger_impl* impl, std::size_t last_record)
+        {
+            drain();
+
+            // drain() stops at a slot whose producer has not finished filling
+            // it, and records of this logger may be queued behind that slot.
+            // Try again once the producer is done. The mutex keeps a
+            // drop_oldest() that has claimed a record from still using it.
+            std::unique_lock<std::mutex> lock(drop_mutex_);
+            if (!ring_.consumed(last_record))
+            {
+                lock.unlock();
+                boost::asio::post(work_io_context_, boost::bind(
+                    &logger_service::destroy_impl, this, impl, last_record));
+                return;
+            }
+
+            batch_.clear();
+            append_drops(*impl);
+            write_batch();
+            impls_.erase(impl);
+            delete impl;
+        }
+
+        /// Helper function used to register a logger implementation from within
+        /// the private io_context's thread, so that its drops get reported.
+        void create_impl(logger_impl* impl)
+        {
+            impls_.insert(impl);
+        }
+
+        /// Helper function used to change the flush interval from within the
+        /// private io_context's thread.
+        void set_flush_interval_impl(std::chrono::steady_clock::duration interval)
+        {
+            flush_interval_ = interval;
+        }
+
+        /// Start the flush interval at the end of which the ring is drained.
+        void schedule_drain()
+        {
+            if (flush_interval_ == std::chrono::steady_clock::duration::zero())
+            {
+                drain();
+            }
+            else
+            {
+                flush_timer_.expires_after(flush_interval_);
+                flush_timer_.async_wait(boost::bind(&logger_service::drain, this));
+            }
+        }
+
+        /// Drain the ring ahead of the flush timer.
+        void drain_now()
+        {
+            drain_urgent_.store(false);
+            drain();
+        }
+
+        /// Write out everything in the ring with one write and one flush. Runs
+        /// on the private io_context's thread.
+        void drain()
+        {
+            drain_scheduled_.store(false);
+
+            batch_.clear();
+            ring_.consume(ring_.capacity(), [this](const log_record& record)
+                {
+                    append(*record.impl, record.format,
+                        record.data.data(), record.data.size());
+                });
+
+            // Once the ring has been emptied the pressure is off: report what
+            // was lost while it lasted.
+            if (drops_pending_.load(std::memory_order_relaxed) && ring_.empty())
+            {
+                drops_pending_.store(false, std::memory_order_relaxed);
+                for (logger_impl* impl : impls_)
+                    append_drops(*impl);
+            }
+            write_batch();
+
+            // A producer that saw the flag still set before it was cleared above
+            // relies on this drain; if its slot was not ready to consume yet,
+            // schedule another.
+            if (!ring_.empty() && !drain_scheduled_.exchange(true))
+                boost::asio::post(work_io_context_, boost::bind(
+                    &logger_service::schedule_drain, this));
+        }
+
+        /// Write the batch with one write and one flush.
+        void write_batch()
+        {
+            if (batch_.empty())
+                return;
+
+            if (mapped_file_.is_open())
+            {
+                mapped_file_.write(batch_.data(), batch_.size());
+                schedule_sync();
+            }
+            else
+            {
+                ofstream_.write(batch_.data(), batch_.size());
+                ofstream_.flush();
+            }
+        }
+
+        /// Append a message to the batch in the output file's format.
+        void append(const logger_impl& impl, format_id format,
+            const char* data, std::size_t size)
+        {
+            if (binary_)
+                append_binary(impl, format, data, size);
+            else
+                append_text(impl, format, data, size);
+        }
+
+        /// Append a line reporting the messages a logger has dropped, if any.
+        void append_drops(logger_impl& impl)
+        {
+            std::uint64_t dropped =
+                impl.dropped.exchange(0, std::memory_order_relaxed);
+            if (dropped != 0)
+            {
+                std::string text = "dropped " + std::to_string(dropped)
+                    + " messages while the log was overloaded";
+                append(impl, 0, text.data(), text.size());
+            }
+        }
+
+        /// Apply the segment files' sync policy after a batch has been written.
+        void schedule_sync()
+        {
+            switch (mapped_options_.sync)
+            {
+            case mapped_file_options::sync_per_batch:
+                mapped_file_.sync();
+                break;
+            case mapped_file_options::sync_periodic:
+                if (!sync_pending_)
+                {
+                    sync_pending_ = true;
+                    sync_timer_.expires_after(mapped_options_.sync_interval);
+                    sync_timer_.async_wait(
+                        boost::bind(&logger_service::sync_impl, this));
+                }
+                break;
+            default:
+                break;
+            }
+        }
+
+        void sync_impl()
+        {
+            sync_pending_ = false;
+            mapped_file_.sync();
+        }
+
+        /// Format a message as a line of text.
+        void append_text(const logger_impl& impl, format_id format,
+            const char* data, std::size_t size)
+        {
+            batch_.append(impl.identifier);
+            batch_.append(": ", 2);
+            if (format == 0)
+                batch_.append(data, size);
+            else
+                log_args::format(batch_, format_string(format), data, size);
+            batch_.push_back('\n');
+        }
+
+        /// Append a message to a binary log, preceded by the definitions of its
+        /// logger and format the first time each appears in the file.
+        void append_binary(const logger_impl& impl, format_id format,
+            const char* data, std::size_t size)
+        {
+            if (loggers_written_.insert(impl.key).second)
+            {
+                batch_.push_back('L');
+                append_value(impl.key);
+                append_bytes(impl.identifier.data(), impl.identifier.size());
+            }
+
+            if (format != 0)
+            {
+                if (formats_written_.size() <= format)
+                    formats_written_.resize(format + 1);
+                if (!formats_written_[format])
+                {
+                    formats_written_[format] = true;
+                    batch_.push_back('F');
+                    append_value(format);
+                    const std::string& text = format_string(format);
+                    append_bytes(text.data(), text.size());
+                }
+            }
+
+            batch_.push_back('M');
+            append_value(impl.key);
+            append_value(format);
+            append_bytes(data, size);
+        }
+
+        template <typename T>
+        void append_value(const T& value)
+        {
+            batch_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+
+        void append_bytes(const char* data, std::size_t size)
+        {
+            append_value(static_cast<std::uint32_t>(size));
+            batch_.append(data, size);
+        }
+
+        /// Look up a format string, refreshing the local copy of the registry
+        /// when the id is new to it.
+        const std::string& format_string(format_id id)
+        {
+            if (id > formats_.size())
+                format_registry::instance().copy_to(formats_);
+            return formats_[id - 1];
+        }
+
+        /// Messages waiting to be written.
+        message_ring<log_record> ring_;
+
+        /// Whether a drain has been posted or its timer is running.
+        std::atomic<bool> drain_scheduled_;
+
+        /// Whether a drain has been posted because the ring filled up.
+        std::atomic<bool> drain_urgent_;
+
+        /// The overload policy and its severity threshold.
+        std::atomic<int> policy_;
+        std::atomic<int> drop_below_;
+
+        /// Whether any logger has dropped messages since the last report.
+        std::atomic<bool> drops_pending_;
+
+        /// Held while a producer drops the oldest message, and while the
+        /// background thread deletes a logger implementation.
+        std::mutex drop_mutex_;
+
+        /// Live logger implementations. Only used on the background thread.
+        std::set<logger_impl*> impls_;
+
+        /// Source of logger keys.
+        std::atomic<std::uint64_t> next_key_;
+
         /// Private io_context used for performing logging operations.
         boost::asio::io_context work_io_context_;
 
+        /// Timer for the flush interval. Only used on the background thread.
+        boost::asio::steady_timer flush_timer_;
+
+        /// The flush interval. Only used on the background thread.
+        std::chrono::steady_clock::duration flush_interval_;
+
+        /// Whether the output file is a binary log.
+        bool binary_;
+
+        /// Segment files written instead of ofstream_ while open, and their
+        /// options.
+        mapped_log_file mapped_file_;
+        mapped_file_options mapped_options_;
+
+        /// Timer for the periodic sync policy, and whether it is running.
+        boost::asio::steady_timer sync_timer_;
+        bool sync_pending_;
+
         /// Work for the private io_context to perform. If we do not give the
         /// io_context some work to do then the io_context::run() function will exit
         /// immediately.
@@ -189,6 +1402,16 @@ namespace services {
 
         /// The file to which log messages will be written.
         std::ofstream ofstream_;
+
+        /// Text of the batch being written, reused from one batch to the next.
+        std::string batch_;
+
+        /// The background thread's copy of the format registry.
+        std::vector<std::string> formats_;
+
+        /// Formats and loggers already defined in the binary log.
+        std::vector<bool> formats_written_;
+        std::set<std::uint64_t> loggers_written_;
     };
 
 
@@ -200,4 +1423,484 @@ TEST(asio, logger_service)
     boost::asio::io_context io_context;
     services::logger logger(io_context, "logger");
     logger.log("test logger");
-}
\ No newline at end of file
+}
+
+namespace {
+
+std::vector<std::string> read_lines(const char* path)
+{
+    std::ifstream is(path);
+    std::vector<std::string> lines;
+    std::string line;
+    while (std::getline(is, line))
+        lines.push_back(line);
+    return lines;
+}
+
+} // namespace
+
+TEST(asio, logger_service_batching)
+{
+    const char* path = "logger_service_test.log";
+
+    // A message is written within the flush interval without waiting for
+    // more to arrive.
+    {
+        boost::asio::io_context io_context;
+        boost::asio::execution_context& context = io_context;
+        boost::asio::use_service<services::logger_service>(context)
+            .set_flush_interval(std::chrono::milliseconds(5));
+        services::logger logger(io_context, "first");
+        logger.use_file(path);
+        logger.log("hello");
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        std::vector<std::string> lines = read_lines(path);
+        ASSERT_EQ(1u, lines.size());
+        EXPECT_EQ("first: hello", lines[0]);
+    }
+
+    // Several threads logging at once, many times the ring's capacity. Every
+    // message arrives, in order for each logger, by the time the service is
+    // destroyed.
+    const int thread_count = 4;
+    const int message_count = 250000;
+    std::chrono::duration<double> elapsed;
+    {
+        boost::asio::io_context io_context;
+        services::logger file_setter(io_context, "setter");
+        file_setter.use_file(path);
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (int t = 0; t < thread_count; ++t)
+        {
+            threads.emplace_back([&io_context, t, message_count]()
+                {
+                    services::logger logger(io_context,
+                        "thread " + std::to_string(t));
+                    for (int i = 0; i < message_count; ++i)
+                        logger.log(std::to_string(i));
+                });
+        }
+        for (std::thread& thread : threads)
+            thread.join();
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+
+    std::vector<std::string> lines = read_lines(path);
+    ASSERT_EQ(std::size_t(thread_count) * message_count, lines.size());
+    std::vector<int> next(thread_count, 0);
+    for (const std::string& line : lines)
+    {
+        int t = 0, i = 0;
+        ASSERT_EQ(2, std::sscanf(line.c_str(), "thread %d: %d", &t, &i));
+        ASSERT_EQ(next[t]++, i);
+    }
+    std::cout << thread_count * message_count / elapsed.count()
+        << " messages/s" << std::endl;
+    std::remove(path);
+}
+
+TEST(asio, logger_service_destroy_under_load)
+{
+    const char* path = "logger_service_test.log";
+
+    // Large messages take long enough to copy into their slot that records of
+    // the short-lived loggers queue up behind a slot still being filled when
+    // those loggers are destroyed.
+    const int churn_threads = 3;
+    const int loggers_per_thread = 1000;
+    const int messages_per_logger = 10;
+    {
+        boost::asio::io_context io_context;
+        services::logger big(io_context, "big");
+        big.use_file(path);
+
+        std::atomic<bool> done(false);
+        std::thread big_thread([&big, &done]()
+            {
+                const std::string message(1 << 20, 'x');
+                for (int i = 0; i < 64 && !done.load(); ++i)
+                    big.log(message);
+            });
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < churn_threads; ++t)
+        {
+            threads.emplace_back([&io_context, t]()
+                {
+                    for (int l = 0; l < loggers_per_thread; ++l)
+                    {
+                        services::logger logger(io_context, "churn "
+                            + std::to_string(t) + "." + std::to_string(l));
+                        for (int i = 0; i < messages_per_logger; ++i)
+                            logger.log(std::to_string(i));
+                    }
+                });
+        }
+        for (std::thread& thread : threads)
+            thread.join();
+        done.store(true);
+        big_thread.join();
+    }
+
+    // Every churn message was written under its own logger's name.
+    std::size_t churn_lines = 0;
+    for (const std::string& line : read_lines(path))
+    {
+        if (line.compare(0, 5, "big: ") == 0)
+            continue;
+        int t = -1, l = -1, i = -1;
+        ASSERT_EQ(3, std::sscanf(line.c_str(), "churn %d.%d: %d", &t, &l, &i))
+            << line.substr(0, 80);
+        EXPECT_TRUE(t >= 0 && t < churn_threads && l >= 0
+            && l < loggers_per_thread && i >= 0 && i < messages_per_logger);
+        ++churn_lines;
+    }
+    EXPECT_EQ(std::size_t(churn_threads) * loggers_per_thread
+        * messages_per_logger, churn_lines);
+    std::remove(path);
+}
+
+namespace {
+
+// Log the same messages, deferred and as plain text, through one logger.
+void log_samples(services::logger& logger)
+{
+    static const services::log_format request("request {} from {} took {} ms");
+    static const services::log_format flags("{} {} {} {}");
+    logger.log(request, 42, std::string("10.0.0.1"), 1.5);
+    logger.log(flags, 'x', true, std::uint64_t(18446744073709551615ull), -7L);
+    logger.log(request, "only one");
+    logger.log("plain text");
+}
+
+const char* expected_samples[] =
+{
+    "samples: request 42 from 10.0.0.1 took 1.5 ms",
+    "samples: x true 18446744073709551615 -7",
+    "samples: request only one from {} took {} ms",
+    "samples: plain text"
+};
+
+} // namespace
+
+TEST(asio, logger_service_deferred)
+{
+    const char* path = "logger_service_test.log";
+    std::vector<std::string> expected(std::begin(expected_samples),
+        std::end(expected_samples));
+
+    // Formatted on the background thread.
+    {
+        boost::asio::io_context io_context;
+        services::logger logger(io_context, "samples");
+        logger.use_file(path);
+        log_samples(logger);
+    }
+    EXPECT_EQ(expected, read_lines(path));
+
+    // Written raw and formatted by the decoder.
+    {
+        boost::asio::io_context io_context;
+        services::logger logger(io_context, "samples");
+        logger.use_binary_file(path);
+        log_samples(logger);
+    }
+    {
+        std::ifstream in(path, std::ios::binary);
+        std::ostringstream out;
+        EXPECT_TRUE(services::decode_log(in, out));
+        std::istringstream lines(out.str());
+        std::vector<std::string> decoded;
+        std::string line;
+        while (std::getline(lines, line))
+            decoded.push_back(line);
+        EXPECT_EQ(expected, decoded);
+    }
+    std::remove(path);
+
+    // Cost on the caller's thread. Each round logs fewer messages than the
+    // ring holds and then lets the background thread catch up, so the time is
+    // the caller's alone; the best round is reported. Both halves of a round
+    // log the same lines, which the decoder must give back.
+    const int rounds = 20;
+    const int round_size = 1024;
+    double deferred_ns = 1e9, text_ns = 1e9;
+    {
+        boost::asio::io_context io_context;
+        boost::asio::execution_context& context = io_context;
+        boost::asio::use_service<services::logger_service>(context)
+            .set_flush_interval(std::chrono::milliseconds(1));
+        services::logger logger(io_context, "bench");
+        logger.use_binary_file(path);
+
+        static const services::log_format format("value {} of {} at {}");
+        for (int round = 0; round < rounds; ++round)
+        {
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < round_size; ++i)
+                logger.log(format, i, round_size, round);
+            std::chrono::duration<double, std::nano> deferred =
+                std::chrono::steady_clock::now() - start;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+            start = std::chrono::steady_clock::now();
+            for (int i = 0; i < round_size; ++i)
+                logger.log("value " + std::to_string(i) + " of "
+                    + std::to_string(round_size) + " at "
+                    + std::to_string(round));
+            std::chrono::duration<double, std::nano> text =
+                std::chrono::steady_clock::now() - start;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+            deferred_ns = std::min(deferred_ns, deferred.count() / round_size);
+            text_ns = std::min(text_ns, text.count() / round_size);
+        }
+    }
+    std::cout << "deferred: " << deferred_ns << " ns/message, formatted: "
+        << text_ns << " ns/message" << std::endl;
+
+    {
+        std::ifstream in(path, std::ios::binary);
+        std::ostringstream out;
+        EXPECT_TRUE(services::decode_log(in, out));
+        std::istringstream lines(out.str());
+        std::string line;
+        std::size_t count = 0, mismatches = 0;
+        for (int round = 0; round < rounds; ++round)
+        {
+            for (int half = 0; half < 2; ++half)
+            {
+                for (int i = 0; i < round_size; ++i)
+                {
+                    if (!std::getline(lines, line))
+                        break;
+                    ++count;
+                    if (line != "bench: value " + std::to_string(i) + " of "
+                        + std::to_string(round_size) + " at "
+                        + std::to_string(round))
+                        ++mismatches;
+                }
+            }
+        }
+        EXPECT_EQ(std::size_t(2 * rounds * round_size), count);
+        EXPECT_EQ(0u, mismatches);
+        EXPECT_FALSE(std::getline(lines, line));
+    }
+    std::remove(path);
+}
+
+#if !defined(BOOST_ASIO_WINDOWS)
+
+TEST(asio, logger_service_mapped)
+{
+    const char* base = "logger_service_test.mapped";
+    const int message_count = 20000;
+
+    // Small segments so that the log rotates several times, synced after
+    // every batch.
+    services::mapped_file_options options;
+    options.segment_size = 64 * 1024;
+    options.sync = services::mapped_file_options::sync_per_batch;
+    {
+        boost::asio::io_context io_context;
+        services::logger logger(io_context, "mapped");
+        logger.use_mapped_file(base, options);
+        for (int i = 0; i < message_count; ++i)
+            logger.log("message " + std::to_string(i));
+    }
+
+    // Every segment but the last is full; the last is trimmed to its data.
+    std::string text;
+    std::size_t segments = 0;
+    for (;; ++segments)
+    {
+        char path[64];
+        std::snprintf(path, sizeof(path), "%s.%06lu", base,
+            static_cast<unsigned long>(segments));
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+            break;
+        std::string segment((std::istreambuf_iterator<char>(in)),
+            std::istreambuf_iterator<char>());
+        in.close();
+        std::remove(path);
+        if (segments > 0)
+        {
+            EXPECT_EQ(options.segment_size, text.size() / segments);
+        }
+        text += segment;
+    }
+    EXPECT_GT(segments, 3u);
+
+    std::istringstream lines(text);
+    std::string line;
+    int next = 0;
+    while (std::getline(lines, line))
+        ASSERT_EQ("mapped: message " + std::to_string(next++), line);
+    EXPECT_EQ(message_count, next);
+
+    // Throughput of the two backends with the background thread writing
+    // flat out.
+    services::mapped_file_options bench_options;
+    bench_options.segment_size = 8 << 20;
+    for (int mapped = 0; mapped < 2; ++mapped)
+    {
+        auto start = std::chrono::steady_clock::now();
+        {
+            boost::asio::io_context io_context;
+            services::logger logger(io_context, "bench");
+            if (mapped)
+                logger.use_mapped_file(base, bench_options);
+            else
+                logger.use_file(base);
+            static const services::log_format format("message {} of {}");
+            for (int i = 0; i < 1000000; ++i)
+                logger.log(format, i, 1000000);
+        }
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        std::cout << (mapped ? "mapped: " : "ofstream: ")
+            << 1000000 / elapsed.count() << " messages/s" << std::endl;
+        for (int i = 0; mapped && i < 8; ++i)
+        {
+            char path[64];
+            std::snprintf(path, sizeof(path), "%s.%06d", base, i);
+            std::remove(path);
+        }
+        if (!mapped)
+            std::remove(base);
+    }
+}
+
+#endif // !defined(BOOST_ASIO_WINDOWS)
+
+#if defined(__linux__)
+
+namespace {
+
+std::size_t resident_bytes()
+{
+    std::ifstream statm("/proc/self/statm");
+    std::size_t pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+}
+
+struct overload_result
+{
+    std::size_t written = 0;
+    std::uint64_t dropped = 0;
+    std::size_t warnings_written = 0;
+    double log_seconds = 0;
+    std::size_t resident_growth = 0;
+};
+
+// Log message_count messages, every tenth a warning, into a FIFO whose reader
+// stalls for the first stall_time. Every line the reader gets is either a
+// message or a report of dropped messages.
+overload_result run_overload(services::overload_policy policy,
+    int message_count, std::chrono::milliseconds stall_time)
+{
+    const char* path = "logger_service_test.fifo";
+    std::remove(path);
+    EXPECT_EQ(0, ::mkfifo(path, 0600));
+
+    overload_result result;
+    std::thread reader([&]()
+        {
+            std::ifstream in(path);
+            std::this_thread::sleep_for(stall_time);
+            std::string line;
+            while (std::getline(in, line))
+            {
+                unsigned long long dropped = 0;
+                if (std::sscanf(line.c_str(), "overload: dropped %llu", &dropped) == 1)
+                {
+                    result.dropped += dropped;
+                    continue;
+                }
+                ++result.written;
+                if (line.find("warning") != std::string::npos)
+                    ++result.warnings_written;
+            }
+        });
+
+    {
+        boost::asio::io_context io_context;
+        boost::asio::execution_context& context = io_context;
+        boost::asio::use_service<services::logger_service>(context)
+            .set_overload_policy(policy, services::severity_warning);
+        services::logger logger(io_context, "overload");
+        logger.use_file(path);
+
+        static const services::log_format format("message {} {}");
+        std::size_t resident_before = resident_bytes();
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < message_count; ++i)
+        {
+            if (i % 10 == 0)
+                logger.log(services::severity_warning, format, i, "warning");
+            else
+                logger.log(services::severity_info, format, i, "info");
+        }
+        result.log_seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+        std::size_t resident_after = resident_bytes();
+        result.resident_growth = resident_after > resident_before
+            ? resident_after - resident_before : 0;
+    }
+    reader.join();
+    std::remove(path);
+    return result;
+}
+
+} // namespace
+
+TEST(asio, logger_service_overload)
+{
+    const int message_count = 500000;
+    const std::chrono::milliseconds stall_time(300);
+    struct
+    {
+        const char* name;
+        services::overload_policy policy;
+    } policies[] =
+    {
+        { "block", services::overload_block },
+        { "drop newest", services::overload_drop_newest },
+        { "drop oldest", services::overload_drop_oldest },
+        { "drop below warning", services::overload_drop_below_severity }
+    };
+
+    for (auto& p : policies)
+    {
+        overload_result r = run_overload(p.policy, message_count, stall_time);
+        std::cout << p.name << ": logged in " << r.log_seconds << "s, "
+            << r.written << " written, " << r.dropped << " dropped, "
+            << r.resident_growth / 1024 << " KB resident growth" << std::endl;
+
+        // Nothing is lost without being accounted for, and the ring keeps
+        // memory flat however far the sink falls behind.
+        EXPECT_EQ(std::size_t(message_count), r.written + r.dropped);
+        EXPECT_LT(r.resident_growth, std::size_t(16) << 20);
+
+        switch (p.policy)
+        {
+        case services::overload_block:
+            EXPECT_EQ(0u, r.dropped);
+            break;
+        case services::overload_drop_below_severity:
+            EXPECT_EQ(std::size_t(message_count / 10), r.warnings_written);
+            EXPECT_GT(r.dropped, 0u);
+            break;
+        default:
+            EXPECT_GT(r.dropped, 0u);
+            EXPECT_LT(r.log_seconds, stall_time.count() / 1000.0);
+            break;
+        }
+    }
+}
+
+#endif // defined(__linux__)
@@ -0,0 +1,632 @@
+//
+// uring_queue.hpp
+// ~~~~~~~~~~~~~~~
+//
+
+#ifndef URING_QUEUE_HPP
+#define URING_QUEUE_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  define URING_QUEUE_HAS_IO_URING 1
+# endif
+#endif
+
+#if defined(URING_QUEUE_HAS_IO_URING)
+# include <cerrno>
+# include <cstring>
+# include <linux/io_uring.h>
+# include <sys/eventfd.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <sys/uio.h>
+# include <unistd.h>
+#endif // defined(URING_QUEUE_HAS_IO_URING)
+
+// Reads and writes through an io_uring instance, driven from an io_context.
+//
+// Operations are written to the submission ring as they are started and handed
+// to the kernel together, with one io_uring_enter call per turn of the
+// io_context, however many sockets and files they touch. Completions are
+// announced through an eventfd that the io_context waits on like any other
+// descriptor, so handlers run on the io_context's threads as usual.
+//
+// The queue owns a pool of equally sized buffers that are registered with the
+// kernel once, so fixed reads and writes into them skip the page pinning and
+// unpinning a plain read or write pays on every call.
+//
+// The ring is set up with raw system calls, so no liburing is needed. When the
+// headers are missing, or the kernel refuses to create a ring (too old, or
+// io_uring disabled by sysctl or a seccomp policy), is_open() returns false
+// and callers are expected to take their reactor-based path instead.
+//
+// A uring_queue must be used from one thread at a time, and destroyed only
+// while its io_context is not running. Destroying it cancels the operations
+// still in flight and waits for the kernel to finish with their buffers; their
+// handlers are destroyed without being called.
+class uring_queue
+{
+public:
+  uring_queue(boost::asio::io_context& io_context, unsigned entries,
+      std::size_t buffer_size, std::size_t buffer_count)
+    : io_context_(io_context),
+      buffer_size_(buffer_size),
+      storage_(new char[buffer_size * buffer_count])
+  {
+    for (std::size_t i = buffer_count; i > 0; --i)
+      free_buffers_.push_back(static_cast<int>(i - 1));
+    open(entries, buffer_count);
+  }
+
+  uring_queue(const uring_queue&) = delete;
+  uring_queue& operator=(const uring_queue&) = delete;
+
+  ~uring_queue()
+  {
+    *self_ = 0;
+    close();
+  }
+
+  // Whether operations go through io_uring. If not, starting one fails with
+  // operation_not_supported.
+  bool is_open() const
+  {
+    return ring_fd_ != -1;
+  }
+
+  // Take a registered buffer from the pool. Returns -1 if none is left.
+  int acquire_buffer()
+  {
+    if (free_buffers_.empty())
+      return -1;
+    int index = free_buffers_.back();
+    free_buffers_.pop_back();
+    return index;
+  }
+
+  void release_buffer(int index)
+  {
+    free_buffers_.push_back(index);
+  }
+
+  boost::asio::mutable_buffer buffer(int index)
+  {
+    return boost::asio::buffer(storage_.get() + index * buffer_size_,
+        buffer_size_);
+  }
+
+  // Read into (part of) registered buffer buffer_index. The offset is the
+  // position in the file and is ignored for sockets and pipes. Completes with
+  // error::eof when nothing is left to read.
+  template <typename Handler>
+  void async_read_fixed(int fd, const boost::asio::mutable_buffer& buffer,
+      int buffer_index, std::uint64_t offset, Handler handler);
+
+  // Write (part of) registered buffer buffer_index. The write may be short.
+  template <typename Handler>
+  void async_write_fixed(int fd, const boost::asio::const_buffer& buffer,
+      int buffer_index, std::uint64_t offset, Handler handler);
+
+private:
+  // An operation waiting for its completion entry. Outstanding operations are
+  // kept on a list so that those still in flight are freed with the queue.
+  class op
+  {
+  public:
+    op() : prev_(0), next_(0) {}
+    virtual ~op() {}
+    virtual void complete(int result) = 0;
+
+    op* prev_;
+    op* next_;
+  };
+
+  template <typename Handler>
+  class handler_op : public op
+  {
+  public:
+    handler_op(uring_queue& queue, Handler& handler, bool is_read)
+      : queue_(queue), handler_(std::move(handler)), is_read_(is_read)
+    {
+    }
+
+    void complete(int result)
+    {
+      // Free the operation before the upcall, so the handler can start the
+      // next one without growing the list.
+      queue_.unlink(this);
+      Handler handler(std::move(handler_));
+      bool is_read = is_read_;
+      delete this;
+
+      boost::system::error_code ec;
+      std::size_t bytes = 0;
+      if (result < 0)
+        ec = boost::system::error_code(-result,
+            boost::asio::error::get_system_category());
+      else if (result == 0 && is_read)
+        ec = boost::asio::error::eof;
+      else
+        bytes = static_cast<std::size_t>(result);
+      handler(ec, bytes);
+    }
+
+  private:
+    uring_queue& queue_;
+    Handler handler_;
+    bool is_read_;
+  };
+
+  void link(op* o)
+  {
+    o->next_ = ops_;
+    if (ops_)
+      ops_->prev_ = o;
+    ops_ = o;
+  }
+
+  void unlink(op* o)
+  {
+    if (o->prev_)
+      o->prev_->next_ = o->next_;
+    else
+      ops_ = o->next_;
+    if (o->next_)
+      o->next_->prev_ = o->prev_;
+  }
+
+  template <typename Handler>
+  void fail(Handler& handler, const boost::system::error_code& ec)
+  {
+    boost::asio::post(io_context_,
+        std::bind(std::move(handler), ec, std::size_t(0)));
+  }
+
+#if defined(URING_QUEUE_HAS_IO_URING)
+  template <typename Handler>
+  void start(std::uint8_t opcode, int fd, const void* data, std::size_t size,
+      int buffer_index, std::uint64_t offset, Handler& handler)
+  {
+    if (!is_open())
+    {
+      fail(handler, boost::asio::error::operation_not_supported);
+      return;
+    }
+
+    io_uring_sqe* sqe = next_sqe();
+    if (!sqe)
+    {
+      fail(handler, boost::asio::error::no_buffer_space);
+      return;
+    }
+
+    op* o = new handler_op<Handler>(*this, handler,
+        opcode == IORING_OP_READ_FIXED);
+    link(o);
+    if (!waiting_)
+      wait_for_completions();
+
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = reinterpret_cast<std::uint64_t>(data);
+    sqe->len = static_cast<std::uint32_t>(size);
+    sqe->buf_index = static_cast<std::uint16_t>(buffer_index);
+    sqe->user_data = reinterpret_cast<std::uint64_t>(o);
+
+    // Hand everything started during this turn to the kernel at once. Reads
+    // that find data waiting complete during the submission, so pick their
+    // results up straight away rather than after a trip through the eventfd.
+    if (!flush_scheduled_)
+    {
+      flush_scheduled_ = true;
+      std::shared_ptr<uring_queue*> self(self_);
+      boost::asio::post(io_context_,
+          [self]()
+          {
+            if (uring_queue* queue = *self)
+            {
+              queue->flush();
+              queue->reap();
+            }
+          });
+    }
+  }
+
+  static int sys_setup(unsigned entries, io_uring_params* params)
+  {
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+  }
+
+  static int sys_enter(int fd, unsigned to_submit, unsigned min_complete = 0,
+      unsigned flags = 0)
+  {
+    return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit,
+          min_complete, flags, static_cast<void*>(0), 0));
+  }
+
+  static int sys_register(int fd, unsigned opcode, const void* arg,
+      unsigned count)
+  {
+    return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode,
+          arg, count));
+  }
+
+  void open(unsigned entries, std::size_t buffer_count)
+  {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    ring_fd_ = sys_setup(entries, &params);
+    if (ring_fd_ < 0)
+    {
+      ring_fd_ = -1;
+      return;
+    }
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes
+      + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap)
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+
+    sq_ring_ = map(sq_ring_size_, IORING_OFF_SQ_RING);
+    cq_ring_ = single_mmap ? sq_ring_ : map(cq_ring_size_, IORING_OFF_CQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = static_cast<io_uring_sqe*>(map(sqes_size_, IORING_OFF_SQES));
+    if (!sq_ring_ || !cq_ring_ || !sqes_)
+    {
+      close();
+      return;
+    }
+
+    char* sq = static_cast<char*>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    unsigned* sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    for (unsigned i = 0; i < sq_entries_; ++i)
+      sq_array[i] = i;
+    sqe_tail_ = submitted_ = *sq_tail_;
+
+    char* cq = static_cast<char*>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    std::vector<iovec> iov(buffer_count);
+    for (std::size_t i = 0; i < buffer_count; ++i)
+    {
+      iov[i].iov_base = storage_.get() + i * buffer_size_;
+      iov[i].iov_len = buffer_size_;
+    }
+    if (buffer_count > 0 && sys_register(ring_fd_, IORING_REGISTER_BUFFERS,
+          iov.data(), static_cast<unsigned>(iov.size())) != 0)
+    {
+      close();
+      return;
+    }
+
+    // The kernel signals the eventfd whenever it posts a completion.
+    int event_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd == -1 || sys_register(ring_fd_, IORING_REGISTER_EVENTFD,
+          &event_fd, 1) != 0)
+    {
+      if (event_fd != -1)
+        ::close(event_fd);
+      close();
+      return;
+    }
+    event_.assign(event_fd);
+  }
+
+  void* map(std::size_t size, std::uint64_t offset)
+  {
+    void* p = ::mmap(0, size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring_fd_, static_cast<off_t>(offset));
+    return p == MAP_FAILED ? 0 : p;
+  }
+
+  void close()
+  {
+    boost::system::error_code ignored_ec;
+    event_.close(ignored_ec);
+
+    // Operations whose completions were deferred are finished already.
+    for (std::size_t i = 0; i < deferred_.size(); ++i)
+    {
+      op* o = reinterpret_cast<op*>(deferred_[i].user_data);
+      unlink(o);
+      delete o;
+    }
+    deferred_.clear();
+
+    // Fixed reads and writes still in flight use the registered buffers, and
+    // closing the ring does not stop them before storage_ is freed. Cancel
+    // them and wait until they are done. If the ring cannot be driven any
+    // more, leak the buffers rather than hand pages the kernel may still
+    // write to back to the allocator.
+    if (ops_ && !cancel_all())
+      static_cast<void>(storage_.release());
+
+    if (sqes_)
+      ::munmap(sqes_, sqes_size_);
+    if (cq_ring_ && cq_ring_ != sq_ring_)
+      ::munmap(cq_ring_, cq_ring_size_);
+    if (sq_ring_)
+      ::munmap(sq_ring_, sq_ring_size_);
+    sqes_ = 0;
+    sq_ring_ = cq_ring_ = 0;
+
+    if (ring_fd_ != -1)
+      ::close(ring_fd_);
+    ring_fd_ = -1;
+
+    while (ops_)
+    {
+      op* o = ops_;
+      unlink(o);
+      delete o;
+    }
+  }
+
+  // Cancel every outstanding operation and wait for all of them to complete,
+  // destroying their handlers without calling them. Operations started but not
+  // yet submitted go to the kernel along with the cancellations. Returns false
+  // if io_uring_enter fails.
+  bool cancel_all()
+  {
+    std::vector<op*> outstanding;
+    for (op* o = ops_; o; o = o->next_)
+      outstanding.push_back(o);
+
+    for (std::size_t i = 0; i < outstanding.size(); ++i)
+    {
+      while (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE)
+          >= sq_entries_)
+        if (!submit_and_discard(0))
+          return false;
+
+      // A cancellation completes with user_data 0, which names no operation.
+      io_uring_sqe* sqe = &sqes_[sqe_tail_++ & sq_mask_];
+      std::memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = -1;
+      sqe->addr = reinterpret_cast<std::uint64_t>(outstanding[i]);
+      sqe->user_data = 0;
+    }
+
+    while (ops_)
+      if (!submit_and_discard(1))
+        return false;
+    return true;
+  }
+
+  // Submit whatever is queued, waiting for at least min_complete completions,
+  // and free the operations that completed without calling their handlers.
+  bool submit_and_discard(unsigned min_complete)
+  {
+    __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+    int result = sys_enter(ring_fd_, sqe_tail_ - submitted_, min_complete,
+        min_complete ? IORING_ENTER_GETEVENTS : 0);
+    if (result > 0)
+      submitted_ += result;
+    else if (result < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      return false;
+
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head)
+    {
+      if (op* o = reinterpret_cast<op*>(cqes_[head & cq_mask_].user_data))
+      {
+        unlink(o);
+        delete o;
+      }
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  io_uring_sqe* next_sqe()
+  {
+    if (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+    {
+      // The submission ring is full: submit now rather than at the end of
+      // the turn.
+      flush();
+      if (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE)
+          >= sq_entries_)
+        return 0;
+    }
+    return &sqes_[sqe_tail_++ & sq_mask_];
+  }
+
+  void flush()
+  {
+    flush_scheduled_ = false;
+    if (!is_open())
+      return;
+
+    __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+    while (submitted_ != sqe_tail_)
+    {
+      int result = sys_enter(ring_fd_, sqe_tail_ - submitted_);
+      if (result > 0)
+      {
+        submitted_ += result;
+      }
+      else if (result < 0 && (errno == EAGAIN || errno == EBUSY))
+      {
+        // The completion ring is full. Make room and try again. flush() is
+        // reached from start(), so the handlers must not run here.
+        defer_completions();
+      }
+      else if (result < 0 && errno != EINTR)
+      {
+        boost::asio::detail::throw_error(boost::system::error_code(errno,
+              boost::asio::error::get_system_category()), "io_uring_enter");
+      }
+    }
+  }
+
+  // The eventfd is only waited on while operations are outstanding, so that
+  // an idle queue does not keep io_context::run() from returning.
+  void wait_for_completions()
+  {
+    waiting_ = true;
+    std::shared_ptr<uring_queue*> self(self_);
+    event_.async_wait(boost::asio::posix::stream_descriptor::wait_read,
+        [self](const boost::system::error_code& ec)
+        {
+          uring_queue* queue = *self;
+          if (!queue)
+            return;
+          queue->waiting_ = false;
+          if (ec)
+            return;
+
+          std::uint64_t count;
+          while (::read(queue->event_.native_handle(), &count, sizeof(count))
+              > 0)
+          {
+          }
+          queue->reap();
+          if (queue->ops_ && !queue->waiting_)
+            queue->wait_for_completions();
+        });
+  }
+
+  // Take the completions off the ring and post their handlers, for callers
+  // inside an initiating function.
+  void defer_completions()
+  {
+    bool was_empty = deferred_.empty();
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head)
+      deferred_.push_back(cqes_[head & cq_mask_]);
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+    if (was_empty && !deferred_.empty())
+    {
+      std::shared_ptr<uring_queue*> self(self_);
+      boost::asio::post(io_context_,
+          [self]()
+          {
+            uring_queue* queue = *self;
+            if (!queue)
+              return;
+            std::vector<io_uring_cqe> cqes;
+            cqes.swap(queue->deferred_);
+            for (std::size_t i = 0; i < cqes.size(); ++i)
+              reinterpret_cast<op*>(cqes[i].user_data)->complete(cqes[i].res);
+          });
+    }
+  }
+
+  void reap()
+  {
+    unsigned head = *cq_head_;
+    while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+    {
+      io_uring_cqe cqe = cqes_[head & cq_mask_];
+      __atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+      reinterpret_cast<op*>(cqe.user_data)->complete(cqe.res);
+      head = *cq_head_;
+    }
+  }
+#else // defined(URING_QUEUE_HAS_IO_URING)
+  template <typename Handler>
+  void start(int /*opcode*/, int /*fd*/, const void* /*data*/,
+      std::size_t /*size*/, int /*buffer_index*/, std::uint64_t /*offset*/,
+      Handler& handler)
+  {
+    fail(handler, boost::asio::error::operation_not_supported);
+  }
+
+  void open(unsigned /*entries*/, std::size_t /*buffer_count*/)
+  {
+  }
+
+  void close()
+  {
+  }
+#endif // defined(URING_QUEUE_HAS_IO_URING)
+
+  boost::asio::io_context& io_context_;
+  std::size_t buffer_size_;
+  std::unique_ptr<char[]> storage_;
+  std::vector<int> free_buffers_;
+  op* ops_ = 0;
+  int ring_fd_ = -1;
+  bool flush_scheduled_ = false;
+  bool waiting_ = false;
+
+  // Handlers the queue posts or waits with hold this and do nothing once the
+  // queue is gone, as they may still be queued in the io_context then.
+  std::shared_ptr<uring_queue*> self_ = std::make_shared<uring_queue*>(this);
+
+#if defined(URING_QUEUE_HAS_IO_URING)
+  boost::asio::posix::stream_descriptor event_{io_context_};
+  void* sq_ring_ = 0;
+  void* cq_ring_ = 0;
+  io_uring_sqe* sqes_ = 0;
+  std::size_t sq_ring_size_ = 0;
+  std::size_t cq_ring_size_ = 0;
+  std::size_t sqes_size_ = 0;
+  unsigned* sq_head_ = 0;
+  unsigned* sq_tail_ = 0;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned sqe_tail_ = 0;
+  unsigned submitted_ = 0;
+  unsigned* cq_head_ = 0;
+  unsigned* cq_tail_ = 0;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe* cqes_ = 0;
+
+  // Completions taken off the ring whose handlers have been posted.
+  std::vector<io_uring_cqe> deferred_;
+#endif // defined(URING_QUEUE_HAS_IO_URING)
+};
+
+template <typename Handler>
+inline void uring_queue::async_read_fixed(int fd,
+    const boost::asio::mutable_buffer& buffer, int buffer_index,
+    std::uint64_t offset, Handler handler)
+{
+#if defined(URING_QUEUE_HAS_IO_URING)
+  start(IORING_OP_READ_FIXED, fd, buffer.data(), buffer.size(),
+      buffer_index, offset, handler);
+#else // defined(URING_QUEUE_HAS_IO_URING)
+  start(0, fd, buffer.data(), buffer.size(), buffer_index, offset, handler);
+#endif // defined(URING_QUEUE_HAS_IO_URING)
+}
+
+template <typename Handler>
+inline void uring_queue::async_write_fixed(int fd,
+    const boost::asio::const_buffer& buffer, int buffer_index,
+    std::uint64_t offset, Handler handler)
+{
+#if defined(URING_QUEUE_HAS_IO_URING)
+  start(IORING_OP_WRITE_FIXED, fd, buffer.data(), buffer.size(),
+      buffer_index, offset, handler);
+#else // defined(URING_QUEUE_HAS_IO_URING)
+  start(0, fd, buffer.data(), buffer.size(), buffer_index, offset, handler);
+#endif // defined(URING_QUEUE_HAS_IO_URING)
+}
+
+#endif // URING_QUEUE_HPP